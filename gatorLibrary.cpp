@@ -4,34 +4,326 @@
 #include <ctime>
 #include <regex>
 #include <climits>
+#include <cmath>
 #include <fstream>
 #include <sstream>
+#include <new>
+#include <cstring>
+#include <map>
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-// Stores the patron ID, priority number and time of Reservation
+// Non owning view of characters inside the input buffer.
+struct StringRef {
+    const char *data;
+    size_t length;
+
+    StringRef() : data(NULL), length(0) {}
+    StringRef(const char *data, size_t length) : data(data), length(length) {}
+
+    string str() const { return string(data, length); }
+};
+
+// Ordering two strings byte by byte, returning <0, 0 or >0.
+static int compareText(StringRef a, StringRef b) {
+    int c = memcmp(a.data, b.data, a.length < b.length ? a.length : b.length);
+    if (c != 0)
+        return c;
+    return a.length < b.length ? -1 : (a.length > b.length ? 1 : 0);
+}
+
+static bool startsWith(StringRef text, StringRef prefix) {
+    return text.length >= prefix.length && memcmp(text.data, prefix.data, prefix.length) == 0;
+}
+
+// Text of a title or author name as catalog searches see it: without the surrounding quotes it was
+// given with.
+static StringRef searchText(const string &s) {
+    if (s.size() >= 2 && s[0] == '"' && s[s.size() - 1] == '"')
+        return StringRef(s.data() + 1, s.size() - 2);
+    return StringRef(s.data(), s.size());
+}
+
+// Output sink for everything the library prints. Text is appended to one large reusable buffer that
+// is written out in big blocks, so no command forces a flush. Payloads larger than the free space go out
+// together with the buffered bytes in a single writev. The destination is any file descriptor: a file
+// opened by path, stdout, or a descriptor owned by the caller.
+class OutputBuffer {
+private:
+    static const size_t DEFAULT_CAPACITY = 1 << 20;
+
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    int fd;
+    bool ownsFd;
+    bool failed;
+    bool inMemory;
+
+    OutputBuffer(const OutputBuffer &);
+    OutputBuffer &operator=(const OutputBuffer &);
+
+    // Writing every byte described by the iovecs, retrying partial writes.
+    void writeAll(struct iovec *iov, int count) {
+        while (count > 0) {
+            ssize_t n = writev(fd, iov, count);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                failed = true;
+                return;
+            }
+            while (count > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+    }
+
+    void grow(size_t needed) {
+        size_t newCapacity = max(capacity * 2, needed);
+        char *larger = new char[newCapacity];
+        memcpy(larger, buffer, used);
+        delete[] buffer;
+        buffer = larger;
+        capacity = newCapacity;
+    }
+
+    template <typename Unsigned>
+    void appendUnsigned(Unsigned value) {
+        char digits[24];
+        char *p = digits + sizeof(digits);
+        do {
+            *--p = (char)('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        append(p, digits + sizeof(digits) - p);
+    }
+
+    template <typename Signed, typename Unsigned>
+    void appendSigned(Signed value) {
+        if (value < 0) {
+            append('-');
+            appendUnsigned((Unsigned)(0 - (Unsigned)value));
+        } else {
+            appendUnsigned((Unsigned)value);
+        }
+    }
+
+public:
+    explicit OutputBuffer(int fd = -1, bool ownsFd = false, size_t capacity = DEFAULT_CAPACITY)
+        : buffer(new char[capacity]), capacity(capacity), used(0), fd(fd), ownsFd(ownsFd), failed(false), inMemory(false) {}
+
+    ~OutputBuffer() {
+        close();
+        delete[] buffer;
+    }
+
+    // Sending output to a newly created (or truncated) file.
+    bool open(const string &path) {
+        close();
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ownsFd = true;
+        failed = false;
+        return fd >= 0;
+    }
+
+    // Sending output to a descriptor; stdout is STDOUT_FILENO.
+    void attach(int newFd, bool owns = false) {
+        close();
+        fd = newFd;
+        ownsFd = owns;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    // False once any write to the destination has failed.
+    bool good() const { return !failed; }
+
+    // Keeping everything appended in memory, growing the buffer as needed, until it is read through data()
+    // and size() and emptied with clear(). Collects the output of commands run on worker threads.
+    void collectInMemory() {
+        close();
+        inMemory = true;
+    }
+
+    const char *data() const { return buffer; }
+    size_t size() const { return used; }
+    void clear() { used = 0; }
+
+    // Exchanging contents and storage with another in-memory buffer, handing over what was collected.
+    void swapContents(OutputBuffer &other) {
+        std::swap(buffer, other.buffer);
+        std::swap(capacity, other.capacity);
+        std::swap(used, other.used);
+    }
+
+    // Writing out the buffered bytes. Without a destination they are discarded.
+    void flush() {
+        if (used == 0 || inMemory)
+            return;
+        if (fd < 0) {
+            used = 0;
+            return;
+        }
+        struct iovec iov;
+        iov.iov_base = buffer;
+        iov.iov_len = used;
+        writeAll(&iov, 1);
+        used = 0;
+    }
+
+    // Writing out the buffered bytes and waiting until the destination has them on stable storage.
+    bool sync() {
+        flush();
+        if (fd >= 0 && !failed && fdatasync(fd) != 0)
+            failed = true;
+        return !failed;
+    }
+
+    void close() {
+        flush();
+        if (ownsFd && fd >= 0 && ::close(fd) != 0)
+            failed = true;
+        fd = -1;
+        ownsFd = false;
+    }
+
+    void append(const char *data, size_t length) {
+        if (inMemory && used + length > capacity)
+            grow(used + length);
+        if (used + length <= capacity) {
+            memcpy(buffer + used, data, length);
+            used += length;
+            return;
+        }
+        if (length < capacity / 2) {
+            flush();
+            memcpy(buffer + used, data, length);
+            used += length;
+            return;
+        }
+        if (fd < 0)
+            return;
+        struct iovec iov[2];
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = used;
+        iov[1].iov_base = const_cast<char*>(data);
+        iov[1].iov_len = length;
+        writeAll(iov, 2);
+        used = 0;
+    }
+
+    void append(char c) {
+        if (used == capacity) {
+            if (inMemory)
+                grow(used + 1);
+            else
+                flush();
+        }
+        buffer[used++] = c;
+    }
+
+    OutputBuffer &operator<<(const char *text) { append(text, strlen(text)); return *this; }
+    OutputBuffer &operator<<(const string &text) { append(text.data(), text.size()); return *this; }
+    OutputBuffer &operator<<(const StringRef &text) { append(text.data, text.length); return *this; }
+    OutputBuffer &operator<<(char c) { append(c); return *this; }
+    OutputBuffer &operator<<(int value) { appendSigned<int, unsigned>(value); return *this; }
+    OutputBuffer &operator<<(long value) { appendSigned<long, unsigned long>(value); return *this; }
+    OutputBuffer &operator<<(long long value) { appendSigned<long long, unsigned long long>(value); return *this; }
+    OutputBuffer &operator<<(unsigned value) { appendUnsigned(value); return *this; }
+    OutputBuffer &operator<<(unsigned long value) { appendUnsigned(value); return *this; }
+    OutputBuffer &operator<<(unsigned long long value) { appendUnsigned(value); return *this; }
+};
+
+// Number of reservations one book can hold. The spec caps a waitlist at 20; builds may override it.
+#ifndef GATOR_RESERVATION_CAPACITY
+#define GATOR_RESERVATION_CAPACITY 20
+#endif
+
+// Stores the patron ID, priority number and the order in which the reservation was made
 class ReservationNode {
 public:
     int patronID;
     int priorityNumber;
-    time_t timeOfReservation;
+    uint32_t sequence;
 
-    ReservationNode(int id, int priority, time_t timeOfReservation = time(0)) : patronID(id), priorityNumber(priority) {}
+    ReservationNode(int id, int priority, uint32_t sequence = 0) : patronID(id), priorityNumber(priority), sequence(sequence) {}
 };
 
-// This is the min heap that stores the reservationNode
+// This is the min heap that stores the reservations of one book. The entries live inline, so a waitlist
+// never allocates. Entries are ordered by a single 64-bit key: the priority number in the high half (sign
+// bit flipped so negative numbers still sort first) and the heap's own reservation sequence number in the low
+// half, which serves equal priorities first come first served. Before the sequence would run out, the live
+// entries are renumbered 0, 1, 2, ... in their existing order.
+//
+// The heap is indexed: every reservation gets a handle that stays fixed while the entry moves, and the
+// position of each handle is tracked, so a reservation can be cancelled or reprioritized in O(log n)
+// without searching. handleAt[0..count) are the live handles in heap order and handleAt[count..CAPACITY)
+// the free ones, so handing out and recycling handles needs no free list.
 class ReservationHeap {
+public:
+    static const int CAPACITY = GATOR_RESERVATION_CAPACITY;
+
 private:
-    vector<ReservationNode> heap;
+    static_assert(CAPACITY > 0 && CAPACITY <= 256, "reservation handles are stored in one byte");
+
+    uint64_t keys[CAPACITY];
+    int patrons[CAPACITY];
+    uint8_t handleAt[CAPACITY];     // heap position -> handle
+    uint8_t positionOf[CAPACITY];   // handle -> heap position
+    int count;
+    uint32_t nextSequence;          // above every live sequence number, unless it reached UINT32_MAX
+
+    static uint64_t makeKey(int priorityNumber, uint32_t sequence) {
+        return ((uint64_t)((uint32_t)priorityNumber ^ 0x80000000u) << 32) | sequence;
+    }
+
+    void swapEntries(int a, int b) {
+        std::swap(keys[a], keys[b]);
+        std::swap(patrons[a], patrons[b]);
+        std::swap(handleAt[a], handleAt[b]);
+        positionOf[handleAt[a]] = a;
+        positionOf[handleAt[b]] = b;
+    }
 
     // Helper function to maintain heap property
     void heapifyUp(int index) {
         while (index > 0) {
             int parent = (index - 1) / 2;
-            if (heap[index].priorityNumber < heap[parent].priorityNumber ||
-                (heap[index].priorityNumber == heap[parent].priorityNumber &&
-                 heap[index].timeOfReservation < heap[parent].timeOfReservation)) {
-                swap(heap[index], heap[parent]);
+            if (keys[index] < keys[parent]) {
+                swapEntries(index, parent);
                 index = parent;
             } else {
                 break;
@@ -41,86 +333,310 @@ private:
 
     // Helper function to maintain heap property
     void heapifyDown(int index) {
-        int left = 2 * index + 1;
-        int right = 2 * index + 2;
-        int smallest = index;
-        int n=heap.size();
+        while (true) {
+            int left = 2 * index + 1;
+            int right = 2 * index + 2;
+            int smallest = index;
 
-        if (left < n &&
-            (heap[left].priorityNumber < heap[smallest].priorityNumber ||
-             (heap[left].priorityNumber == heap[smallest].priorityNumber &&
-              heap[left].timeOfReservation < heap[smallest].timeOfReservation))) {
-            smallest = left;
+            if (left < count && keys[left] < keys[smallest]) {
+                smallest = left;
+            }
+            if (right < count && keys[right] < keys[smallest]) {
+                smallest = right;
+            }
+            if (smallest == index) {
+                break;
+            }
+            swapEntries(index, smallest);
+            index = smallest;
         }
+    }
 
-        if (right < n &&
-            (heap[right].priorityNumber < heap[smallest].priorityNumber ||
-             (heap[right].priorityNumber == heap[smallest].priorityNumber &&
-              heap[right].timeOfReservation < heap[smallest].timeOfReservation))) {
-            smallest = right;
+    // Numbering the live entries 0 .. count-1 in sequence order. Every comparison between keys comes out
+    // as before, so the heap order holds.
+    void renumber() {
+        int order[CAPACITY];
+        for (int i = 0; i < count; i++) {
+            order[i] = i;
         }
+        sort(order, order + count, [this](int a, int b) { return (uint32_t)keys[a] < (uint32_t)keys[b]; });
+        for (int i = 0; i < count; i++) {
+            keys[order[i]] = (keys[order[i]] & 0xFFFFFFFF00000000ULL) | (uint32_t)i;
+        }
+        nextSequence = count;
+    }
 
-        if (smallest != index) {
-            std::swap(heap[index], heap[smallest]);
-            heapifyDown(smallest);
+    // Placing a new entry at the end of the heap, returning its handle or -1 when the heap is full.
+    int append(int patronID, uint64_t key) {
+        if (count == CAPACITY) {
+            return -1;
         }
+        keys[count] = key;
+        patrons[count] = patronID;
+        return handleAt[count++];
     }
 
 public:
+    ReservationHeap() : count(0), nextSequence(0) {
+        for (int i = 0; i < CAPACITY; i++) {
+            handleAt[i] = positionOf[i] = i;
+        }
+    }
 
-    // Function to insert a new reservation node into the heap
-    void insertReservation(int patronID, int priorityNumber) {
-        ReservationNode newNode(patronID, priorityNumber);
-        heap.push_back(newNode);
-        heapifyUp(heap.size() - 1);
+    // Function to insert a new reservation node into the heap. Returns the handle of the reservation, or -1
+    // with the heap unchanged when it is full.
+    int insertReservation(int patronID, int priorityNumber) {
+        if (isFull()) {
+            return -1;
+        }
+        if (nextSequence == UINT32_MAX) {
+            renumber();
+        }
+        int handle = append(patronID, makeKey(priorityNumber, nextSequence++));
+        heapifyUp(count - 1);
+        return handle;
     }
 
     // Function to get the top (min) element from the heap
     ReservationNode extractMin() {
-        if (heap.empty()) {
+        if (count == 0) {
             throw std::out_of_range("Heap is empty");
         }
-        ReservationNode m=heap[0];
-        heap[0] = heap.back();
-        heap.pop_back();
-        heapifyDown(0);
+        ReservationNode m = entry(0);
+        remove(handleAt[0]);
         return m;
     }
 
+    // Function to remove the reservation with the given handle. The last entry fills its position and is
+    // sifted whichever way its key requires.
+    void remove(int handle) {
+        int position = positionOf[handle];
+        count--;
+        if (position != count) {
+            swapEntries(position, count);
+            int moved = handleAt[position];
+            heapifyUp(position);
+            heapifyDown(positionOf[moved]);
+        }
+    }
+
+    // Function to change the priority of the reservation with the given handle. It keeps its sequence
+    // number, so it still goes ahead of later reservations with the same priority.
+    void updatePriority(int handle, int priorityNumber) {
+        int position = positionOf[handle];
+        keys[position] = makeKey(priorityNumber, (uint32_t)keys[position]);
+        heapifyUp(position);
+        heapifyDown(positionOf[handle]);
+    }
+
     // Function to check if the heap is empty
     bool isEmpty() {
-        return heap.empty();
+        return count == 0;
+    }
+
+    // Function to check if the heap has reached its capacity
+    bool isFull() const {
+        return count == CAPACITY;
+    }
+
+    // Number of reservations in the heap.
+    int size() const {
+        return count;
+    }
+
+    // Reservation at the given position of the heap array.
+    ReservationNode entry(int index) const {
+        return ReservationNode(patrons[index], (int)((uint32_t)(keys[index] >> 32) ^ 0x80000000u), (uint32_t)keys[index]);
+    }
+
+    // Handle of the reservation at the given position of the heap array.
+    int handle(int index) const {
+        return handleAt[index];
+    }
+
+    // Appending a reservation that is already in heap order, used when restoring a saved heap array. Later
+    // reservations are numbered after the restored one. Returns the handle, or -1 when the heap is full.
+    int restore(const ReservationNode &node) {
+        int handle = append(node.patronID, makeKey(node.priorityNumber, node.sequence));
+        if (handle >= 0 && node.sequence >= nextSequence) {
+            nextSequence = node.sequence == UINT32_MAX ? UINT32_MAX : node.sequence + 1;
+        }
+        return handle;
     }
 
-    // Function to get a string of all the patrons that have reserved the book.
-    string getHeapString() const {
-        std::stringstream ss;
-        ss<<"[";
-        int count1=0;
-        int n=heap.size();
-        for (ReservationNode ele : heap) {
-            count1++;
-            ss << ele.patronID;
-            if(count1<n){
-               ss<< ", ";
+    // Function to write the IDs of all the patrons that have reserved the book, separated by commas.
+    void printPatrons(OutputBuffer &outputFile) const {
+        for (int i = 0; i < count; i++) {
+            if (i > 0) {
+                outputFile << ", ";
             }
+            outputFile << patrons[i];
         }
-        ss<<"]";
-        return ss.str();
     }
 };
 
+
 // Book Node structure
 struct BookNode {
     int BookId;
     string BookName;
-    string AuthorName;
+    const string *AuthorName;   // interned in the tree's AuthorTable
     bool AvailabilityStatus;
     int BorrowedBy;
     ReservationHeap reservationHeap;
 
-    BookNode(int id, string name, string author, bool available, int borrowedBy)
-        : BookId(id), BookName(name), AuthorName(author), AvailabilityStatus(available), BorrowedBy(borrowedBy) {}
+    BookNode(int id, string name, const string *author, bool available, int borrowedBy)
+        : BookId(id), BookName(std::move(name)), AuthorName(author), AvailabilityStatus(available), BorrowedBy(borrowedBy) {}
+};
+
+// Counters reported by the node allocators.
+struct AllocatorStats {
+    size_t liveNodes;      // objects currently handed out
+    size_t bytesLive;      // bytes used by live objects
+    size_t bytesReserved;  // bytes held in slabs (live + free slots)
+    size_t slabs;          // number of slabs allocated
+
+    AllocatorStats() : liveNodes(0), bytesLive(0), bytesReserved(0), slabs(0) {}
+
+    AllocatorStats &operator+=(const AllocatorStats &other) {
+        liveNodes += other.liveNodes;
+        bytesLive += other.bytesLive;
+        bytesReserved += other.bytesReserved;
+        slabs += other.slabs;
+        return *this;
+    }
+};
+
+// Runtime statistics: latencies of every command and counts of rotations and recolors. They cost a few
+// counter increments and two clock reads per command; build with -DGATOR_STATS=0 to compile them out. The
+// shape figures of Stats() are computed when asked for and are always available.
+#ifndef GATOR_STATS
+#define GATOR_STATS 1
+#endif
+
+// Log-linear latency histogram in nanoseconds: 64 power of two ranges split into 32 linear buckets,
+// which keeps the relative error of every reported percentile near 3%. The buckets are allocated by the
+// first sample, so histograms of commands that never run cost nothing.
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKETS = 32;
+    static const int RANGES = 64;
+    vector<unsigned long long> buckets;
+    unsigned long long total;
+    unsigned long long maxValue;
+
+    static int bucketOf(unsigned long long ns) {
+        if (ns < SUB_BUCKETS)
+            return (int)ns;
+        int log2 = 63 - __builtin_clzll(ns);
+        int shift = log2 - 5;
+        return (shift + 1) * SUB_BUCKETS + (int)((ns >> shift) - SUB_BUCKETS);
+    }
+
+    static unsigned long long valueOf(int bucket) {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        int shift = bucket / SUB_BUCKETS - 1;
+        return ((unsigned long long)(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift) + ((1ULL << shift) - 1);
+    }
+
+public:
+    LatencyHistogram() : total(0), maxValue(0) {}
+
+    void record(unsigned long long ns) {
+        if (buckets.empty())
+            buckets.assign(SUB_BUCKETS * RANGES, 0);
+        buckets[bucketOf(ns)]++;
+        total++;
+        if (ns > maxValue)
+            maxValue = ns;
+    }
+
+    unsigned long long count() const { return total; }
+
+    // Smallest recorded value such that the given fraction of samples is at or below it.
+    unsigned long long percentile(double fraction) const {
+        if (total == 0)
+            return 0;
+        unsigned long long needed = (unsigned long long)ceil(fraction * total);
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen >= needed && buckets[i] != 0)
+                return min(valueOf((int)i), maxValue);
+        }
+        return maxValue;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        if (other.buckets.empty())
+            return;
+        if (buckets.empty())
+            buckets.assign(SUB_BUCKETS * RANGES, 0);
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += other.buckets[i];
+        }
+        total += other.total;
+        maxValue = max(maxValue, other.maxValue);
+    }
+};
+
+// Which kind of update changed a node's color.
+enum RecolorCause {
+    RECOLOR_INSERT,   // insert fixup
+    RECOLOR_DELETE,   // deletion and its double black fixup
+    RECOLOR_BULK,     // balanced rebuilds and joins of bulk inserts and snapshot loads
+    RECOLOR_CAUSES
+};
+static const char *const RECOLOR_NAMES[RECOLOR_CAUSES] = {"insert", "delete", "bulk"};
+
+// What Stats() reports about one library. A library keeps the latencies and its tree the counters up to
+// date, and the shape figures are filled in on request; the statistics of several libraries are added up
+// with +=.
+struct LibraryStats {
+    long long books;
+    int height;                        // longest root to leaf path, in nodes
+    int blackHeight;                   // black nodes on every root to leaf path
+    long long depthSum;                // sum of the depths of all books, the root at depth 1
+    vector<long long> waitlists;       // books by number of reservations held
+    long long rotations[2];            // left, right
+    long long recolors[RECOLOR_CAUSES];
+    vector<LatencyHistogram> latency;  // by CommandType
+    long long cacheHits;               // book lookups answered by the hot-book cache
+    long long cacheLookups;
+
+    LibraryStats() : books(0), height(0), blackHeight(0), depthSum(0), waitlists(GATOR_RESERVATION_CAPACITY + 1, 0),
+                     cacheHits(0), cacheLookups(0) {
+        rotations[0] = rotations[1] = 0;
+        for (int i = 0; i < RECOLOR_CAUSES; i++)
+            recolors[i] = 0;
+    }
+
+    void recordLatency(int type, unsigned long long ns) {
+        if ((size_t)type >= latency.size())
+            latency.resize(type + 1);
+        latency[type].record(ns);
+    }
+
+    LibraryStats &operator+=(const LibraryStats &other) {
+        books += other.books;
+        height = max(height, other.height);
+        blackHeight = max(blackHeight, other.blackHeight);
+        depthSum += other.depthSum;
+        for (size_t i = 0; i < waitlists.size(); i++)
+            waitlists[i] += other.waitlists[i];
+        rotations[0] += other.rotations[0];
+        rotations[1] += other.rotations[1];
+        for (int i = 0; i < RECOLOR_CAUSES; i++)
+            recolors[i] += other.recolors[i];
+        if (latency.size() < other.latency.size())
+            latency.resize(other.latency.size());
+        for (size_t i = 0; i < other.latency.size(); i++)
+            latency[i].merge(other.latency[i]);
+        cacheHits += other.cacheHits;
+        cacheLookups += other.cacheLookups;
+        return *this;
+    }
 };
 
 // Color Enum which is used in the red black tree.
@@ -130,745 +646,7082 @@ enum Color
     BLACK
 };
 
-// Node of the red black tree that contains the book details, parent node, children and color of the node.
-class RBNode {
+// Nodes are addressed by 32-bit indices into the node store. Index 0 is a sentinel meaning "no node".
+typedef uint32_t NodeIndex;
+static const NodeIndex NIL = 0;
+
+// Node of the red black tree. Only what a descent needs is kept here: the key, the two children and
+// the parent index with the color packed into its lowest bit. With int keys four nodes fit in a cache line.
+// The value lives in the store's cold array under the same index.
+template <typename Key>
+struct RBNode {
+    Key key;
+    NodeIndex left;
+    NodeIndex right;
+    uint32_t parentAndColor;
+
+    NodeIndex parent() const { return parentAndColor >> 1; }
+    Color color() const { return (Color)(parentAndColor & 1); }
+    void setParent(NodeIndex parent) { parentAndColor = (parent << 1) | (parentAndColor & 1); }
+    void setColor(Color color) { parentAndColor = (parentAndColor & ~1u) | (uint32_t)color; }
+};
+
+static_assert(sizeof(RBNode<int>) == 16, "RBNode should stay at 16 bytes");
+
+// Storage for the tree nodes and their values, the default Allocator of RedBlackTree. Both live in slabs
+// addressed by the same index: the hot array of RBNodes holds what a descent touches and the cold array
+// holds the values themselves. A third array holds the size of the subtree under each node, used only by
+// the order statistic queries. Slabs never move once allocated, so pointers to a value stay valid while it
+// is in the tree. Freed indices are recycled through a freelist threaded through RBNode::left, and every
+// slab is released in one go when the store is destroyed. Index 0 is a permanently black sentinel node
+// without a value.
+template <typename Key, typename Value>
+class NodeStore {
 public:
-  BookNode* book;
-  RBNode* parent;
-  RBNode* left;
-  RBNode* right; 
-  Color color;
- 
-  RBNode(BookNode* book) : book(book) {
-    parent = left = right = NULL;
-    color = RED;
-  }
- 
-  // returns pointer to uncle
-  RBNode *uncle() {
-    // If no parent or grandparent, then no uncle
-    if (parent == NULL or parent->parent == NULL)
-      return NULL;
- 
-    if (parent->isOnLeft())
-      // uncle on right
-      return parent->parent->right;
-    else
-      // uncle on left
-      return parent->parent->left;
-  }
- 
-  // check if node is left child of parent
-  bool isOnLeft() { return this == parent->left; }
- 
-  // returns pointer to sibling
-  RBNode *sibling() {
-    // sibling null if no parent
-    if (parent == NULL)
-      return NULL;
- 
-    if (isOnLeft())
-      return parent->right;
- 
-    return parent->left;
-  }
- 
-  // moves node down and moves given node in its place
-  void moveDown(RBNode *nParent) {
-    if (parent != NULL) {
-      if (isOnLeft()) {
-        parent->left = nParent;
-      } else {
-        parent->right = nParent;
-      }
+    typedef RBNode<Key> Node;
+
+private:
+    static const int SLAB_SHIFT = 16;
+    static const uint32_t SLAB_SIZE = 1u << SLAB_SHIFT;
+    static const uint32_t MAX_SLABS = 1u << (31 - SLAB_SHIFT);
+    typedef typename aligned_storage<sizeof(Value), alignof(Value)>::type ValueSlot;
+
+    Node **nodeSlabs;
+    ValueSlot **valueSlabs;
+    uint32_t **sizeSlabs;
+    uint32_t slabCount;
+    uint32_t nextIndex;   // first never used index
+    NodeIndex freeList;
+    size_t live;
+
+    NodeStore(const NodeStore &);
+    NodeStore &operator=(const NodeStore &);
+
+    void addSlab() {
+        if (slabCount == MAX_SLABS)
+            throw bad_alloc();
+        nodeSlabs[slabCount] = new Node[SLAB_SIZE];
+        valueSlabs[slabCount] = new ValueSlot[SLAB_SIZE];
+        sizeSlabs[slabCount] = new uint32_t[SLAB_SIZE];
+        slabCount++;
+    }
+
+public:
+    NodeStore()
+        : nodeSlabs(new Node*[MAX_SLABS]()), valueSlabs(new ValueSlot*[MAX_SLABS]()),
+          sizeSlabs(new uint32_t*[MAX_SLABS]()), slabCount(0), nextIndex(0), freeList(NIL), live(0) {
+        addSlab();
+        Node &sentinel = node(NIL);
+        sentinel.key = Key();
+        sentinel.left = sentinel.right = NIL;
+        sentinel.parentAndColor = BLACK;
+        size(NIL) = 0;
+        nextIndex = 1;
+    }
+
+    // The owner must release every live node first.
+    ~NodeStore() {
+        for (uint32_t i = 0; i < slabCount; i++) {
+            delete[] nodeSlabs[i];
+            delete[] valueSlabs[i];
+            delete[] sizeSlabs[i];
+        }
+        delete[] nodeSlabs;
+        delete[] valueSlabs;
+        delete[] sizeSlabs;
+    }
+
+    // Whether the index lies in an allocated slab. Concurrent readers check every index they follow.
+    bool allocated(NodeIndex index) const {
+        return (index >> SLAB_SHIFT) < MAX_SLABS && nodeSlabs[index >> SLAB_SHIFT] != NULL;
+    }
+
+    Node &node(NodeIndex index) { return nodeSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+    const Node &node(NodeIndex index) const { return nodeSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+
+    // Number of nodes in the subtree rooted at the index; 0 for the sentinel.
+    uint32_t &size(NodeIndex index) { return sizeSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+    uint32_t size(NodeIndex index) const { return sizeSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+
+    Value &value(NodeIndex index) {
+        return *reinterpret_cast<Value*>(&valueSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]);
+    }
+    const Value &value(NodeIndex index) const {
+        return *reinterpret_cast<const Value*>(&valueSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]);
+    }
+
+    // Creating a red, unlinked node with the key and a value built from the given arguments.
+    template <typename... Args>
+    NodeIndex create(const Key &key, Args&&... args) {
+        NodeIndex index;
+        if (freeList != NIL) {
+            index = freeList;
+            freeList = node(index).left;
+        } else {
+            if (nextIndex == slabCount << SLAB_SHIFT)
+                addSlab();
+            index = nextIndex++;
+        }
+        new (&valueSlabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]) Value(std::forward<Args>(args)...);
+        Node &n = node(index);
+        n.key = key;
+        n.left = n.right = NIL;
+        n.parentAndColor = RED;
+        size(index) = 1;
+        live++;
+        return index;
+    }
+
+    // Destroying the value of a node and putting the index on the freelist.
+    void release(NodeIndex index) {
+        value(index).~Value();
+        node(index).left = freeList;
+        freeList = index;
+        live--;
+    }
+
+    // Forgetting the freelist once every node has been released, so new nodes are handed out in order again.
+    void reset() {
+        freeList = NIL;
+        nextIndex = 1;
+    }
+
+    AllocatorStats stats() const {
+        AllocatorStats s;
+        s.liveNodes = live;
+        s.bytesLive = live * (sizeof(Node) + sizeof(Value) + sizeof(uint32_t));
+        s.bytesReserved = (size_t)slabCount * SLAB_SIZE * (sizeof(Node) + sizeof(ValueSlot) + sizeof(uint32_t));
+        s.slabs = slabCount * 3;
+        return s;
     }
-    nParent->parent = parent;
-    parent = nParent;
-  }
- 
-  bool hasRedChild() {
-    return (left != NULL and left->color == RED) or
-           (right != NULL and right->color == RED);
-  }
 };
 
-//The red black tree containing the the node and the counter of the color flip count.
+typedef NodeStore<int, BookNode> BookStore;
+
+// Stats policies of RedBlackTree. The tree reports every rotation and every color change to its policy;
+// under a policy whose COUNTS_RECOLORS is false it does not look at the old color and just stores the new.
+
+// Counting nothing.
+struct NoTreeStats {
+    static const bool COUNTS_RECOLORS = false;
+    void rotated(bool) {}
+    void recolored(RecolorCause) {}
+};
+
+// Counting color changes only, which is what ColorFlipCount() prints.
+struct FlipCounter {
+    static const bool COUNTS_RECOLORS = true;
+    int flips;
+
+    FlipCounter() : flips(0) {}
+    void rotated(bool) {}
+    void recolored(RecolorCause) { flips++; }
+};
+
+// Counting color changes, split by cause, and rotations by direction, for Stats().
+struct TreeCounters {
+    static const bool COUNTS_RECOLORS = true;
+    int flips;
+    long long rotations[2];   // left, right
+    long long recolors[RECOLOR_CAUSES];
+
+    TreeCounters() : flips(0) {
+        rotations[0] = rotations[1] = 0;
+        for (int i = 0; i < RECOLOR_CAUSES; i++)
+            recolors[i] = 0;
+    }
+    void rotated(bool left) { rotations[left ? 0 : 1]++; }
+    void recolored(RecolorCause cause) {
+        flips++;
+        recolors[cause]++;
+    }
+};
+
+// Whether two keys are equivalent under Compare: neither orders before the other. Under less<T> that is
+// ==, a single comparison whose flags the descent reuses to choose the child without a branch.
+template <typename Compare>
+struct KeyEquivalence {
+    template <typename A, typename B>
+    static bool equal(const Compare &compare, const A &a, const B &b) { return !compare(a, b) && !compare(b, a); }
+};
+
+template <typename T>
+struct KeyEquivalence<less<T> > {
+    template <typename A, typename B>
+    static bool equal(const less<T> &, const A &a, const B &b) { return a == b; }
+};
+
+// Red black tree of values ordered by their keys under Compare. Nodes and values live in an Allocator with
+// the interface of NodeStore and are addressed by index, each value stored in place in its slot. Every node
+// also carries the size of its subtree for the order statistic queries. Lookups are templates, so any key
+// Compare accepts can be searched for without first building a Key.
+//
+// The tree never creates or frees nodes of its own accord: a node is created, then inserted, and after erase
+// it is released by the caller once nothing can still be looking at it. A value stays in the node it was
+// created in for as long as it is in the tree.
+template <typename Key, typename Value, typename Compare = less<Key>, typename Allocator = NodeStore<Key, Value>,
+          typename StatsPolicy = NoTreeStats>
 class RedBlackTree {
+public:
+    typedef RBNode<Key> Node;
 
 private:
+    NodeIndex root;
+    Allocator store;
+    Compare compare;
+    StatsPolicy counters;
 
-    RBNode* root;
-    int colorFlipCount=0;  // Counter for color flips
-    
-    //Coloring the specified node with the specific color.
-    void colorNode(RBNode *node, Color color){
-        if (node->color!=color){
-            colorFlipCount++;
-        }
-        node->color=color;
+    RedBlackTree(const RedBlackTree &);
+    RedBlackTree &operator=(const RedBlackTree &);
+
+    // check if node is left child of parent
+    bool isOnLeft(NodeIndex x) { return x == node(parentOf(x)).left; }
+
+    // returns the sibling, NIL if there is no parent
+    NodeIndex sibling(NodeIndex x) {
+        NodeIndex parent = parentOf(x);
+        if (parent == NIL)
+            return NIL;
+        return isOnLeft(x) ? node(parent).right : node(parent).left;
     }
 
-    // Helper functions for Red-Black Tree
+    bool hasRedChild(NodeIndex x) {
+        return (node(x).left != NIL and colorOf(node(x).left) == RED) or
+               (node(x).right != NIL and colorOf(node(x).right) == RED);
+    }
 
-    //Print the books between the 1 book IDs provided.
-    void print(int bookID1, int bookID2, RBNode* node, ofstream &outputFile);
+    // Visiting the keys of [low, high] under the given node, in order.
+    template <typename K, typename Visit>
+    void visitRange(NodeIndex index, const K &low, const K &high, Visit &visit) const {
+        if (index == NIL)
+            return;
+        const Node &n = node(index);
+        if (compare(low, n.key))
+            visitRange(n.left, low, high, visit);
+        if (!compare(n.key, low) && !compare(high, n.key))
+            visit(index);
+        if (compare(n.key, high))
+            visitRange(n.right, low, high, visit);
+    }
 
-    //Print the book with the book ID provided.
-    void printInfo(int bookID, RBNode* node, ofstream &outputFile);
+    // Height of the subtree rooted at the given node.
+    int subtreeHeight(NodeIndex index) const {
+        if (index == NIL)
+            return 0;
+        return 1 + max(subtreeHeight(node(index).left), subtreeHeight(node(index).right));
+    }
 
-    //Find the books closest to the book ID provided.
-    void find(int targetID, RBNode* node, ofstream &outputFile, int minans);
+    //Coloring the specified node with the specific color.
+    void colorNode(NodeIndex index, Color color, RecolorCause cause){
+        if (StatsPolicy::COUNTS_RECOLORS && colorOf(index)!=color)
+            counters.recolored(cause);
+        node(index).setColor(color);
+    }
 
     //Left rotation of the red black tree.
-    void rotateLeft(RBNode *x){
-        RBNode *y = x->right;
-        x->right = y->left;
+    void rotateLeft(NodeIndex x){
+        counters.rotated(true);
+        NodeIndex y = node(x).right;
+        node(x).right = node(y).left;
 
-        if (y->left)
+        if (node(y).left != NIL)
         {
-            y->left->parent = x;
+            node(node(y).left).setParent(x);
         }
 
-        y->parent = x->parent;
+        NodeIndex xParent = parentOf(x);
+        node(y).setParent(xParent);
 
-        if (!x->parent)
+        if (xParent == NIL)
         {
             root = y;
         }
-        else if (x == x->parent->left)
+        else if (x == node(xParent).left)
         {
-            x->parent->left = y;
+            node(xParent).left = y;
         }
         else
         {
-            x->parent->right = y;
+            node(xParent).right = y;
         }
 
-        y->left = x;
-        x->parent = y;
+        node(y).left = x;
+        node(x).setParent(y);
+
+        // y takes over the subtree of x, x keeps its new children
+        store.size(y) = sizeOf(x);
+        store.size(x) = sizeOf(node(x).left) + sizeOf(node(x).right) + 1;
     }
 
     //Right rotation of the red black tree.
-    void rotateRight(RBNode *y){
-        RBNode *x = y->left;
-        y->left = x->right;
+    void rotateRight(NodeIndex y){
+        counters.rotated(false);
+        NodeIndex x = node(y).left;
+        node(y).left = node(x).right;
 
-        if (x->right)
+        if (node(x).right != NIL)
         {
-            x->right->parent = y;
+            node(node(x).right).setParent(y);
         }
 
-        x->parent = y->parent;
+        NodeIndex yParent = parentOf(y);
+        node(x).setParent(yParent);
 
-        if (!y->parent)
+        if (yParent == NIL)
         {
             root = x;
         }
-        else if (y == y->parent->right)
+        else if (y == node(yParent).right)
         {
-            y->parent->right = x;
+            node(yParent).right = x;
         }
         else
         {
-            y->parent->left = x;
+            node(yParent).left = x;
         }
 
-        x->right = y;
-        y->parent = x;
+        node(x).right = y;
+        node(y).setParent(x);
+
+        // x takes over the subtree of y, y keeps its new children
+        store.size(x) = sizeOf(y);
+        store.size(y) = sizeOf(node(y).left) + sizeOf(node(y).right) + 1;
+    }
+
+    // Hanging a new node under parent, found by an insertion descent that counted it already, and
+    // rebalancing.
+    void attach(NodeIndex newNode, NodeIndex parent) {
+        node(newNode).setParent(parent);
+        if (parent == NIL)
+            root = newNode;
+        else if (compare(node(newNode).key, node(parent).key))
+            node(parent).left = newNode;
+        else
+            node(parent).right = newNode;
+        fixInsert(newNode);
     }
 
     //Fixing the red black tree after insertion.
-    void fixInsert(RBNode *node){
-        while (node->parent && node->parent->color == RED)
+    void fixInsert(NodeIndex x){
+        while (parentOf(x) != NIL && colorOf(parentOf(x)) == RED)
         {
+            NodeIndex parent = parentOf(x);
+            NodeIndex grandparent = parentOf(parent);
             // If parent of node is left child of grandparent of node
-            if (node->parent == node->parent->parent->left)
+            if (parent == node(grandparent).left)
             {
-                RBNode *uncle = node->parent->parent->right;
+                NodeIndex uncle = node(grandparent).right;
 
                 // If uncle of node is red, recolor parent, uncle and grandparent of node
-                if (uncle && uncle->color == RED)
+                if (uncle != NIL && colorOf(uncle) == RED)
                 {
-                    colorNode(node->parent, BLACK);
-                    colorNode(uncle, BLACK);
-                    colorNode(node->parent->parent, RED);
-                    node = node->parent->parent;
+                    colorNode(parent, BLACK, RECOLOR_INSERT);
+                    colorNode(uncle, BLACK, RECOLOR_INSERT);
+                    colorNode(grandparent, RED, RECOLOR_INSERT);
+                    x = grandparent;
                 } // If uncle of node is black, rotate the tree
                 else
                 {
                     // If node is right child of parent, rotate left at parent
-                    if (node == node->parent->right)
+                    if (x == node(parent).right)
                     {
-                        node = node->parent;
-                        rotateLeft(node);
+                        x = parent;
+                        rotateLeft(x);
                     }
-                    colorNode(node->parent, BLACK);
-                    colorNode(node->parent->parent, RED);
-                    rotateRight(node->parent->parent);
+                    colorNode(parentOf(x), BLACK, RECOLOR_INSERT);
+                    colorNode(parentOf(parentOf(x)), RED, RECOLOR_INSERT);
+                    rotateRight(parentOf(parentOf(x)));
                 }
             } // If parent of node is right child of grandparent of node
             else
             {
-                RBNode *uncle = node->parent->parent->left;
+                NodeIndex uncle = node(grandparent).left;
 
                 // If uncle of node is red, recolor parent, uncle and grandparent of node
-                if (uncle && uncle->color == RED)
+                if (uncle != NIL && colorOf(uncle) == RED)
                 {
-                    colorNode(node->parent, BLACK);
-                    colorNode(uncle, BLACK);
-                    colorNode(node->parent->parent, RED);
-                    node = node->parent->parent;
+                    colorNode(parent, BLACK, RECOLOR_INSERT);
+                    colorNode(uncle, BLACK, RECOLOR_INSERT);
+                    colorNode(grandparent, RED, RECOLOR_INSERT);
+                    x = grandparent;
                 }
                 else // If uncle of node is black, rotate the tree
                 {
                     // If node is left child of parent, rotate right at parent
-                    if (node == node->parent->left)
+                    if (x == node(parent).left)
                     {
-                        node = node->parent;
-                        rotateRight(node);
+                        x = parent;
+                        rotateRight(x);
                     }
-                    colorNode(node->parent, BLACK);
-                    colorNode(node->parent->parent, RED);
-                    rotateLeft(node->parent->parent);
+                    colorNode(parentOf(x), BLACK, RECOLOR_INSERT);
+                    colorNode(parentOf(parentOf(x)), RED, RECOLOR_INSERT);
+                    rotateLeft(parentOf(parentOf(x)));
                 }
             }
         }
-        colorNode(root, BLACK);
+        colorNode(root, BLACK, RECOLOR_INSERT);
 
     }
 
     //Finding the successor of the node given.
-    RBNode *successor(RBNode *x) {
-    RBNode *temp = x;
- 
-    while (temp->left != NULL)
-      temp = temp->left;
- 
-    return temp;
+    NodeIndex successor(NodeIndex x) {
+        NodeIndex temp = x;
+
+        while (node(temp).left != NIL)
+            temp = node(temp).left;
+
+        return temp;
+    }
+
+    NodeIndex BSTreplace(NodeIndex x) {
+        // when node have 2 children
+        if (node(x).left != NIL and node(x).right != NIL)
+            return successor(node(x).right);
+
+        // when leaf
+        if (node(x).left == NIL and node(x).right == NIL)
+            return NIL;
+
+        // when single child
+        if (node(x).left != NIL)
+            return node(x).left;
+        else
+            return node(x).right;
+    }
+
+  // Taking a node that is about to be unlinked out of the subtree sizes of its ancestors.
+  void shrinkAncestors(NodeIndex v) {
+    for (NodeIndex p = parentOf(v); p != NIL; p = parentOf(p))
+      store.size(p)--;
   }
 
-    RBNode *BSTreplace(RBNode *x) {
-    // when node have 2 children
-    if (x->left != NULL and x->right != NULL)
-      return successor(x->right);
- 
-    // when leaf
-    if (x->left == NULL and x->right == NULL)
-      return NULL;
- 
-    // when single child
-    if (x->left != NULL)
-      return x->left;
+  // Exchanging the places of a node with two children and its in-order successor u. Each takes over the
+  // other's parent, children, color and subtree size, so the shape and colors of the tree stay as they were
+  // and only the two nodes trade positions; their keys and values do not move.
+  void swapPlaces(NodeIndex v, NodeIndex u) {
+    Node &nv = node(v), &nu = node(u);
+    NodeIndex vParent = nv.parent(), vLeft = nv.left, vRight = nv.right;
+    NodeIndex uParent = nu.parent(), uRight = nu.right;
+    Color vColor = nv.color(), uColor = nu.color();
+    uint32_t vSize = sizeOf(v), uSize = sizeOf(u);
+
+    // u moves up into the place of v
+    if (vParent == NIL)
+      root = u;
+    else if (node(vParent).left == v)
+      node(vParent).left = u;
     else
-      return x->right;
-  }
+      node(vParent).right = u;
+    nu.setParent(vParent);
+    nu.left = vLeft;
+    node(vLeft).setParent(u);
+    if (uParent == v) {
+      nu.right = v;
+      nv.setParent(u);
+    } else {
+      nu.right = vRight;
+      node(vRight).setParent(u);
+      node(uParent).left = v;
+      nv.setParent(uParent);
+    }
+
+    // v moves down into the place of u, which has no left child
+    nv.left = NIL;
+    nv.right = uRight;
+    if (uRight != NIL)
+      node(uRight).setParent(v);
 
-  // Swapping books of 2 nodes.
-  void swapValues(RBNode *u, RBNode *v) {
-    BookNode *temp;
-    temp = u->book;
-    u->book = v->book;
-    v->book = temp;
+    nu.setColor(vColor);
+    nv.setColor(uColor);
+    store.size(u) = vSize;
+    store.size(v) = uSize;
   }
 
-  // Deleting a node.
-  void deleteNode(RBNode *v) {
-    RBNode *u = BSTreplace(v);
- 
+  // Deleting a node. A node with two children first trades places with its successor, so every book
+  // stays in the node it was created in.
+  void deleteNode(NodeIndex v) {
+    if (node(v).left != NIL and node(v).right != NIL)
+      swapPlaces(v, successor(node(v).right));
+    NodeIndex u = BSTreplace(v);
+
     // True when u and v are both black
-    bool uvBlack = ((u == NULL or u->color == BLACK) and (v->color == BLACK));
-    RBNode *parent = v->parent;
- 
-    if (u == NULL) {
-      // u is NULL therefore v is leaf
+    bool uvBlack = ((u == NIL or colorOf(u) == BLACK) and (colorOf(v) == BLACK));
+    NodeIndex parent = parentOf(v);
+
+    if (u == NIL) {
+      // u is NIL therefore v is leaf
       if (v == root) {
         // v is root, making root null
-        root = NULL;
+        root = NIL;
       } else {
+        // v keeps a weight of 0 while the fixup rotates around it
+        shrinkAncestors(v);
+        store.size(v) = 0;
         if (uvBlack) {
           // u and v both black
           // v is leaf, fix double black at v
           fixDoubleBlack(v);
         } else {
           // u or v is red
-          if (v->sibling() != NULL)
+          if (sibling(v) != NIL)
             // sibling is not null, make it red"
-            v->sibling()->color = RED;
+            colorNode(sibling(v), RED, RECOLOR_DELETE);
         }
- 
+
         // delete v from the tree
-        if (v->isOnLeft()) {
-          parent->left = NULL;
+        if (isOnLeft(v)) {
+          node(parent).left = NIL;
         } else {
-          parent->right = NULL;
+          node(parent).right = NIL;
         }
       }
-      delete v;
       return;
     }
- 
-    if (v->left == NULL or v->right == NULL) {
-      // v has 1 child
-      if (v == root) {
-        // v is root, assign the value of u to v, and delete u
-        v->book = u->book;
-        v->left = v->right = NULL;
-        delete u;
+
+    // v has 1 child
+    if (v == root) {
+      // v is root and u a red leaf, u becomes the root in the color of v. This stands for moving u's book
+      // into the root node, which keeps its color, so unlike other recolors it is not counted by colorNode
+      // and ColorFlipCount stays as it always was.
+      root = u;
+      node(u).setParent(NIL);
+      node(u).setColor(colorOf(v));
+    } else {
+      // Detach v from tree and move u up
+      shrinkAncestors(v);
+      if (isOnLeft(v)) {
+        node(parent).left = u;
       } else {
-        // Detach v from tree and move u up
-        if (v->isOnLeft()) {
-          parent->left = u;
-        } else {
-          parent->right = u;
-        }
-        delete v;
-        u->parent = parent;
-        if (uvBlack) {
-          // u and v both black, fix double black at u
-          fixDoubleBlack(u);
-        } else {
-          // u or v red, color u black
-          u->color = BLACK;
-        }
+        node(parent).right = u;
+      }
+      node(u).setParent(parent);
+      if (uvBlack) {
+        // u and v both black, fix double black at u
+        fixDoubleBlack(u);
+      } else {
+        // u or v red, color u black
+        colorNode(u, BLACK, RECOLOR_DELETE);
       }
-      return;
     }
- 
-    // v has 2 children, swap values with successor and recurse
-    swapValues(u, v);
-    deleteNode(u);
   }
 
-  //Fixing the double black property of the red black tree after deletion.
-  void fixDoubleBlack(RBNode *x) {
-    if (x == root)
-      // Reached root
-      return;
- 
-    RBNode *sibling = x->sibling(), *parent = x->parent;
-    if (sibling == NULL) {
-      // No sibling, double black pushed up
-      fixDoubleBlack(parent);
-    } else {
-      if (sibling->color == RED) {
-        // Sibling red
-        parent->color = RED;
-        sibling->color = BLACK;
-        if (sibling->isOnLeft()) {
+  //Fixing the double black property of the red black tree after deletion, moving up from x.
+  void fixDoubleBlack(NodeIndex x) {
+    while (x != root) {
+      NodeIndex sib = sibling(x), parent = parentOf(x);
+      if (sib == NIL) {
+        // No sibling, double black pushed up
+        x = parent;
+        continue;
+      }
+      if (colorOf(sib) == RED) {
+        // Sibling red, rotate it above the parent and look at x again
+        colorNode(parent, RED, RECOLOR_DELETE);
+        colorNode(sib, BLACK, RECOLOR_DELETE);
+        if (isOnLeft(sib)) {
           // left case
           rotateRight(parent);
         } else {
           // right case
           rotateLeft(parent);
         }
-        fixDoubleBlack(x);
-      } else {
-        // Sibling black
-        if (sibling->hasRedChild()) {
-          // at least 1 red children
-          if (sibling->left != NULL and sibling->left->color == RED) {
-            if (sibling->isOnLeft()) {
-              // left left
-              sibling->left->color = sibling->color;
-              sibling->color = parent->color;
-              rotateRight(parent);
-            } else {
-              // right left
-              sibling->left->color = parent->color;
-              rotateRight(sibling);
-              rotateLeft(parent);
-            }
+        continue;
+      }
+      // Sibling black
+      if (hasRedChild(sib)) {
+        // at least 1 red children
+        NodeIndex sibLeft = node(sib).left, sibRight = node(sib).right;
+        if (sibLeft != NIL and colorOf(sibLeft) == RED) {
+          if (isOnLeft(sib)) {
+            // left left
+            colorNode(sibLeft, colorOf(sib), RECOLOR_DELETE);
+            colorNode(sib, colorOf(parent), RECOLOR_DELETE);
+            rotateRight(parent);
           } else {
-            if (sibling->isOnLeft()) {
-              // left right
-              sibling->right->color = parent->color;
-              rotateLeft(sibling);
-              rotateRight(parent);
-            } else {
-              // right right
-              sibling->right->color = sibling->color;
-              sibling->color = parent->color;
-              rotateLeft(parent);
-            }
+            // right left
+            colorNode(sibLeft, colorOf(parent), RECOLOR_DELETE);
+            rotateRight(sib);
+            rotateLeft(parent);
           }
-          parent->color = BLACK;
         } else {
-          // 2 black children
-          sibling->color = RED;
-          if (parent->color == BLACK)
-            fixDoubleBlack(parent);
-          else
-            parent->color = BLACK;
+          if (isOnLeft(sib)) {
+            // left right
+            colorNode(sibRight, colorOf(parent), RECOLOR_DELETE);
+            rotateLeft(sib);
+            rotateRight(parent);
+          } else {
+            // right right
+            colorNode(sibRight, colorOf(sib), RECOLOR_DELETE);
+            colorNode(sib, colorOf(parent), RECOLOR_DELETE);
+            rotateLeft(parent);
+          }
         }
+        colorNode(parent, BLACK, RECOLOR_DELETE);
+        return;
       }
+      // 2 black children
+      colorNode(sib, RED, RECOLOR_DELETE);
+      if (colorOf(parent) != BLACK) {
+        colorNode(parent, BLACK, RECOLOR_DELETE);
+        return;
+      }
+      x = parent;
     }
   }
 
-    void transplant(RBNode *oldNode, RBNode *newNode){
-        if (!oldNode->parent)
-        {
-            root = newNode;
+    // Building a balanced subtree from nodes[lo, hi) which are sorted by key. Taking the middle node at
+    // every step fills all levels above redDepth completely, so coloring exactly the nodes on level redDepth
+    // red gives every path the same number of black nodes. Colors are set through colorNode, so as with
+    // insertBook a new node (born red) that ends up black counts as one flip, and so does every existing
+    // node whose color changes in the rebuild.
+    NodeIndex buildBalanced(vector<NodeIndex> &nodes, int lo, int hi, int depth, int redDepth, NodeIndex parent) {
+        if (lo >= hi)
+            return NIL;
+        int mid = lo + (hi - lo) / 2;
+        NodeIndex index = nodes[mid];
+        node(index).setParent(parent);
+        colorNode(index, (depth == redDepth) ? RED : BLACK, RECOLOR_BULK);
+        node(index).left = buildBalanced(nodes, lo, mid, depth + 1, redDepth, index);
+        node(index).right = buildBalanced(nodes, mid + 1, hi, depth + 1, redDepth, index);
+        store.size(index) = hi - lo;
+        return index;
+    }
+
+    // Building a balanced, correctly colored tree from sorted nodes and returning its root.
+    NodeIndex buildTree(vector<NodeIndex> &nodes, int lo, int hi) {
+        int n = hi - lo;
+        int fullLevels = 0;
+        while ((2 << fullLevels) - 1 <= n)
+            fullLevels++;
+        // A perfect tree has no partially filled level and stays all black.
+        int redDepth = ((1 << fullLevels) - 1 == n) ? -1 : fullLevels;
+        return buildBalanced(nodes, lo, hi, 0, redDepth, NIL);
+    }
+
+    // Number of black nodes on the path from the node down to a leaf, counting the node itself.
+    int blackHeight(NodeIndex index) const {
+        int height = 0;
+        for (; index != NIL; index = node(index).left) {
+            if (colorOf(index) == BLACK)
+                height++;
+        }
+        return height;
+    }
+
+    // Joining the valid red black trees rooted at left and right with the single node middle, where every
+    // key in left < middle < every key in right. Runs in O(|black height difference|) plus the insert fixup.
+    NodeIndex join(NodeIndex left, NodeIndex middle, NodeIndex right) {
+        int leftHeight = blackHeight(left);
+        int rightHeight = blackHeight(right);
+        if (leftHeight == rightHeight) {
+            node(middle).setParent(NIL);
+            node(middle).left = left;
+            node(middle).right = right;
+            if (left != NIL) node(left).setParent(middle);
+            if (right != NIL) node(right).setParent(middle);
+            store.size(middle) = sizeOf(left) + sizeOf(right) + 1;
+            colorNode(middle, BLACK, RECOLOR_BULK);
+            return middle;
+        }
+        root = (leftHeight > rightHeight) ? left : right;
+        if (leftHeight > rightHeight) {
+            // Walking down the right spine of left to the black node with the black height of right.
+            NodeIndex current = left, parent = NIL;
+            int height = leftHeight;
+            while (current != NIL && (colorOf(current) == RED || height > rightHeight)) {
+                if (colorOf(current) == BLACK)
+                    height--;
+                parent = current;
+                current = node(current).right;
+            }
+            node(middle).left = current;
+            node(middle).right = right;
+            if (current != NIL) node(current).setParent(middle);
+            if (right != NIL) node(right).setParent(middle);
+            node(middle).setParent(parent);
+            node(parent).right = middle;
+            store.size(middle) = sizeOf(current) + sizeOf(right) + 1;
+            for (NodeIndex p = parent; p != NIL; p = parentOf(p))
+                store.size(p) += sizeOf(right) + 1;
+        } else {
+            NodeIndex current = right, parent = NIL;
+            int height = rightHeight;
+            while (current != NIL && (colorOf(current) == RED || height > leftHeight)) {
+                if (colorOf(current) == BLACK)
+                    height--;
+                parent = current;
+                current = node(current).left;
+            }
+            node(middle).right = current;
+            node(middle).left = left;
+            if (current != NIL) node(current).setParent(middle);
+            if (left != NIL) node(left).setParent(middle);
+            node(middle).setParent(parent);
+            node(parent).left = middle;
+            store.size(middle) = sizeOf(current) + sizeOf(left) + 1;
+            for (NodeIndex p = parent; p != NIL; p = parentOf(p))
+                store.size(p) += sizeOf(left) + 1;
+        }
+        fixInsert(middle);
+        return root;
+    }
+
+public:
+    RedBlackTree() : root(NIL) {}
+
+    // The owner must release every node first.
+    ~RedBlackTree() {}
+
+    // Accessors for the nodes and values stored at an index.
+    Node &node(NodeIndex index) { return store.node(index); }
+    const Node &node(NodeIndex index) const { return store.node(index); }
+    Value &value(NodeIndex index) { return store.value(index); }
+    const Value &value(NodeIndex index) const { return store.value(index); }
+    NodeIndex parentOf(NodeIndex index) const { return store.node(index).parent(); }
+    uint32_t sizeOf(NodeIndex index) const { return store.size(index); }
+    Color colorOf(NodeIndex index) const { return store.node(index).color(); }
+
+    // Descents findMany keeps in flight at once.
+    static const int FIND_GROUP = 16;
+
+    NodeIndex rootIndex() const { return root; }
+    uint32_t size() const { return sizeOf(root); }
+    const Allocator &nodes() const { return store; }
+    StatsPolicy &statistics() { return counters; }
+    const StatsPolicy &statistics() const { return counters; }
+
+    // Creating an unlinked node holding the key and a value built from the arguments.
+    template <typename... Args>
+    NodeIndex create(const Key &key, Args&&... args) {
+        return store.create(key, std::forward<Args>(args)...);
+    }
+
+    // Destroying the value of a node that is not in the tree and recycling the node.
+    void release(NodeIndex index) { store.release(index); }
+
+    // Linking a node from create into the tree. A key equal to existing ones goes after them.
+    void insert(NodeIndex newNode) {
+        const Key &key = node(newNode).key;
+        NodeIndex parent = NIL;
+        NodeIndex temp = root;
+        while (temp != NIL) {
+            parent = temp;
+            store.size(temp)++;
+            if (compare(key, node(temp).key))
+                temp = node(temp).left;
+            else
+                temp = node(temp).right;
+        }
+        attach(newNode, parent);
+    }
+
+    // Linking a node from create into the tree unless a key equal to its own is already there, in one
+    // descent. Returns the node holding the key: the one find would return, which leaves newNode unlinked,
+    // or newNode itself.
+    NodeIndex insertOrFind(NodeIndex newNode) {
+        const Key &key = node(newNode).key;
+        NodeIndex parent = NIL;
+        NodeIndex temp = root;
+        while (temp != NIL) {
+            const Node &n = node(temp);
+            if (KeyEquivalence<Compare>::equal(compare, key, n.key)) {
+                // Taking back the counts added on the way down
+                for (NodeIndex above = parent; above != NIL; above = parentOf(above))
+                    store.size(above)--;
+                return temp;
+            }
+            parent = temp;
+            store.size(temp)++;
+            temp = compare(key, n.key) ? n.left : n.right;
+        }
+        attach(newNode, parent);
+        return newNode;
+    }
+
+    // Unlinking the node from the tree. No other node changes its key or value, so references to them stay
+    // valid; the caller releases the node once nothing can still be looking at it.
+    void erase(NodeIndex index) {
+        deleteNode(index);
+    }
+
+    // Releasing every node of the tree.
+    void clear() {
+        NodeIndex current = root;
+        while (current != NIL) {
+            Node &n = node(current);
+            if (n.left != NIL) {
+                current = n.left;
+            } else if (n.right != NIL) {
+                current = n.right;
+            } else {
+                NodeIndex parent = n.parent();
+                if (parent != NIL) {
+                    if (node(parent).left == current)
+                        node(parent).left = NIL;
+                    else
+                        node(parent).right = NIL;
+                }
+                store.release(current);
+                current = parent;
+            }
+        }
+        root = NIL;
+        store.reset();
+    }
+
+    // Node holding a key equal to the given one, NIL when there is none.
+    template <typename K>
+    NodeIndex find(const K &key) const {
+        NodeIndex current = root;
+        while (current != NIL) {
+            const Node &n = node(current);
+            if (KeyEquivalence<Compare>::equal(compare, key, n.key))
+                return current;
+            current = compare(key, n.key) ? n.left : n.right;
+        }
+        return NIL;
+    }
+
+    // find for each of n keys, putting the node for keys[i] in found[i]. Groups of FIND_GROUP descents
+    // advance in lockstep, each step prefetching the node every unfinished one moves to, so that their
+    // cache misses overlap instead of waiting one behind the other.
+    template <typename K>
+    void findMany(const K *keys, size_t n, NodeIndex *found) const {
+        for (size_t start = 0; start < n; start += FIND_GROUP) {
+            int group = (int)min(n - start, (size_t)FIND_GROUP);
+            const K *key = keys + start;
+            NodeIndex *current = found + start;
+            int active[FIND_GROUP];
+            int running = 0;
+            for (int i = 0; i < group; i++) {
+                current[i] = root;
+                if (root != NIL)
+                    active[running++] = i;
+            }
+            while (running > 0) {
+                int kept = 0;
+                for (int j = 0; j < running; j++) {
+                    int i = active[j];
+                    const Node &at = node(current[i]);
+                    if (KeyEquivalence<Compare>::equal(compare, key[i], at.key))
+                        continue;
+                    current[i] = compare(key[i], at.key) ? at.left : at.right;
+                    if (current[i] != NIL) {
+                        __builtin_prefetch(&node(current[i]));
+                        active[kept++] = i;
+                    }
+                }
+                running = kept;
+            }
+        }
+    }
+
+    // Nodes with the greatest key <= the given one and the smallest key >= it, found in one descent. Both
+    // are the same node on an exact match, and either is NIL when no such node exists.
+    template <typename K>
+    void floorCeiling(const K &key, NodeIndex &floorNode, NodeIndex &ceilingNode) const {
+        floorNode = ceilingNode = NIL;
+        NodeIndex current = root;
+        while (current != NIL) {
+            const Node &n = node(current);
+            if (KeyEquivalence<Compare>::equal(compare, key, n.key)) {
+                floorNode = ceilingNode = current;
+                return;
+            }
+            if (compare(n.key, key)) {
+                floorNode = current;
+                current = n.right;
+            } else {
+                ceilingNode = current;
+                current = n.left;
+            }
+        }
+    }
+
+    // Nodes with the smallest and the greatest key, NIL in an empty tree.
+    NodeIndex first() const {
+        NodeIndex current = root;
+        if (current != NIL)
+            while (node(current).left != NIL) current = node(current).left;
+        return current;
+    }
+    NodeIndex last() const {
+        NodeIndex current = root;
+        if (current != NIL)
+            while (node(current).right != NIL) current = node(current).right;
+        return current;
+    }
+
+    // Number of levels on the longest root to leaf path.
+    int height() const { return subtreeHeight(root); }
+
+    // Number of black nodes on every root to leaf path.
+    int blackHeight() const { return blackHeight(root); }
+
+
+    // Appending every node of the tree to nodes in key order.
+    void collectInOrder(vector<NodeIndex> &nodes) const {
+        NodeIndex current = root;
+        if (current == NIL)
+            return;
+        while (node(current).left != NIL) current = node(current).left;
+        while (current != NIL) {
+            nodes.push_back(current);
+            if (node(current).right != NIL) {
+                current = node(current).right;
+                while (node(current).left != NIL) current = node(current).left;
+            } else {
+                while (parentOf(current) != NIL && current == node(parentOf(current)).right) current = parentOf(current);
+                current = parentOf(current);
+            }
+        }
+    }
+
+    // Linking sorted nodes into the tree. With rebuild the nodes are every node the tree is to hold and the
+    // tree is rebuilt from them; otherwise they all lie below or above the existing keys and are joined on
+    // through their last or first node.
+    void linkSorted(vector<NodeIndex> &nodes, bool rebuild) {
+        int n = nodes.size();
+        if (root == NIL || rebuild) {
+            root = buildTree(nodes, 0, n);
+        } else if (compare(node(root).key, node(nodes.front()).key)) {
+            // Batch above every key: the first new node joins the old tree with the rest of the batch.
+            NodeIndex middle = nodes[0];
+            NodeIndex right = buildTree(nodes, 1, n);
+            NodeIndex left = root;
+            root = join(left, middle, right);
+        } else {
+            NodeIndex middle = nodes[n - 1];
+            NodeIndex left = buildTree(nodes, 0, n - 1);
+            NodeIndex right = root;
+            root = join(left, middle, right);
+        }
+        node(root).setParent(NIL);
+    }
+
+    // Number of keys below key (or at most key when inclusive), in one descent.
+    template <typename K>
+    int countBelow(const K &key, bool inclusive) const {
+        int count = 0;
+        NodeIndex current = root;
+        while (current != NIL) {
+            const Node &n = node(current);
+            if (compare(n.key, key) || (inclusive && KeyEquivalence<Compare>::equal(compare, n.key, key))) {
+                count += sizeOf(n.left) + 1;
+                current = n.right;
+            } else {
+                current = n.left;
+            }
+        }
+        return count;
+    }
+
+    // Node with the given 0-based rank, NIL when rank is out of range.
+    NodeIndex select(long long rank) const {
+        if (rank < 0 || rank >= sizeOf(root))
+            return NIL;
+        NodeIndex current = root;
+        while (current != NIL) {
+            long long leftSize = sizeOf(node(current).left);
+            if (rank < leftSize) {
+                current = node(current).left;
+            } else if (rank == leftSize) {
+                return current;
+            } else {
+                rank -= leftSize + 1;
+                current = node(current).right;
+            }
+        }
+        return NIL;
+    }
+
+    // In order predecessor of a node, NIL before the first one.
+    NodeIndex prev(NodeIndex current) const {
+        if (node(current).left != NIL) {
+            current = node(current).left;
+            while (node(current).right != NIL) current = node(current).right;
+            return current;
+        }
+        while (parentOf(current) != NIL && current == node(parentOf(current)).left) current = parentOf(current);
+        return parentOf(current);
+    }
+
+    // In order successor of a node, NIL after the last one.
+    NodeIndex next(NodeIndex current) const {
+        if (node(current).right != NIL) {
+            current = node(current).right;
+            while (node(current).left != NIL) current = node(current).left;
+            return current;
+        }
+        while (parentOf(current) != NIL && current == node(parentOf(current)).right) current = parentOf(current);
+        return parentOf(current);
+    }
+
+    // Calling visit(node) for every key in [low, high], in order.
+    template <typename K, typename Visit>
+    void forEachInRange(const K &low, const K &high, Visit visit) const {
+        visitRange(root, low, high, visit);
+    }
+
+    // Calling visit(node, depth) for every node, the root at depth 1.
+    template <typename Visit>
+    void forEachWithDepth(Visit visit) const {
+        vector<pair<NodeIndex, int> > pending;
+        if (root != NIL)
+            pending.push_back(make_pair(root, 1));
+        while (!pending.empty()) {
+            NodeIndex index = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+            visit(index, depth);
+            const Node &n = node(index);
+            if (n.left != NIL)
+                pending.push_back(make_pair(n.left, depth + 1));
+            if (n.right != NIL)
+                pending.push_back(make_pair(n.right, depth + 1));
+        }
+    }};
+
+
+// Pages of BPlusTree are addressed by 32-bit indices into their PageStore. Index 0 means "no page".
+typedef uint32_t PageIndex;
+static const PageIndex NO_PAGE = 0;
+
+// Storage for the pages of one kind of BPlusTree page, in slabs aligned to cache lines. Like NodeStore,
+// slabs never move or shrink while the store lives, so a concurrent reader holding a stale index reads a
+// page that may have changed but is never unmapped. A released page gets a count of 0 before it is reused.
+template <typename Page>
+class PageStore {
+    static const int SLAB_SHIFT = 14;
+    static const uint32_t SLAB_SIZE = 1u << SLAB_SHIFT;
+    static const uint32_t MAX_SLABS = 1u << (28 - SLAB_SHIFT);
+
+    Page **slabs;
+    uint32_t slabCount;
+    uint32_t nextIndex;   // first never used index
+    vector<PageIndex> freePages;
+    size_t live;
+
+    PageStore(const PageStore &);
+    PageStore &operator=(const PageStore &);
+
+    void addSlab() {
+        if (slabCount == MAX_SLABS)
+            throw bad_alloc();
+        void *memory;
+        if (posix_memalign(&memory, 64, SLAB_SIZE * sizeof(Page)) != 0)
+            throw bad_alloc();
+        slabs[slabCount++] = static_cast<Page*>(memory);
+    }
+
+public:
+    PageStore() : slabs(new Page*[MAX_SLABS]()), slabCount(0), nextIndex(1), live(0) {}
+
+    ~PageStore() {
+        for (uint32_t i = 0; i < slabCount; i++)
+            free(slabs[i]);
+        delete[] slabs;
+    }
+
+    // Whether the index lies in an allocated slab. Concurrent readers check every index they follow.
+    bool allocated(PageIndex index) const {
+        return (index >> SLAB_SHIFT) < MAX_SLABS && slabs[index >> SLAB_SHIFT] != NULL;
+    }
+
+    Page &page(PageIndex index) { return slabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+    const Page &page(PageIndex index) const { return slabs[index >> SLAB_SHIFT][index & (SLAB_SIZE - 1)]; }
+
+    // Handing out a zeroed page.
+    PageIndex create() {
+        PageIndex index;
+        if (!freePages.empty()) {
+            index = freePages.back();
+            freePages.pop_back();
+        } else {
+            if ((nextIndex >> SLAB_SHIFT) == slabCount)
+                addSlab();
+            index = nextIndex++;
+        }
+        memset(&page(index), 0, sizeof(Page));
+        live++;
+        return index;
+    }
+
+    void release(PageIndex index) {
+        page(index).count = 0;
+        freePages.push_back(index);
+        live--;
+    }
+
+    // Forgetting every page at once; the slabs are kept for the pages built next.
+    void reset() {
+        for (PageIndex index = 1; index < nextIndex; index++)
+            page(index).count = 0;
+        freePages.clear();
+        nextIndex = 1;
+        live = 0;
+    }
+
+    AllocatorStats stats() const {
+        AllocatorStats s;
+        s.liveNodes = live;
+        s.bytesLive = live * sizeof(Page);
+        s.bytesReserved = (size_t)slabCount * SLAB_SIZE * sizeof(Page);
+        s.slabs = slabCount;
+        return s;
+    }
+};
+
+// Position of a key among the first count keys of a B+tree page: how many order before it, or with
+// inclusive how many do not order after it. A page holds a few cache lines of keys, which a linear scan
+// without branches gets through faster than a binary search.
+template <typename Key, typename Compare, int CAPACITY>
+struct PageSearch {
+    template <typename K>
+    static int rank(const Compare &compare, const Key *keys, int count, const K &key, bool inclusive) {
+        int below = 0;
+        for (int i = 0; i < count; i++)
+            below += inclusive ? !compare(key, keys[i]) : compare(keys[i], key);
+        return below;
+    }
+};
+
+#ifdef __SSE2__
+// Under less<int> sixteen keys are compared at once with SSE2, which every x86-64 processor has. The
+// comparison masks are packed down to one bit per key; lanes past count are masked off.
+template <int CAPACITY>
+struct PageSearch<int, less<int>, CAPACITY> {
+    static_assert(CAPACITY % 16 == 0, "int pages are searched sixteen keys at a time");
+
+    template <typename K>
+    static int rank(const less<int> &, const int *keys, int count, const K &key, bool inclusive) {
+        __m128i probe = _mm_set1_epi32(key);
+        int below = 0;
+        for (int base = 0; base < count; base += 16) {
+            const __m128i *block = reinterpret_cast<const __m128i*>(keys + base);
+            __m128i lanes[4];
+            for (int i = 0; i < 4; i++) {
+                __m128i k = _mm_loadu_si128(block + i);
+                lanes[i] = inclusive ? _mm_cmpgt_epi32(k, probe) : _mm_cmplt_epi32(k, probe);
+            }
+            __m128i packed = _mm_packs_epi16(_mm_packs_epi32(lanes[0], lanes[1]), _mm_packs_epi32(lanes[2], lanes[3]));
+            int valid = min(16, count - base);
+            int hits = __builtin_popcount(_mm_movemask_epi8(packed) & ((1u << valid) - 1));
+            below += inclusive ? valid - hits : hits;
+        }
+        return below;
+    }
+};
+#endif
+
+// B+tree of values ordered by their keys under Compare, with the interface of RedBlackTree so the library
+// can run on either. Values live in the same kind of Allocator and are addressed by the same NodeIndex
+// handles; the tree itself only holds keys and handles, in pages of PAGE_KEYS sorted keys. Inner pages
+// route a descent with one separator between each pair of children and keep the number of values under
+// every child, for the order statistic queries. Leaf pages hold the handles and are linked both ways, so a
+// range is read as a run of consecutive pages. Every page but the root is kept at least half full, except
+// that a leaf split while appending past the last key keeps everything it had, so IDs inserted in
+// increasing order fill their leaves; the next erase there refills it from its full neighbour.
+//
+// A separator orders no later than any key to its right and no earlier than any key to its left. A lookup
+// of key descends into the child before the first separator above key, which leaves any equal key either
+// in the leaf it ends in or last in the leaf before; a range descends before the first separator not below
+// its start. Equal keys are allowed and an inserted key goes after them, as in RedBlackTree.
+//
+// Nothing is rotated or recolored, so the StatsPolicy keeps its initial values.
+template <typename Key, typename Value, typename Compare = less<Key>, typename Allocator = NodeStore<Key, Value>,
+          typename StatsPolicy = NoTreeStats>
+class BPlusTree {
+public:
+    // Two cache lines of keys per page, and at least eight.
+    static const int PAGE_KEYS = 128 / sizeof(Key) < 8 ? 8 : 128 / sizeof(Key);
+    static const int MIN_KEYS = PAGE_KEYS / 2;
+    // Pages at least half full hold 2^31 values in fewer levels than this.
+    static const int MAX_LEVELS = 32;
+    // Descents findMany keeps in flight at once.
+    static const int FIND_GROUP = 16;
+
+    // The keys come first, so a search reads whole cache lines of them.
+    struct alignas(64) Leaf {
+        Key keys[PAGE_KEYS];
+        int count;
+        PageIndex prev;
+        PageIndex next;
+        NodeIndex values[PAGE_KEYS];
+    };
+
+    // keys[i] separates children i and i + 1, so the last key slot is unused.
+    struct alignas(64) Inner {
+        Key keys[PAGE_KEYS];
+        int count;                        // children
+        PageIndex children[PAGE_KEYS];
+        uint32_t sizes[PAGE_KEYS];        // values under each child
+    };
+
+    typedef PageSearch<Key, Compare, PAGE_KEYS> Search;
+
+private:
+    // One inner page on the path of a descent and the child it went into.
+    struct Step {
+        PageIndex page;
+        int slot;
+    };
+
+    PageStore<Leaf> leaves;
+    PageStore<Inner> inners;
+    PageIndex root;
+    int levels;                // 0 when empty, 1 when the root is a leaf
+    PageIndex head;            // first and last leaf
+    PageIndex tail;
+    uint32_t count;
+    Allocator store;
+    Compare compare;
+    StatsPolicy counters;
+    // Where prev or next last found a value, so stepping through neighbours does not descend every time.
+    mutable PageIndex hintLeaf;
+    mutable int hintSlot;
+
+    BPlusTree(const BPlusTree &);
+    BPlusTree &operator=(const BPlusTree &);
+
+    template <typename K>
+    int rank(const Key *keys, int n, const K &key, bool inclusive) const {
+        return Search::rank(compare, keys, n, key, inclusive);
+    }
+
+    template <typename K>
+    bool equal(const Key &a, const K &b) const { return KeyEquivalence<Compare>::equal(compare, a, b); }
+
+    // Descending to the leaf for key, through the child before the first separator above key, or with
+    // inclusive false not below it. The inner pages passed are recorded in path when it is given.
+    template <typename K>
+    PageIndex descend(const K &key, bool inclusive, Step *path) const {
+        PageIndex page = root;
+        for (int depth = 0; depth + 1 < levels; depth++) {
+            const Inner &n = inners.page(page);
+            int slot = rank(n.keys, n.count - 1, key, inclusive);
+            if (path) {
+                path[depth].page = page;
+                path[depth].slot = slot;
+            }
+            page = n.children[slot];
+        }
+        return page;
+    }
+
+    // Moving path on to the leaf after the one it ends in, which must exist.
+    PageIndex nextLeaf(Step *path) const {
+        int depth = levels - 2;
+        while (path[depth].slot + 1 == inners.page(path[depth].page).count)
+            depth--;
+        path[depth].slot++;
+        PageIndex page = inners.page(path[depth].page).children[path[depth].slot];
+        for (depth++; depth + 1 < levels; depth++) {
+            path[depth].page = page;
+            path[depth].slot = 0;
+            page = inners.page(page).children[0];
+        }
+        return page;
+    }
+
+    // Leaf and slot holding the handle, from the hint or from a descent by its key.
+    void locate(NodeIndex index, PageIndex &leaf, int &slot) const {
+        if (hintLeaf != NO_PAGE && hintSlot < leaves.page(hintLeaf).count &&
+            leaves.page(hintLeaf).values[hintSlot] == index) {
+            leaf = hintLeaf;
+            slot = hintSlot;
+            return;
+        }
+        const Key &key = store.node(index).key;
+        leaf = descend(key, false, NULL);
+        slot = rank(leaves.page(leaf).keys, leaves.page(leaf).count, key, false);
+        while (slot == leaves.page(leaf).count || leaves.page(leaf).values[slot] != index) {
+            if (slot == leaves.page(leaf).count) {
+                leaf = leaves.page(leaf).next;
+                slot = 0;
+            } else {
+                slot++;
+            }
+        }
+    }
+
+    // The first handle in key order whose key equals the one at the leaf slot; equal keys may start in an
+    // earlier leaf.
+    NodeIndex firstEqual(PageIndex page, int slot) const {
+        Key key = leaves.page(page).keys[slot];
+        for (;;) {
+            const Leaf &leaf = leaves.page(page);
+            if (slot > 0 && equal(leaf.keys[slot - 1], key)) {
+                slot--;
+            } else if (slot == 0 && leaf.prev != NO_PAGE &&
+                       equal(leaves.page(leaf.prev).keys[leaves.page(leaf.prev).count - 1], key)) {
+                page = leaf.prev;
+                slot = leaves.page(page).count - 1;
+            } else {
+                return leaf.values[slot];
+            }
+        }
+    }
+
+    // What find returns for the key, given the leaf an inclusive descent for it reached.
+    template <typename K>
+    NodeIndex findInLeaf(PageIndex page, const K &key) const {
+        const Leaf &leaf = leaves.page(page);
+        int slot = rank(leaf.keys, leaf.count, key, true);
+        if (slot > 0)
+            return equal(leaf.keys[slot - 1], key) ? firstEqual(page, slot - 1) : NIL;
+        if (leaf.prev == NO_PAGE)
+            return NIL;
+        const Leaf &before = leaves.page(leaf.prev);
+        return equal(before.keys[before.count - 1], key) ? firstEqual(leaf.prev, before.count - 1) : NIL;
+    }
+
+    // Asking for every cache line of a page.
+    template <typename Page>
+    static void prefetchPage(const Page *page) {
+        for (size_t offset = 0; offset < sizeof(Page); offset += 64)
+            __builtin_prefetch(reinterpret_cast<const char*>(page) + offset);
+    }
+
+    // The handle at a leaf slot, remembered as the hint.
+    NodeIndex at(PageIndex leaf, int slot) const {
+        hintLeaf = leaf;
+        hintSlot = slot;
+        return leaves.page(leaf).values[slot];
+    }
+
+    PageIndex newLeaf() { return leaves.create(); }
+
+    void freeLeaf(PageIndex page) {
+        Leaf &leaf = leaves.page(page);
+        if (leaf.prev != NO_PAGE)
+            leaves.page(leaf.prev).next = leaf.next;
+        else
+            head = leaf.next;
+        if (leaf.next != NO_PAGE)
+            leaves.page(leaf.next).prev = leaf.prev;
+        else
+            tail = leaf.prev;
+        leaves.release(page);
+    }
+
+    // Taking child and the separator before it out of an inner page.
+    static void removeChild(Inner &n, int child) {
+        for (int i = child; i + 1 < n.count; i++) {
+            n.keys[i - 1] = n.keys[i];
+            n.children[i] = n.children[i + 1];
+            n.sizes[i] = n.sizes[i + 1];
+        }
+        n.count--;
+    }
+
+    // Putting a handle into the leaf an insertion descent along path reached, and counting it in the inner
+    // pages above.
+    void place(Step *path, PageIndex page, const Key &key, NodeIndex newNode) {
+        for (int depth = 0; depth + 1 < levels; depth++)
+            inners.page(path[depth].page).sizes[path[depth].slot]++;
+        count++;
+        Leaf &leaf = leaves.page(page);
+        int slot = rank(leaf.keys, leaf.count, key, true);
+        if (leaf.count == PAGE_KEYS) {
+            splitLeaf(path, page, slot, key, newNode);
+            return;
+        }
+        for (int i = leaf.count; i > slot; i--) {
+            leaf.keys[i] = leaf.keys[i - 1];
+            leaf.values[i] = leaf.values[i - 1];
+        }
+        leaf.keys[slot] = key;
+        leaf.values[slot] = newNode;
+        leaf.count++;
+    }
+
+    // Splitting a full leaf while inserting the key and handle at slot, then adding the new right leaf
+    // to the parents.
+    void splitLeaf(Step *path, PageIndex page, int slot, const Key &key, NodeIndex value) {
+        Leaf &left = leaves.page(page);
+        Key keys[PAGE_KEYS + 1];
+        NodeIndex values[PAGE_KEYS + 1];
+        for (int i = 0, j = 0; i <= PAGE_KEYS; i++) {
+            if (i == slot) {
+                keys[i] = key;
+                values[i] = value;
+            } else {
+                keys[i] = left.keys[j];
+                values[i] = left.values[j++];
+            }
+        }
+        bool appending = left.next == NO_PAGE && slot == PAGE_KEYS;
+        int kept = appending ? PAGE_KEYS : (PAGE_KEYS + 1) / 2;
+        PageIndex right = newLeaf();
+        Leaf &r = leaves.page(right);
+        for (int i = 0; i < kept; i++) {
+            left.keys[i] = keys[i];
+            left.values[i] = values[i];
+        }
+        for (int i = kept; i <= PAGE_KEYS; i++) {
+            r.keys[i - kept] = keys[i];
+            r.values[i - kept] = values[i];
+        }
+        left.count = kept;
+        r.count = PAGE_KEYS + 1 - kept;
+        r.prev = page;
+        r.next = left.next;
+        if (left.next != NO_PAGE)
+            leaves.page(left.next).prev = right;
+        else
+            tail = right;
+        left.next = right;
+        addChild(path, levels - 2, r.keys[0], right, left.count, r.count);
+    }
+
+    // Adding the right half of a split child to the inner page at depth of path, splitting that page in
+    // turn when it is full. A split of the root adds a level.
+    void addChild(Step *path, int depth, Key separator, PageIndex right, uint32_t leftSize, uint32_t rightSize) {
+        for (;; depth--) {
+            if (depth < 0) {
+                PageIndex top = inners.create();
+                Inner &t = inners.page(top);
+                t.count = 2;
+                t.keys[0] = separator;
+                t.children[0] = root;
+                t.children[1] = right;
+                t.sizes[0] = leftSize;
+                t.sizes[1] = rightSize;
+                root = top;
+                levels++;
+                return;
+            }
+            Inner &n = inners.page(path[depth].page);
+            int slot = path[depth].slot;
+            if (n.count < PAGE_KEYS) {
+                for (int i = n.count; i > slot + 1; i--) {
+                    n.keys[i - 1] = n.keys[i - 2];
+                    n.children[i] = n.children[i - 1];
+                    n.sizes[i] = n.sizes[i - 1];
+                }
+                n.keys[slot] = separator;
+                n.children[slot + 1] = right;
+                n.sizes[slot] = leftSize;
+                n.sizes[slot + 1] = rightSize;
+                n.count++;
+                return;
+            }
+
+            // Laying out the PAGE_KEYS + 1 children, then keeping the first half and moving the rest
+            Key keys[PAGE_KEYS];
+            PageIndex children[PAGE_KEYS + 1];
+            uint32_t sizes[PAGE_KEYS + 1];
+            for (int i = 0, j = 0; i <= PAGE_KEYS; i++) {
+                if (i == slot + 1) {
+                    children[i] = right;
+                    sizes[i] = rightSize;
+                    keys[i - 1] = separator;
+                } else {
+                    children[i] = n.children[j];
+                    sizes[i] = i == slot ? leftSize : n.sizes[j];
+                    if (i > 0)
+                        keys[i - 1] = n.keys[j - 1];
+                    j++;
+                }
+            }
+            int kept = (PAGE_KEYS + 1) / 2;
+            PageIndex sibling = inners.create();
+            Inner &s = inners.page(sibling);
+            leftSize = rightSize = 0;
+            for (int i = 0; i <= PAGE_KEYS; i++) {
+                if (i < kept) {
+                    n.children[i] = children[i];
+                    n.sizes[i] = sizes[i];
+                    if (i > 0)
+                        n.keys[i - 1] = keys[i - 1];
+                    leftSize += sizes[i];
+                } else {
+                    s.children[i - kept] = children[i];
+                    s.sizes[i - kept] = sizes[i];
+                    if (i > kept)
+                        s.keys[i - kept - 1] = keys[i - 1];
+                    rightSize += sizes[i];
+                }
+            }
+            n.count = kept;
+            s.count = PAGE_KEYS + 1 - kept;
+            separator = keys[kept - 1];
+            right = sibling;
+        }
+    }
+
+    // Refilling a leaf that fell below MIN_KEYS from a neighbour under the same parent, or merging it with
+    // one, then refilling the parent if it lost a child.
+    void refillLeaf(Step *path, PageIndex page) {
+        Inner &parent = inners.page(path[levels - 2].page);
+        int slot = path[levels - 2].slot;
+        Leaf &leaf = leaves.page(page);
+        if (slot > 0) {
+            Leaf &left = leaves.page(parent.children[slot - 1]);
+            if (left.count > MIN_KEYS) {
+                for (int i = leaf.count; i > 0; i--) {
+                    leaf.keys[i] = leaf.keys[i - 1];
+                    leaf.values[i] = leaf.values[i - 1];
+                }
+                left.count--;
+                leaf.keys[0] = left.keys[left.count];
+                leaf.values[0] = left.values[left.count];
+                leaf.count++;
+                parent.keys[slot - 1] = leaf.keys[0];
+                parent.sizes[slot - 1]--;
+                parent.sizes[slot]++;
+                return;
+            }
+        }
+        if (slot + 1 < parent.count) {
+            Leaf &right = leaves.page(parent.children[slot + 1]);
+            if (right.count > MIN_KEYS) {
+                leaf.keys[leaf.count] = right.keys[0];
+                leaf.values[leaf.count] = right.values[0];
+                leaf.count++;
+                right.count--;
+                for (int i = 0; i < right.count; i++) {
+                    right.keys[i] = right.keys[i + 1];
+                    right.values[i] = right.values[i + 1];
+                }
+                parent.keys[slot] = right.keys[0];
+                parent.sizes[slot]++;
+                parent.sizes[slot + 1]--;
+                return;
+            }
+        }
+        // Neither neighbour can spare a key, so the two fit in one leaf
+        int into = slot > 0 ? slot - 1 : slot;
+        Leaf &target = leaves.page(parent.children[into]);
+        PageIndex emptied = parent.children[into + 1];
+        Leaf &source = leaves.page(emptied);
+        for (int i = 0; i < source.count; i++) {
+            target.keys[target.count + i] = source.keys[i];
+            target.values[target.count + i] = source.values[i];
+        }
+        target.count += source.count;
+        parent.sizes[into] += parent.sizes[into + 1];
+        removeChild(parent, into + 1);
+        freeLeaf(emptied);
+        refillInner(path, levels - 2);
+    }
+
+    // The same for the inner page at depth of path, rotating separators through the parent. A root left
+    // with one child hands the root to it.
+    void refillInner(Step *path, int depth) {
+        for (;; depth--) {
+            PageIndex page = path[depth].page;
+            Inner &n = inners.page(page);
+            if (depth == 0) {
+                if (n.count == 1) {
+                    root = n.children[0];
+                    levels--;
+                    inners.release(page);
+                }
+                return;
+            }
+            if (n.count >= MIN_KEYS)
+                return;
+            Inner &parent = inners.page(path[depth - 1].page);
+            int slot = path[depth - 1].slot;
+            if (slot > 0) {
+                Inner &left = inners.page(parent.children[slot - 1]);
+                if (left.count > MIN_KEYS) {
+                    for (int i = n.count; i > 0; i--) {
+                        n.children[i] = n.children[i - 1];
+                        n.sizes[i] = n.sizes[i - 1];
+                        if (i > 1)
+                            n.keys[i - 1] = n.keys[i - 2];
+                    }
+                    n.keys[0] = parent.keys[slot - 1];
+                    left.count--;
+                    n.children[0] = left.children[left.count];
+                    n.sizes[0] = left.sizes[left.count];
+                    n.count++;
+                    parent.keys[slot - 1] = left.keys[left.count - 1];
+                    parent.sizes[slot - 1] -= n.sizes[0];
+                    parent.sizes[slot] += n.sizes[0];
+                    return;
+                }
+            }
+            if (slot + 1 < parent.count) {
+                Inner &right = inners.page(parent.children[slot + 1]);
+                if (right.count > MIN_KEYS) {
+                    n.keys[n.count - 1] = parent.keys[slot];
+                    n.children[n.count] = right.children[0];
+                    n.sizes[n.count] = right.sizes[0];
+                    n.count++;
+                    parent.keys[slot] = right.keys[0];
+                    parent.sizes[slot] += right.sizes[0];
+                    parent.sizes[slot + 1] -= right.sizes[0];
+                    for (int i = 0; i + 1 < right.count; i++) {
+                        right.children[i] = right.children[i + 1];
+                        right.sizes[i] = right.sizes[i + 1];
+                        if (i + 2 < right.count)
+                            right.keys[i] = right.keys[i + 1];
+                    }
+                    right.count--;
+                    return;
+                }
+            }
+            int into = slot > 0 ? slot - 1 : slot;
+            Inner &target = inners.page(parent.children[into]);
+            PageIndex emptied = parent.children[into + 1];
+            Inner &source = inners.page(emptied);
+            target.keys[target.count - 1] = parent.keys[into];
+            for (int i = 0; i < source.count; i++) {
+                target.children[target.count + i] = source.children[i];
+                target.sizes[target.count + i] = source.sizes[i];
+                if (i + 1 < source.count)
+                    target.keys[target.count + i] = source.keys[i];
+            }
+            target.count += source.count;
+            parent.sizes[into] += parent.sizes[into + 1];
+            removeChild(parent, into + 1);
+            inners.release(emptied);
+        }
+    }
+
+    // Building the tree from handles in key order, spreading them evenly over as few pages as hold them.
+    void build(const vector<NodeIndex> &nodes) {
+        leaves.reset();
+        inners.reset();
+        root = head = tail = NO_PAGE;
+        levels = 0;
+        count = nodes.size();
+        hintLeaf = NO_PAGE;
+        if (nodes.empty())
+            return;
+        vector<PageIndex> pages;
+        vector<Key> lows;
+        vector<uint32_t> sizes;
+        size_t pageCount = (nodes.size() + PAGE_KEYS - 1) / PAGE_KEYS;
+        for (size_t p = 0, next = 0; p < pageCount; p++) {
+            size_t take = nodes.size() / pageCount + (p < nodes.size() % pageCount ? 1 : 0);
+            PageIndex page = newLeaf();
+            Leaf &leaf = leaves.page(page);
+            for (size_t i = 0; i < take; i++) {
+                leaf.keys[i] = store.node(nodes[next]).key;
+                leaf.values[i] = nodes[next++];
+            }
+            leaf.count = take;
+            leaf.prev = tail;
+            if (tail != NO_PAGE)
+                leaves.page(tail).next = page;
+            else
+                head = page;
+            tail = page;
+            pages.push_back(page);
+            lows.push_back(leaf.keys[0]);
+            sizes.push_back(take);
+        }
+        levels = 1;
+        while (pages.size() > 1) {
+            vector<PageIndex> upper;
+            vector<Key> upperLows;
+            vector<uint32_t> upperSizes;
+            pageCount = (pages.size() + PAGE_KEYS - 1) / PAGE_KEYS;
+            for (size_t p = 0, next = 0; p < pageCount; p++) {
+                size_t take = pages.size() / pageCount + (p < pages.size() % pageCount ? 1 : 0);
+                PageIndex page = inners.create();
+                Inner &n = inners.page(page);
+                uint32_t total = 0;
+                upperLows.push_back(lows[next]);
+                for (size_t i = 0; i < take; i++, next++) {
+                    n.children[i] = pages[next];
+                    n.sizes[i] = sizes[next];
+                    if (i > 0)
+                        n.keys[i - 1] = lows[next];
+                    total += sizes[next];
+                }
+                n.count = take;
+                upper.push_back(page);
+                upperSizes.push_back(total);
+            }
+            pages.swap(upper);
+            lows.swap(upperLows);
+            sizes.swap(upperSizes);
+            levels++;
+        }
+        root = pages[0];
+    }
+
+public:
+    BPlusTree() : root(NO_PAGE), levels(0), head(NO_PAGE), tail(NO_PAGE), count(0), hintLeaf(NO_PAGE), hintSlot(0) {}
+
+    // The owner must release every node first.
+    ~BPlusTree() {}
+
+    // Accessors for the values stored at a handle, and its key in the store's node.
+    typedef RBNode<Key> Node;
+    const Node &node(NodeIndex index) const { return store.node(index); }
+    Value &value(NodeIndex index) { return store.value(index); }
+    const Value &value(NodeIndex index) const { return store.value(index); }
+
+    uint32_t size() const { return count; }
+    const Allocator &nodes() const { return store; }
+    StatsPolicy &statistics() { return counters; }
+    const StatsPolicy &statistics() const { return counters; }
+
+    // The pages, for concurrent readers that check every index they follow.
+    PageIndex rootPage() const { return root; }
+    int levelCount() const { return levels; }
+    bool leafAllocated(PageIndex page) const { return leaves.allocated(page); }
+    bool innerAllocated(PageIndex page) const { return inners.allocated(page); }
+    const Leaf &leaf(PageIndex page) const { return leaves.page(page); }
+    const Inner &inner(PageIndex page) const { return inners.page(page); }
+
+    // Memory held by the pages.
+    AllocatorStats pageStats() const {
+        AllocatorStats s = leaves.stats();
+        s += inners.stats();
+        return s;
+    }
+
+    template <typename... Args>
+    NodeIndex create(const Key &key, Args&&... args) {
+        return store.create(key, std::forward<Args>(args)...);
+    }
+
+    void release(NodeIndex index) { store.release(index); }
+
+    // Adding a handle from create to the tree. A key equal to existing ones goes after them.
+    void insert(NodeIndex newNode) {
+        const Key &key = store.node(newNode).key;
+        if (levels == 0) {
+            root = head = tail = newLeaf();
+            levels = 1;
+        }
+        Step path[MAX_LEVELS];
+        place(path, descend(key, true, path), key, newNode);
+    }
+
+    // Adding a handle from create to the tree unless a key equal to its own is already there, in one
+    // descent. Returns the handle holding the key: the one find would return, which leaves newNode out of
+    // the tree, or newNode itself.
+    NodeIndex insertOrFind(NodeIndex newNode) {
+        const Key &key = store.node(newNode).key;
+        if (levels == 0) {
+            root = head = tail = newLeaf();
+            levels = 1;
+        }
+        Step path[MAX_LEVELS];
+        PageIndex page = descend(key, true, path);
+        const Leaf &leaf = leaves.page(page);
+        int slot = rank(leaf.keys, leaf.count, key, true);
+        if (slot > 0 && equal(leaf.keys[slot - 1], key))
+            return firstEqual(page, slot - 1);
+        if (slot == 0 && leaf.prev != NO_PAGE) {
+            const Leaf &before = leaves.page(leaf.prev);
+            if (equal(before.keys[before.count - 1], key))
+                return firstEqual(leaf.prev, before.count - 1);
+        }
+        place(path, page, key, newNode);
+        return newNode;
+    }
+
+    // Taking the handle out of the tree. Values never move, so references to them stay valid; the caller
+    // releases the handle once nothing can still be looking at it.
+    void erase(NodeIndex index) {
+        const Key &key = store.node(index).key;
+        Step path[MAX_LEVELS];
+        PageIndex page = descend(key, false, path);
+        int slot = rank(leaves.page(page).keys, leaves.page(page).count, key, false);
+        // Equal keys may run on into the following leaves
+        while (slot == leaves.page(page).count || leaves.page(page).values[slot] != index) {
+            if (slot == leaves.page(page).count) {
+                page = nextLeaf(path);
+                slot = 0;
+            } else {
+                slot++;
+            }
+        }
+        for (int depth = 0; depth + 1 < levels; depth++)
+            inners.page(path[depth].page).sizes[path[depth].slot]--;
+        count--;
+        Leaf &leaf = leaves.page(page);
+        leaf.count--;
+        for (int i = slot; i < leaf.count; i++) {
+            leaf.keys[i] = leaf.keys[i + 1];
+            leaf.values[i] = leaf.values[i + 1];
+        }
+        if (levels == 1) {
+            if (leaf.count == 0) {
+                freeLeaf(page);
+                root = NO_PAGE;
+                levels = 0;
+            }
+        } else if (leaf.count < MIN_KEYS) {
+            refillLeaf(path, page);
+        }
+    }
+
+    // Releasing every handle and page of the tree.
+    void clear() {
+        for (PageIndex page = head; page != NO_PAGE; page = leaves.page(page).next) {
+            const Leaf &leaf = leaves.page(page);
+            for (int i = 0; i < leaf.count; i++)
+                store.release(leaf.values[i]);
+        }
+        build(vector<NodeIndex>());
+        store.reset();
+    }
+
+    // Handle holding a key equal to the given one, NIL when there is none.
+    template <typename K>
+    NodeIndex find(const K &key) const {
+        if (levels == 0)
+            return NIL;
+        return findInLeaf(descend(key, true, NULL), key);
+    }
+
+    // find for each of n keys, putting the handle for keys[i] in found[i]. Groups of FIND_GROUP descents
+    // go down the levels in lockstep, each step prefetching the keys of the page every one moves to, so
+    // that their cache misses overlap.
+    template <typename K>
+    void findMany(const K *keys, size_t n, NodeIndex *found) const {
+        for (size_t start = 0; start < n; start += FIND_GROUP) {
+            int group = (int)min(n - start, (size_t)FIND_GROUP);
+            const K *key = keys + start;
+            if (levels == 0) {
+                fill(found + start, found + start + group, NIL);
+                continue;
+            }
+            PageIndex page[FIND_GROUP];
+            fill(page, page + group, root);
+            for (int depth = 0; depth + 1 < levels; depth++) {
+                bool leafNext = depth + 2 == levels;
+                for (int i = 0; i < group; i++) {
+                    const Inner &n = inners.page(page[i]);
+                    page[i] = n.children[rank(n.keys, n.count - 1, key[i], true)];
+                    if (leafNext)
+                        prefetchPage(&leaves.page(page[i]));
+                    else
+                        prefetchPage(&inners.page(page[i]));
+                }
+            }
+            for (int i = 0; i < group; i++)
+                found[start + i] = findInLeaf(page[i], key[i]);
+        }
+    }
+
+    // Handles with the greatest key <= the given one and the smallest key >= it, as RedBlackTree finds them.
+    template <typename K>
+    void floorCeiling(const K &key, NodeIndex &floorNode, NodeIndex &ceilingNode) const {
+        floorNode = ceilingNode = NIL;
+        if (levels == 0)
+            return;
+        const Leaf &leaf = leaves.page(descend(key, true, NULL));
+        int slot = rank(leaf.keys, leaf.count, key, true);
+        const Key *floorKey = NULL;
+        if (slot > 0) {
+            floorNode = leaf.values[slot - 1];
+            floorKey = &leaf.keys[slot - 1];
+        } else if (leaf.prev != NO_PAGE) {
+            const Leaf &before = leaves.page(leaf.prev);
+            floorNode = before.values[before.count - 1];
+            floorKey = &before.keys[before.count - 1];
+        }
+        if (floorKey != NULL && equal(*floorKey, key)) {
+            ceilingNode = floorNode;
+            return;
+        }
+        if (slot < leaf.count)
+            ceilingNode = leaf.values[slot];
+        else if (leaf.next != NO_PAGE)
+            ceilingNode = leaves.page(leaf.next).values[0];
+    }
+
+    NodeIndex first() const { return levels == 0 ? NIL : leaves.page(head).values[0]; }
+    NodeIndex last() const { return levels == 0 ? NIL : leaves.page(tail).values[leaves.page(tail).count - 1]; }
+
+    // Number of pages on the path from the root to a leaf.
+    int height() const { return levels; }
+
+    // There are no colors; 0 keeps the figure of Stats() meaningful to compare.
+    int blackHeight() const { return 0; }
+
+    void collectInOrder(vector<NodeIndex> &nodes) const {
+        for (PageIndex page = head; page != NO_PAGE; page = leaves.page(page).next) {
+            const Leaf &leaf = leaves.page(page);
+            nodes.insert(nodes.end(), leaf.values, leaf.values + leaf.count);
+        }
+    }
+
+    // Linking sorted handles into the tree. With rebuild they are every handle the tree is to hold;
+    // otherwise they all lie below or above the existing keys. Either way the pages are built anew, in
+    // time linear in the size of the tree.
+    void linkSorted(vector<NodeIndex> &nodes, bool rebuild) {
+        if (rebuild || levels == 0) {
+            build(nodes);
+            return;
+        }
+        vector<NodeIndex> all;
+        all.reserve(count + nodes.size());
+        bool below = compare(store.node(nodes.back()).key, leaves.page(head).keys[0]);
+        if (below)
+            all.insert(all.end(), nodes.begin(), nodes.end());
+        collectInOrder(all);
+        if (!below)
+            all.insert(all.end(), nodes.begin(), nodes.end());
+        build(all);
+    }
+
+    template <typename K>
+    int countBelow(const K &key, bool inclusive) const {
+        int below = 0;
+        if (levels == 0)
+            return 0;
+        PageIndex page = root;
+        for (int depth = 0; depth + 1 < levels; depth++) {
+            const Inner &n = inners.page(page);
+            int slot = rank(n.keys, n.count - 1, key, inclusive);
+            for (int i = 0; i < slot; i++)
+                below += n.sizes[i];
+            page = n.children[slot];
+        }
+        const Leaf &leaf = leaves.page(page);
+        return below + rank(leaf.keys, leaf.count, key, inclusive);
+    }
+
+    NodeIndex select(long long rank) const {
+        if (rank < 0 || rank >= count)
+            return NIL;
+        PageIndex page = root;
+        for (int depth = 0; depth + 1 < levels; depth++) {
+            const Inner &n = inners.page(page);
+            int slot = 0;
+            while (rank >= n.sizes[slot])
+                rank -= n.sizes[slot++];
+            page = n.children[slot];
+        }
+        return at(page, (int)rank);
+    }
+
+    NodeIndex prev(NodeIndex current) const {
+        PageIndex page;
+        int slot;
+        locate(current, page, slot);
+        if (slot > 0)
+            return at(page, slot - 1);
+        page = leaves.page(page).prev;
+        return page == NO_PAGE ? NIL : at(page, leaves.page(page).count - 1);
+    }
+
+    NodeIndex next(NodeIndex current) const {
+        PageIndex page;
+        int slot;
+        locate(current, page, slot);
+        if (slot + 1 < leaves.page(page).count)
+            return at(page, slot + 1);
+        page = leaves.page(page).next;
+        return page == NO_PAGE ? NIL : at(page, 0);
+    }
+
+    // Calling visit(handle) for every key in [low, high], in order, along the leaf chain.
+    template <typename K, typename Visit>
+    void forEachInRange(const K &low, const K &high, Visit visit) const {
+        if (levels == 0)
+            return;
+        PageIndex page = descend(low, false, NULL);
+        int slot = rank(leaves.page(page).keys, leaves.page(page).count, low, false);
+        for (; page != NO_PAGE; page = leaves.page(page).next, slot = 0) {
+            const Leaf &leaf = leaves.page(page);
+            for (; slot < leaf.count; slot++) {
+                if (compare(high, leaf.keys[slot]))
+                    return;
+                visit(leaf.values[slot]);
+            }
+        }
+    }
+
+    // Calling visit(handle, depth) for every value, where depth counts the pages a lookup reads.
+    template <typename Visit>
+    void forEachWithDepth(Visit visit) const {
+        for (PageIndex page = head; page != NO_PAGE; page = leaves.page(page).next) {
+            const Leaf &leaf = leaves.page(page);
+            for (int i = 0; i < leaf.count; i++)
+                visit(leaf.values[i], levels);
+        }
+    }
+};
+
+// Books each patron holds or waits for, keyed by patron ID, so a patron's state is found without walking
+// the tree. Patrons live in an open addressing table with linear probing; a patron with nothing held or
+// reserved is removed, so only active patrons take a slot. Each (patron, book) relation is a 12-byte link in
+// a pooled singly linked list, with freed links threaded onto a freelist; a reservation link also keeps the
+// handle of the reservation in the book's heap. Every operation costs time in proportion to the patron's own
+// number of books.
+class PatronIndex {
+    struct Slot {
+        int patronID;
+        uint32_t held;      // first link of the borrowed list, 0 when empty
+        uint32_t waiting;   // first link of the reservation list, 0 when empty
+        bool used() const { return held != 0 || waiting != 0; }
+    };
+    struct Link {
+        int bookID;
+        uint32_t next;
+        int handle;     // reservation handle in the book's heap, -1 for a borrowed book
+    };
+
+    vector<Slot> slots;
+    vector<Link> links;   // links[0] is the end of list marker
+    uint32_t freeLinks;
+    size_t patronCount;
+    int shift;            // 32 - log2(slots.size()), so home() keeps the top bits of the hash
+
+    size_t home(int patronID) const {
+        return ((uint32_t)patronID * 2654435769u) >> shift;
+    }
+
+    // Slot of the patron, or the empty slot where it would go.
+    size_t find(int patronID) const {
+        size_t i = home(patronID);
+        while (slots[i].used() && slots[i].patronID != patronID)
+            i = (i + 1) & (slots.size() - 1);
+        return i;
+    }
+
+    void grow() {
+        vector<Slot> old;
+        old.swap(slots);
+        slots.assign(old.empty() ? 16 : old.size() * 2, Slot());
+        shift = old.empty() ? 28 : shift - 1;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].used())
+                slots[find(old[i].patronID)] = old[i];
+        }
+    }
+
+    // Removing the slot at i and shifting later members of its probe run back, so lookups stay correct
+    // without tombstones.
+    void erase(size_t i) {
+        size_t mask = slots.size() - 1;
+        size_t j = i;
+        while (true) {
+            slots[i] = Slot();
+            while (true) {
+                j = (j + 1) & mask;
+                if (!slots[j].used())
+                    return;
+                size_t k = home(slots[j].patronID);
+                // Slot j may move into the hole at i only if its home is not in (i, j]
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                    continue;
+                break;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    void add(int patronID, int bookID, int handle, bool held) {
+        if ((patronCount + 1) * 4 > slots.size() * 3)
+            grow();
+        size_t i = find(patronID);
+        if (!slots[i].used()) {
+            slots[i].patronID = patronID;
+            patronCount++;
+        }
+        uint32_t link = freeLinks;
+        if (link != 0) {
+            freeLinks = links[link].next;
+        } else {
+            link = links.size();
+            links.push_back(Link());
+        }
+        uint32_t &head = held ? slots[i].held : slots[i].waiting;
+        links[link].bookID = bookID;
+        links[link].handle = handle;
+        links[link].next = head;
+        head = link;
+    }
+
+    // Unlinking the patron's link to the book; a handle of -1 matches any link to it.
+    void remove(int patronID, int bookID, int handle, bool held) {
+        if (slots.empty())
+            return;
+        size_t i = find(patronID);
+        if (!slots[i].used())
+            return;
+        uint32_t *previous = held ? &slots[i].held : &slots[i].waiting;
+        while (*previous != 0 && (links[*previous].bookID != bookID || (handle >= 0 && links[*previous].handle != handle)))
+            previous = &links[*previous].next;
+        if (*previous == 0)
+            return;
+        uint32_t link = *previous;
+        *previous = links[link].next;
+        links[link].next = freeLinks;
+        freeLinks = link;
+        if (!slots[i].used()) {
+            erase(i);
+            patronCount--;
+        }
+    }
+
+    void collect(uint32_t link, vector<int> &bookIDs) const {
+        for (; link != 0; link = links[link].next)
+            bookIDs.push_back(links[link].bookID);
+        sort(bookIDs.begin(), bookIDs.end());
+    }
+
+public:
+    PatronIndex() : links(1), freeLinks(0), patronCount(0), shift(32) {}
+
+    void addBorrowed(int patronID, int bookID) { add(patronID, bookID, -1, true); }
+    void removeBorrowed(int patronID, int bookID) { remove(patronID, bookID, -1, true); }
+    void addReservation(int patronID, int bookID, int handle) { add(patronID, bookID, handle, false); }
+    void removeReservation(int patronID, int bookID, int handle) { remove(patronID, bookID, handle, false); }
+
+    // Heap handle of the patron's reservation for the book, -1 when they have none.
+    int reservationHandle(int patronID, int bookID) const {
+        if (slots.empty())
+            return -1;
+        size_t i = find(patronID);
+        if (!slots[i].used())
+            return -1;
+        for (uint32_t link = slots[i].waiting; link != 0; link = links[link].next) {
+            if (links[link].bookID == bookID)
+                return links[link].handle;
+        }
+        return -1;
+    }
+
+    // IDs of the books the patron holds and waits for, each in increasing order.
+    void books(int patronID, vector<int> &borrowed, vector<int> &reserved) const {
+        borrowed.clear();
+        reserved.clear();
+        if (slots.empty())
+            return;
+        size_t i = find(patronID);
+        if (!slots[i].used())
+            return;
+        collect(slots[i].held, borrowed);
+        collect(slots[i].waiting, reserved);
+    }
+
+    // Number of patrons holding or waiting for at least one book.
+    size_t patrons() const { return patronCount; }
+
+    // Bytes held by the table and the link pool.
+    size_t bytes() const { return slots.capacity() * sizeof(Slot) + links.capacity() * sizeof(Link); }
+
+    void clear() {
+        vector<Slot>().swap(slots);
+        links.assign(1, Link());
+        freeLinks = 0;
+        patronCount = 0;
+        shift = 32;
+    }
+};
+
+// Interned author names. Each distinct author string is stored once, as the key of a hash map that counts
+// the books referring to it, and books point at that key; it stays put until its last book is released.
+class AuthorTable {
+    typedef unordered_map<string, size_t> Names;
+    Names names;
+
+public:
+    typedef Names::iterator Entry;
+
+    // Entry of an author, created with no books if it is new. Loaders that see the same author many times
+    // keep the entry and call addBook on it directly.
+    Entry entry(string author) {
+        return names.insert(make_pair(std::move(author), (size_t)0)).first;
+    }
+
+    // Counting one more book by the author, returning the interned name.
+    const string *addBook(Entry author) {
+        author->second++;
+        return &author->first;
+    }
+
+    // Interning the author of a new book.
+    const string *intern(string author) {
+        return addBook(entry(std::move(author)));
+    }
+
+    // Dropping a book from its author, and the author once no book refers to it.
+    void release(const string *author) {
+        Names::iterator it = names.find(*author);
+        if (it != names.end() && --it->second == 0)
+            names.erase(it);
+    }
+
+    size_t size() const { return names.size(); }
+
+    // Approximate bytes held: buckets, hash nodes and the names that do not fit inline.
+    size_t bytes() const {
+        size_t total = names.bucket_count() * sizeof(void *);
+        for (Names::const_iterator it = names.begin(); it != names.end(); ++it) {
+            total += sizeof(Names::value_type) + 2 * sizeof(void *);
+            if (it->first.capacity() > 15)
+                total += it->first.capacity() + 1;
+        }
+        return total;
+    }
+
+    void clear() { names.clear(); }
+};
+
+// Books sorted by title or by author for prefix search, ordered by the unquoted text and then book ID.
+// Entries are held in blocks of at most BLOCK_SIZE, each block sorted and the blocks in order, so an insert
+// or delete shifts entries within one block instead of the whole table; the last entry of every block is
+// mirrored in one compact array that block lookups search. An entry is 16 bytes: a key that settles most
+// comparisons without touching the book, the node holding the book, and its ID. For titles the key is the
+// first 8 bytes of the text packed big-endian. For authors it is the interned name, so books by the same
+// author compare by ID alone and other authors are compared without loading the book.
+class BookIndex {
+public:
+    enum Field { TITLE, AUTHOR };
+
+private:
+    struct Entry {
+        uint64_t key;
+        NodeIndex node;
+        int bookID;
+    };
+
+    // What an entry is compared against: a text, its entry key (0 when there is none) and a book ID.
+    struct Probe {
+        StringRef text;
+        uint64_t key;
+        int bookID;
+    };
+
+    static const size_t BLOCK_SIZE = 512;
+
+    const BookStore &store;
+    Field field;
+    vector<vector<Entry> > blocks;
+    vector<Entry> lasts;    // last entry of every block
+    size_t count;
+
+    static uint64_t packPrefix(StringRef text) {
+        uint64_t packed = 0;
+        for (size_t i = 0; i < 8; i++)
+            packed = (packed << 8) | (i < text.length ? (unsigned char)text.data[i] : 0);
+        return packed;
+    }
+
+    StringRef textOf(const Entry &entry) const {
+        if (field == AUTHOR)
+            return searchText(*(const string *)(uintptr_t)entry.key);
+        return searchText(store.value(entry.node).BookName);
+    }
+
+    Probe probeOf(const Entry &entry) const {
+        Probe probe = {textOf(entry), entry.key, entry.bookID};
+        return probe;
+    }
+
+    Entry makeEntry(NodeIndex node) const {
+        const BookNode &book = store.value(node);
+        Entry entry;
+        entry.key = field == TITLE ? packPrefix(searchText(book.BookName)) : (uint64_t)(uintptr_t)book.AuthorName;
+        entry.node = node;
+        entry.bookID = book.BookId;
+        return entry;
+    }
+
+    // Ordering an entry against a probe: <0, 0 or >0.
+    int compare(const Entry &entry, const Probe &probe) const {
+        if (field == TITLE) {
+            if (entry.key != probe.key)
+                return entry.key < probe.key ? -1 : 1;
+            // Texts shorter than 8 bytes are decided by the zero padded prefix alone
+            if (probe.text.length >= 8) {
+                int c = compareText(textOf(entry), probe.text);
+                if (c != 0)
+                    return c;
+            }
+        } else if (entry.key != probe.key) {
+            int c = compareText(textOf(entry), probe.text);
+            if (c != 0)
+                return c;
+        }
+        return entry.bookID < probe.bookID ? -1 : (entry.bookID > probe.bookID ? 1 : 0);
+    }
+
+    // Block that holds (or would hold) the probe: the first whose last entry is not below it.
+    size_t findBlock(const Probe &probe) const {
+        size_t lo = 0, hi = lasts.size() - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (compare(lasts[mid], probe) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // Position of the first entry in the block that is not below the probe.
+    size_t findPosition(const vector<Entry> &block, const Probe &probe) const {
+        size_t lo = 0, hi = block.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (compare(block[mid], probe) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // Locating the entry of the book stored at node, from the book currently there.
+    bool locate(NodeIndex node, size_t &blockIndex, size_t &position) const {
+        if (blocks.empty())
+            return false;
+        Entry wanted = makeEntry(node);
+        Probe probe = probeOf(wanted);
+        blockIndex = findBlock(probe);
+        position = findPosition(blocks[blockIndex], probe);
+        // Equal keys (a duplicated ID with the same text) may spread over several blocks
+        for (; blockIndex < blocks.size(); blockIndex++, position = 0) {
+            const vector<Entry> &block = blocks[blockIndex];
+            for (; position < block.size(); position++) {
+                if (block[position].node == node)
+                    return true;
+                if (compare(block[position], probe) != 0)
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    void newBlock(size_t at) {
+        blocks.insert(blocks.begin() + at, vector<Entry>());
+        blocks[at].reserve(BLOCK_SIZE + 1);
+        lasts.insert(lasts.begin() + at, Entry());
+    }
+
+public:
+    BookIndex(const BookStore &store, Field field) : store(store), field(field), count(0) {}
+
+    // Adding the book stored at node.
+    void insert(NodeIndex node) {
+        Entry entry = makeEntry(node);
+        Probe probe = probeOf(entry);
+        if (blocks.empty())
+            newBlock(0);
+        size_t b = findBlock(probe);
+        vector<Entry> &block = blocks[b];
+        size_t position = findPosition(block, probe);
+        block.insert(block.begin() + position, entry);
+        lasts[b] = block.back();
+        count++;
+        if (block.size() > BLOCK_SIZE) {
+            newBlock(b + 1);
+            vector<Entry> &full = blocks[b];
+            blocks[b + 1].assign(full.begin() + full.size() / 2, full.end());
+            full.resize(full.size() / 2);
+            lasts[b] = full.back();
+            lasts[b + 1] = blocks[b + 1].back();
+        }
+    }
+
+    // Adding many books at once. A batch that is large next to the index is merged by sorting everything
+    // and cutting fresh blocks; a small one is inserted entry by entry.
+    void insertMany(const vector<NodeIndex> &nodes) {
+        if (nodes.size() * 8 < count) {
+            for (size_t i = 0; i < nodes.size(); i++)
+                insert(nodes[i]);
+            return;
+        }
+        vector<Entry> entries;
+        entries.reserve(count + nodes.size());
+        for (size_t b = 0; b < blocks.size(); b++)
+            entries.insert(entries.end(), blocks[b].begin(), blocks[b].end());
+        for (size_t i = 0; i < nodes.size(); i++)
+            entries.push_back(makeEntry(nodes[i]));
+        sort(entries.begin(), entries.end(), [this](const Entry &a, const Entry &b) { return compare(a, probeOf(b)) < 0; });
+        blocks.clear();
+        lasts.clear();
+        // Blocks start three quarters full so the next inserts do not split them straight away
+        const size_t fill = BLOCK_SIZE * 3 / 4;
+        for (size_t i = 0; i < entries.size(); i += fill) {
+            newBlock(blocks.size());
+            blocks.back().assign(entries.begin() + i, entries.begin() + min(entries.size(), i + fill));
+            lasts.back() = blocks.back().back();
+        }
+        count = entries.size();
+    }
+
+    // Removing the book stored at node; it must still be there.
+    void remove(NodeIndex node) {
+        size_t b, position;
+        if (!locate(node, b, position))
+            return;
+        vector<Entry> &block = blocks[b];
+        block.erase(block.begin() + position);
+        count--;
+        if (block.empty()) {
+            blocks.erase(blocks.begin() + b);
+            lasts.erase(lasts.begin() + b);
+        } else {
+            lasts[b] = block.back();
+        }
+    }
+
+    // Calling visit(node) for every book whose text starts with prefix, in index order.
+    template <typename Visitor>
+    void forEachPrefix(StringRef prefix, Visitor visit) const {
+        if (blocks.empty())
+            return;
+        Probe probe = {prefix, field == TITLE ? packPrefix(prefix) : 0, INT_MIN};
+        size_t b = findBlock(probe);
+        size_t position = findPosition(blocks[b], probe);
+        // Title prefixes of up to 8 bytes are matched on the packed prefix alone
+        uint64_t mask = prefix.length >= 8 ? ~0ULL : ~(~0ULL >> (8 * prefix.length));
+        uint64_t matchedKey = 0;
+        for (; b < blocks.size(); b++, position = 0) {
+            const vector<Entry> &block = blocks[b];
+            for (; position < block.size(); position++) {
+                const Entry &entry = block[position];
+                if (field == TITLE) {
+                    if ((entry.key & mask) != (probe.key & mask))
+                        return;
+                    if (prefix.length > 8 && !startsWith(textOf(entry), prefix))
+                        return;
+                } else if (entry.key != matchedKey) {
+                    // A new author: checked once for all of their books
+                    if (!startsWith(textOf(entry), prefix))
+                        return;
+                    matchedKey = entry.key;
+                }
+                visit(entry.node);
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+
+    size_t bytes() const {
+        size_t total = blocks.capacity() * sizeof(vector<Entry>) + lasts.capacity() * sizeof(Entry);
+        for (size_t b = 0; b < blocks.size(); b++)
+            total += blocks[b].capacity() * sizeof(Entry);
+        return total;
+    }
+
+    void clear() {
+        vector<vector<Entry> >().swap(blocks);
+        vector<Entry>().swap(lasts);
+        count = 0;
+    }
+};
+
+// Book fields of one entry in a bulk insert batch.
+struct BookRecord {
+    int BookId;
+    string BookName;
+    string AuthorName;
+    bool AvailabilityStatus;
+    int BorrowedBy;
+
+    BookRecord(int id, string name, string author, bool available, int borrowedBy)
+        : BookId(id), BookName(std::move(name)), AuthorName(std::move(author)), AvailabilityStatus(available), BorrowedBy(borrowedBy) {}
+};
+
+// A book moved from one tree to another with its borrower and waitlist. The author name is carried as a
+// string because the book's AuthorName points into the table of the tree it came from.
+struct BookTransfer {
+    BookNode book;
+    string author;
+
+    BookTransfer(BookNode &&book, string author) : book(std::move(book)), author(std::move(author)) {}
+};
+
+// Coordination between the thread that changes the tree and lock-free reader threads. The writer makes
+// the version odd while it changes the tree and even again when it is done; a reader notes the version
+// before a traversal and throws the result away when the version has moved since, so what it keeps was
+// read from a tree no write was touching. Readers also announce the epoch they started in. A node freed
+// by the writer is parked with the epoch of its removal and only reused once every announced epoch is
+// later, so a reader that still holds its index never sees the slot filled with another book.
+class ReaderEpochs {
+public:
+    static const int MAX_READERS = 64;
+
+private:
+    static const uint64_t IDLE = 0;
+
+    // One reader's announcement, padded to a cache line so readers do not share lines.
+    struct Slot {
+        atomic<uint64_t> epoch;
+        atomic<bool> attached;
+        char padding[64 - sizeof(atomic<uint64_t>) - sizeof(atomic<bool>)];
+    };
+
+    atomic<uint64_t> version;
+    atomic<uint64_t> epoch;
+    atomic<int> readers;
+    Slot slots[MAX_READERS];
+
+    ReaderEpochs(const ReaderEpochs &);
+    ReaderEpochs &operator=(const ReaderEpochs &);
+
+public:
+    ReaderEpochs() : version(0), epoch(1), readers(0) {
+        for (int i = 0; i < MAX_READERS; i++) {
+            slots[i].epoch.store(IDLE);
+            slots[i].attached.store(false);
+        }
+    }
+
+    // Writer side. Only one thread may write at a time.
+    void beginWrite() {
+        version.store(version.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+
+    void endWrite() {
+        version.store(version.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    bool hasReaders() const { return readers.load() > 0; }
+
+    uint64_t currentEpoch() const { return epoch.load(memory_order_relaxed); }
+
+    // Starting a new epoch and returning the oldest epoch a reader is still in, or UINT64_MAX when no
+    // reader is inside the tree. Nodes retired before that epoch can be reused.
+    uint64_t advance() {
+        epoch.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t oldest = UINT64_MAX;
+        for (int i = 0; i < MAX_READERS; i++) {
+            uint64_t e = slots[i].epoch.load();
+            if (e != IDLE && e < oldest)
+                oldest = e;
+        }
+        return oldest;
+    }
+
+    // Waiting until every reader inside the tree has left it, before memory is freed outright.
+    void waitForReaders() {
+        uint64_t now = currentEpoch() + 1;
+        while (advance() < now)
+            this_thread::yield();
+    }
+
+    // Reader side. attach() returns the reader's slot, or -1 when all are taken.
+    int attach() {
+        for (int i = 0; i < MAX_READERS; i++) {
+            bool expected = false;
+            if (slots[i].attached.compare_exchange_strong(expected, true)) {
+                readers.fetch_add(1);
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void detach(int slot) {
+        slots[slot].epoch.store(IDLE);
+        readers.fetch_sub(1);
+        slots[slot].attached.store(false);
+    }
+
+    // Entering the tree. Returns the version to validate against, or an odd value when a write is under
+    // way, in which case the reader has not entered and should retry.
+    uint64_t enter(int slot) {
+        // The announcement must be visible before any node is read, or the writer could miss it
+        slots[slot].epoch.store(epoch.load(memory_order_relaxed), memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t v = version.load(memory_order_acquire);
+        if (v & 1)
+            slots[slot].epoch.store(IDLE, memory_order_release);
+        return v;
+    }
+
+    // True when no write started since enter() returned v.
+    bool validate(uint64_t v) const {
+        atomic_thread_fence(memory_order_acquire);
+        return version.load(memory_order_relaxed) == v;
+    }
+
+    void exit(int slot) { slots[slot].epoch.store(IDLE, memory_order_release); }
+};
+
+//The red black tree containing the the node and the counter of the color flip count.
+#if GATOR_STATS
+typedef TreeCounters BookTreeStats;
+#else
+typedef FlipCounter BookTreeStats;
+#endif
+
+// Index engines a library can keep its books in.
+enum EngineKind {
+    ENGINE_RBTREE,
+    ENGINE_BPLUSTREE,
+    ENGINE_KINDS
+};
+
+// Engine names as --engine takes them.
+static const char *const ENGINE_NAMES[ENGINE_KINDS] = {"rbtree", "bplustree"};
+
+// Looking up an engine by name. Returns false for an unknown name.
+static bool parseEngine(const string &name, EngineKind &engine) {
+    for (int kind = 0; kind < ENGINE_KINDS; kind++) {
+        if (name == ENGINE_NAMES[kind]) {
+            engine = (EngineKind)kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef RedBlackTree<int, BookNode, less<int>, BookStore, BookTreeStats> RedBlackBookTree;
+typedef BPlusTree<int, BookNode, less<int>, BookStore, BookTreeStats> BPlusBookTree;
+
+// The books by ID underneath the library, in the engine chosen when the library is made. Both engines hand
+// out NodeIndex handles into a BookStore, so everything above the tree works the same on either; each call
+// goes to the one engine that exists.
+class BookTree {
+    RedBlackBookTree *redBlack;
+    BPlusBookTree *bplus;
+
+    BookTree(const BookTree &);
+    BookTree &operator=(const BookTree &);
+
+public:
+    explicit BookTree(EngineKind engine)
+        : redBlack(engine == ENGINE_RBTREE ? new RedBlackBookTree() : NULL),
+          bplus(engine == ENGINE_BPLUSTREE ? new BPlusBookTree() : NULL) {}
+
+    ~BookTree() {
+        delete redBlack;
+        delete bplus;
+    }
+
+    EngineKind engine() const { return bplus ? ENGINE_BPLUSTREE : ENGINE_RBTREE; }
+
+    // The engine itself, NULL for the other one; for concurrent readers, which walk its structure.
+    const RedBlackBookTree *redBlackTree() const { return redBlack; }
+    const BPlusBookTree *bplusTree() const { return bplus; }
+
+    const BookStore::Node &node(NodeIndex index) const { return nodes().node(index); }
+    BookNode &value(NodeIndex index) { return bplus ? bplus->value(index) : redBlack->value(index); }
+    const BookNode &value(NodeIndex index) const { return bplus ? bplus->value(index) : redBlack->value(index); }
+    uint32_t size() const { return bplus ? bplus->size() : redBlack->size(); }
+    const BookStore &nodes() const { return bplus ? bplus->nodes() : redBlack->nodes(); }
+    const BookTreeStats &statistics() const { return bplus ? bplus->statistics() : redBlack->statistics(); }
+
+    // ColorFlipCount of the red black tree; a B+tree has no colors and reports 0.
+    int colorFlips() const { return bplus ? 0 : redBlack->statistics().flips; }
+    void restoreColorFlips(int flips) {
+        if (redBlack)
+            redBlack->statistics().flips = flips;
+    }
+
+    // Memory held by the node store and, in a B+tree, its pages.
+    AllocatorStats allocatorStats() const {
+        AllocatorStats s = nodes().stats();
+        if (bplus)
+            s += bplus->pageStats();
+        return s;
+    }
+
+    template <typename... Args>
+    NodeIndex create(int key, Args&&... args) {
+        return bplus ? bplus->create(key, std::forward<Args>(args)...) : redBlack->create(key, std::forward<Args>(args)...);
+    }
+
+    void release(NodeIndex index) { bplus ? bplus->release(index) : redBlack->release(index); }
+    void insert(NodeIndex index) { bplus ? bplus->insert(index) : redBlack->insert(index); }
+    NodeIndex insertOrFind(NodeIndex index) {
+        return bplus ? bplus->insertOrFind(index) : redBlack->insertOrFind(index);
+    }
+    void erase(NodeIndex index) { bplus ? bplus->erase(index) : redBlack->erase(index); }
+    void clear() { bplus ? bplus->clear() : redBlack->clear(); }
+
+    NodeIndex find(int key) const { return bplus ? bplus->find(key) : redBlack->find(key); }
+    void findMany(const int *keys, size_t n, NodeIndex *found) const {
+        bplus ? bplus->findMany(keys, n, found) : redBlack->findMany(keys, n, found);
+    }
+    void floorCeiling(int key, NodeIndex &floorNode, NodeIndex &ceilingNode) const {
+        bplus ? bplus->floorCeiling(key, floorNode, ceilingNode) : redBlack->floorCeiling(key, floorNode, ceilingNode);
+    }
+    NodeIndex first() const { return bplus ? bplus->first() : redBlack->first(); }
+    NodeIndex last() const { return bplus ? bplus->last() : redBlack->last(); }
+    NodeIndex prev(NodeIndex index) const { return bplus ? bplus->prev(index) : redBlack->prev(index); }
+    NodeIndex next(NodeIndex index) const { return bplus ? bplus->next(index) : redBlack->next(index); }
+    int countBelow(int key, bool inclusive) const {
+        return bplus ? bplus->countBelow(key, inclusive) : redBlack->countBelow(key, inclusive);
+    }
+    NodeIndex select(long long rank) const { return bplus ? bplus->select(rank) : redBlack->select(rank); }
+    int height() const { return bplus ? bplus->height() : redBlack->height(); }
+    int blackHeight() const { return bplus ? bplus->blackHeight() : redBlack->blackHeight(); }
+
+    void collectInOrder(vector<NodeIndex> &nodes) const {
+        bplus ? bplus->collectInOrder(nodes) : redBlack->collectInOrder(nodes);
+    }
+    void linkSorted(vector<NodeIndex> &nodes, bool rebuild) {
+        bplus ? bplus->linkSorted(nodes, rebuild) : redBlack->linkSorted(nodes, rebuild);
+    }
+
+    template <typename Visit>
+    void forEachInRange(int low, int high, Visit visit) const {
+        bplus ? bplus->forEachInRange(low, high, visit) : redBlack->forEachInRange(low, high, visit);
+    }
+    template <typename Visit>
+    void forEachWithDepth(Visit visit) const {
+        bplus ? bplus->forEachWithDepth(visit) : redBlack->forEachWithDepth(visit);
+    }
+};
+
+// Entries of the hot-book cache are 2^GATOR_BOOK_CACHE_BITS; the default 16384 take 128 KB per library.
+#ifndef GATOR_BOOK_CACHE_BITS
+#define GATOR_BOOK_CACHE_BITS 14
+#endif
+
+// Direct-mapped cache from book ID to the node holding the book, consulted before the tree by the commands
+// that name one book. Traffic piles up on popular books, which then skip the descent. A node keeps its book
+// for as long as the book is in the tree, so an entry only goes stale when its book is deleted or books move
+// in bulk, and the library forgets it then.
+class BookCache {
+public:
+    static const int SLOT_BITS = GATOR_BOOK_CACHE_BITS;
+
+private:
+    struct Entry {
+        int key;
+        NodeIndex index;                // NIL for an empty entry
+    };
+
+    vector<Entry> entries;
+    long long hitCount;
+    long long lookupCount;
+
+    // Fibonacci hashing, so runs of consecutive IDs spread over the whole table.
+    static size_t position(int key) { return ((uint32_t)key * 2654435769u) >> (32 - SLOT_BITS); }
+    Entry &slot(int key) { return entries[position(key)]; }
+
+public:
+    BookCache() : entries(1 << SLOT_BITS), hitCount(0), lookupCount(0) {}
+
+    // Node cached for the key, NIL on a miss.
+    NodeIndex find(int key) {
+        lookupCount++;
+        NodeIndex index = peek(key);
+        if (index != NIL)
+            hitCount++;
+        return index;
+    }
+
+    // find without counting the lookup, for lookups made ahead of the commands that need them.
+    NodeIndex peek(int key) const {
+        const Entry &entry = entries[position(key)];
+        return entry.index != NIL && entry.key == key ? entry.index : NIL;
+    }
+
+    void remember(int key, NodeIndex index) {
+        Entry &entry = slot(key);
+        entry.key = key;
+        entry.index = index;
+    }
+
+    void forget(int key) {
+        Entry &entry = slot(key);
+        if (entry.key == key)
+            entry.index = NIL;
+    }
+
+    void clear() { entries.assign(entries.size(), Entry()); }
+
+    long long hits() const { return hitCount; }
+    long long lookups() const { return lookupCount; }
+};
+
+// Read only copy of the book IDs for stretches of queries without changes, built by Freeze. The IDs are
+// kept in Eytzinger order, the implicit search tree whose position k has the children 2k and 2k + 1, laid
+// out level by level: the top levels that every search passes are packed in a few cache lines, and a
+// search descends without branching on the comparison while prefetching the line of its descendants four
+// levels down. Each position carries the node and the rank of its ID, and the nodes are also kept in ID
+// order, so a search gives lookups, floor and ceiling, counts and the start of a range. The library drops
+// the index on the next change to its IDs.
+class FrozenIndex {
+private:
+    // 16 IDs fill a cache line, and positions 16k to 16k + 15 are the descendants of k four levels down.
+    static const size_t LINE_KEYS = 64 / sizeof(int);
+
+    vector<int> storage;
+    int *keys;                  // keys[1..count] in Eytzinger order, keys[0] aligned to a cache line
+    vector<NodeIndex> nodes;    // node of keys[k]; nodes[0] is NIL, standing for "no such ID"
+    vector<uint32_t> ranks;     // rank of keys[k]; ranks[0] is count
+    vector<NodeIndex> sorted;   // the nodes in ID order
+    size_t count;
+    bool active;
+
+    FrozenIndex(const FrozenIndex &);
+    FrozenIndex &operator=(const FrozenIndex &);
+
+    // Filling the subtree at position k with sorted[next...] in order, returning the next rank to place.
+    template <typename KeyOf>
+    size_t place(size_t k, size_t next, KeyOf keyOf) {
+        if (k > count)
+            return next;
+        next = place(2 * k, next, keyOf);
+        keys[k] = keyOf(sorted[next]);
+        nodes[k] = sorted[next];
+        ranks[k] = next;
+        return place(2 * k + 1, next + 1, keyOf);
+    }
+
+    // Position below the last level where the search for key ends, going right past the IDs < key, or
+    // <= key when past is set. Every turn appends a bit to k, 1 for right and 0 for left.
+    template <bool past>
+    size_t descend(int key) const {
+        size_t k = 1;
+        while (k <= count) {
+            __builtin_prefetch(keys + min(k * LINE_KEYS, count));
+            k = 2 * k + (past ? keys[k] <= key : keys[k] < key);
+        }
+        return k;
+    }
+
+    // Where the search ending at k last turned left, the first ID it did not pass, and last turned right,
+    // the last ID it passed; 0 when there is none.
+    static size_t lastLeft(size_t k) { return k >> __builtin_ffsll(~(long long)k); }
+    static size_t lastRight(size_t k) { return k >> __builtin_ffsll((long long)k); }
+
+public:
+    FrozenIndex() : keys(NULL), count(0), active(false) {}
+
+    // Replacing the index with the nodes of inOrder, given in ID order; keyOf gives a node's ID.
+    template <typename KeyOf>
+    void build(const vector<NodeIndex> &inOrder, KeyOf keyOf) {
+        count = inOrder.size();
+        sorted = inOrder;
+        storage.assign(count + 1 + LINE_KEYS, 0);
+        size_t misalignment = (uintptr_t)storage.data() % 64 / sizeof(int);
+        keys = storage.data() + (misalignment == 0 ? 0 : LINE_KEYS - misalignment);
+        nodes.assign(count + 1, NIL);
+        ranks.assign(count + 1, 0);
+        ranks[0] = count;
+        place(1, 0, keyOf);
+        active = true;
+    }
+
+    void clear() {
+        if (!active)
+            return;
+        vector<int>().swap(storage);
+        vector<NodeIndex>().swap(nodes);
+        vector<uint32_t>().swap(ranks);
+        vector<NodeIndex>().swap(sorted);
+        keys = NULL;
+        count = 0;
+        active = false;
+    }
+
+    bool built() const { return active; }
+    size_t size() const { return count; }
+
+    // Node of the given rank, NIL outside [0, size()).
+    NodeIndex at(size_t rank) const { return rank < count ? sorted[rank] : NIL; }
+
+    // Number of IDs < key, or <= key when inclusive; also the rank of the first ID past them.
+    size_t countBelow(int key, bool inclusive) const {
+        return ranks[lastLeft(inclusive ? descend<true>(key) : descend<false>(key))];
+    }
+
+    // Node holding the ID, NIL when there is none.
+    NodeIndex find(int key) const {
+        size_t k = lastLeft(descend<false>(key));
+        return k != 0 && keys[k] == key ? nodes[k] : NIL;
+    }
+
+    // Nodes with the greatest ID <= key and the smallest ID >= key, NIL where there is none.
+    void floorCeiling(int key, NodeIndex &floorNode, NodeIndex &ceilingNode) const {
+        size_t end = descend<false>(key), ceiling = lastLeft(end);
+        ceilingNode = nodes[ceiling];
+        floorNode = ceiling != 0 && keys[ceiling] == key ? ceilingNode : nodes[lastRight(end)];
+    }
+};
+
+class Library {
+
+private:
+
+    BookTree tree;             // Books by ID in the chosen engine, with the rotation and recolor counters
+    PatronIndex patrons;       // Books each patron holds or waits for
+    AuthorTable authors;       // Interned author names
+    BookIndex titles;          // Books in title order for prefix search
+    BookIndex byAuthor;        // Books in author order for prefix search
+    ReaderEpochs epochs;       // Version and reader epochs shared with TreeReaders
+    vector<pair<NodeIndex, uint64_t> > retired;  // Freed nodes readers may still see, with their epoch
+    int writeDepth;            // Nesting of WriteSections
+    BookCache cache;           // Nodes of the books named lately
+    bool repeatedIds;          // Some ID may be held by more than one book
+    FrozenIndex frozen;        // Read only index built by Freeze, dropped when the IDs change
+#if GATOR_STATS
+    LibraryStats counters;     // Command latencies; the shape fields stay zero
+#endif
+
+    friend class TreeReader;
+
+    // Freed nodes are handed back to the store in batches of this many.
+    static const size_t RECLAIM_BATCH = 64;
+
+    // Marks the tree as changing while it lives, so concurrent readers retry; nested sections are merged
+    // into the outermost one.
+    class WriteSection {
+        Library &library;
+    public:
+        explicit WriteSection(Library &library) : library(library) {
+            if (library.writeDepth++ == 0)
+                library.epochs.beginWrite();
+        }
+        ~WriteSection() {
+            if (--library.writeDepth == 0)
+                library.epochs.endWrite();
+        }
+    };
+
+    Library(const Library &);
+    Library &operator=(const Library &);
+
+    // Accessors for the node and book stored at an index.
+    const BookStore::Node &node(NodeIndex index) const { return tree.node(index); }
+    BookNode &book(NodeIndex index) { return tree.value(index); }
+
+    // Node of the book with the ID, NIL when there is none, looked up in the cache before the tree. While
+    // some ID is held by several books only IDs held once are cached, since which of the copies the tree
+    // finds can change as it rebalances.
+    NodeIndex locate(int bookID) {
+        NodeIndex index = cache.find(bookID);
+        if (index != NIL)
+            return index;
+        index = findNode(bookID);
+        if (index != NIL && (!repeatedIds || heldOnce(index)))
+            cache.remember(bookID, index);
+        return index;
+    }
+
+    // Searches of the tree, answered by the frozen index while there is one.
+    NodeIndex findNode(int bookID) const {
+        return frozen.built() ? frozen.find(bookID) : tree.find(bookID);
+    }
+    int countBelow(int bookID, bool inclusive) const {
+        return frozen.built() ? (int)frozen.countBelow(bookID, inclusive) : tree.countBelow(bookID, inclusive);
+    }
+    void floorCeiling(int bookID, NodeIndex &floorNode, NodeIndex &ceilingNode) const {
+        if (frozen.built())
+            frozen.floorCeiling(bookID, floorNode, ceilingNode);
+        else
+            tree.floorCeiling(bookID, floorNode, ceilingNode);
+    }
+
+    bool heldOnce(NodeIndex index) const {
+        NodeIndex before = tree.prev(index), after = tree.next(index);
+        return (before == NIL || node(before).key != node(index).key) &&
+               (after == NIL || node(after).key != node(index).key);
+    }
+
+    // Noting whether an ID is held by more than one of the books, given in ID order.
+    void noteRepeats(const vector<NodeIndex> &sorted) {
+        for (size_t i = 1; i < sorted.size() && !repeatedIds; i++)
+            repeatedIds = node(sorted[i - 1]).key == node(sorted[i]).key;
+    }
+
+    // Destroying the book of an unlinked node, dropping its author, and recycling the index.
+    void freeNode(NodeIndex index) {
+        authors.release(book(index).AuthorName);
+        tree.release(index);
+    }
+
+    // Freeing a node taken out of the tree. While readers are attached it waits in retired until no
+    // reader can still be looking at it.
+    void retire(NodeIndex index) {
+        if (retired.empty() && !epochs.hasReaders()) {
+            freeNode(index);
+            return;
+        }
+        retired.push_back(make_pair(index, epochs.currentEpoch()));
+        if (retired.size() >= RECLAIM_BATCH)
+            reclaim();
+    }
+
+    // Freeing the retired nodes that every reader has moved past.
+    void reclaim() {
+        uint64_t oldest = epochs.advance();
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++) {
+            if (retired[i].second < oldest)
+                freeNode(retired[i].first);
+            else
+                retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+    }
+
+    // Releasing every node of the tree, used when the tree is torn down.
+    void clear() {
+        if (epochs.hasReaders())
+            epochs.waitForReaders();
+        for (size_t i = 0; i < retired.size(); i++)
+            tree.release(retired[i].first);
+        retired.clear();
+        tree.clear();
+        cache.clear();
+        frozen.clear();
+        repeatedIds = false;
+        patrons.clear();
+        titles.clear();
+        byAuthor.clear();
+        authors.clear();
+    }
+
+public:
+    explicit Library(EngineKind engine = ENGINE_RBTREE)
+        : tree(engine), titles(tree.nodes(), BookIndex::TITLE), byAuthor(tree.nodes(), BookIndex::AUTHOR), writeDepth(0),
+          repeatedIds(false) {}
+
+    ~Library() {
+        WriteSection section(*this);
+        clear();
+    }
+
+    // Public functions
+
+    //Searching for a book in the tree. Returns NULL when the book is not in the library.
+    BookNode *search(int bookId)
+    {
+        NodeIndex index = locate(bookId);
+        return index == NIL ? NULL : &book(index);
+    }
+
+    // Searching for n books at once, books[i] getting the book with ID bookIds[i] or NULL. The IDs missing
+    // from the cache are looked up with interleaved descents (see RedBlackTree::findMany) and then cached,
+    // so commands applied next in order find their books there. Every change to the library keeps the cache
+    // exact, so those commands still see the changes made before them. The pointers stay valid until the
+    // next change.
+    void searchMany(const int *bookIds, size_t n, BookNode **books);
+
+    //Deleting a book in the tree.
+    void deleteBook(int bookID, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    NodeIndex index = locate(bookID);
+    if (index == NIL)
+         return;
+    BookNode *target = &book(index);
+    if (target->BorrowedBy != -1)
+        patrons.removeBorrowed(target->BorrowedBy, bookID);
+    for (int r = 0; r < target->reservationHeap.size(); r++)
+        patrons.removeReservation(target->reservationHeap.entry(r).patronID, bookID, target->reservationHeap.handle(r));
+    if(target->reservationHeap.isEmpty()){
+                outputFile << "Book " << bookID << " is no longer available." << "\n";
+            }
+            else if(!target->reservationHeap.isEmpty()){
+                outputFile << "Book " << bookID << " is no longer available. Reservations made by patrons ";
+                target->reservationHeap.printPatrons(outputFile);
+                outputFile << " have been cancelled!" << "\n";
+            }
+    titles.remove(index);
+    byAuthor.remove(index);
+    tree.erase(index);
+    cache.forget(bookID);
+    frozen.clear();
+    retire(index);
+}
+    // Printing books within the 2 given bookID's.
+    void printBooks(int bookID1, int bookID2, OutputBuffer &outputFile);
+
+    // Printing book with the given bookID.
+    void printBook(int bookID, OutputBuffer &outputFile);
+
+    // Inserting book into the tree. Returns false when the ID was already in the library; the book is
+    // added all the same, as InsertBook always has.
+    bool insertBook(int id, string name, string author, bool available, int borrowedBy);
+
+    // Allowing the patron to borrow the book or adding the patron to reservation heap.
+    void borrowBook(int patronID, int bookID, int patronPriority, OutputBuffer &outputFile);
+
+    // Updating the book status by making the patron return the book so that it is available.
+    void returnBook(int patronID, int bookID, OutputBuffer &outputFile);
+
+    // Printing every book whose title starts with prefix, in title order.
+    void searchTitle(StringRef prefix, OutputBuffer &outputFile);
+
+    // Printing every book by an author whose name starts with prefix, by author and then book ID.
+    void searchAuthor(StringRef prefix, OutputBuffer &outputFile);
+
+    // Sizes of the search indexes: titles indexed, distinct authors and the bytes both take.
+    size_t indexedTitles() const { return titles.size(); }
+    size_t distinctAuthors() const { return authors.size(); }
+    size_t searchIndexBytes() const { return titles.bytes() + byAuthor.bytes() + authors.bytes(); }
+
+    // Removing the patron's reservation for the book from its waitlist.
+    void cancelReservation(int patronID, int bookID, OutputBuffer &outputFile);
+
+    // Changing the priority of the patron's reservation for the book.
+    void updatePriority(int patronID, int bookID, int newPriority, OutputBuffer &outputFile);
+
+    // Printing the books a patron holds and the books they wait for, from the patron index.
+    void printPatron(int patronID, OutputBuffer &outputFile) const;
+
+    // Returning every book the patron holds, in increasing book ID order.
+    void returnAll(int patronID, OutputBuffer &outputFile);
+
+    // Lookups the book cache answered, out of all lookups made through it.
+    long long cacheHits() const { return cache.hits(); }
+    long long cacheLookups() const { return cache.lookups(); }
+
+    // Number of active patrons and the bytes their index takes.
+    size_t activePatrons() const { return patrons.patrons(); }
+    size_t patronIndexBytes() const { return patrons.bytes(); }
+
+    // Finding the closest books to the target ID in the tree.
+    void findClosestBook(int targetID, OutputBuffer &outputFile);
+
+    // This function will print the k books closest to targetID, nearest first.
+    void findClosestBooks(int targetID, int k, OutputBuffer &outputFile);
+
+    // This function will print the color flip count.
+    void countColorFlip(OutputBuffer &outputFile);
+
+    // Number of books with IDs in [bookID1, bookID2], in O(log n).
+    int countBooks(int bookID1, int bookID2) const {
+        if (bookID1 > bookID2)
+            return 0;
+        return countBelow(bookID2, true) - countBelow(bookID1, false);
+    }
+
+    // 1-based position of the book among all books in ID order, 0 when it is not in the library.
+    int rankOf(int bookID) const {
+        return findNode(bookID) == NIL ? 0 : countBelow(bookID, false) + 1;
+    }
+
+    // Book with the given 1-based rank, NULL when there are fewer books.
+    BookNode *selectBook(long long rank) {
+        NodeIndex index = frozen.built() ? frozen.at(rank - 1) : tree.select(rank - 1);
+        return index == NIL ? NULL : &book(index);
+    }
+
+    // Printing at most limit books of [bookID1, bookID2], skipping the first offset of them. The first book
+    // is located by rank in O(log n) and the rest are visited by in order successor.
+    void printBooksPage(int bookID1, int bookID2, long long offset, long long limit, OutputBuffer &outputFile);
+
+    // Number of levels on the longest root to leaf path.
+    int height() const {
+        return tree.height();
+    }
+
+    // Inserting a batch of books at once in linear time. The batch is sorted first unless it already is.
+    // Books whose ID is already in the tree or repeated in the batch are skipped and their IDs appended to
+    // duplicates. Returns the number of books inserted.
+    int bulkInsert(vector<BookRecord> &books, vector<int> &duplicates);
+
+    // Writing the whole library to a binary snapshot file. Returns false and sets error on failure.
+    bool saveSnapshot(const string &path, string &error);
+
+    // Replacing the library with the contents of a snapshot file. On failure the library is left
+    // unchanged, false is returned and error says why.
+    bool loadSnapshot(const string &path, string &error);
+
+    // Whether a snapshot file passes every check loadSnapshot makes, without loading it.
+    static bool checkSnapshot(const string &path, string &error);
+
+    // Writing the books of several libraries, whose ID ranges follow one another in the given order, to
+    // one snapshot file as if they were a single library.
+    static bool saveSnapshot(const vector<Library*> &parts, const string &path, string &error);
+
+    // Taking every book with an ID in [bookID1, bookID2] out of the library, with its borrower and
+    // waitlist, and appending it to moved in ID order.
+    void extractBooks(int bookID1, int bookID2, vector<BookTransfer> &moved);
+
+    // Adding books taken out of another library with extractBooks. Empties moved.
+    void adoptBooks(vector<BookTransfer> &moved);
+
+    // Building the frozen index over the current books, which then serves lookups, floor and ceiling, counts
+    // and ranges until the next change to the IDs drops it; see FrozenIndex. Returns false, building
+    // nothing, while some ID is held by more than one book, as the tree and the index could pick different
+    // copies.
+    bool freeze();
+
+    // Whether the frozen index is in use.
+    bool frozenIndex() const { return frozen.built(); }
+
+    // Removing every book.
+    void removeAll() {
+        WriteSection section(*this);
+        clear();
+    }
+
+    // Number of books in the library.
+    int bookCount() const { return tree.size(); }
+
+    // Number of color flips so far, 0 on the B+tree engine.
+    int colorFlips() const { return tree.colorFlips(); }
+
+    // Engine the books are kept in.
+    EngineKind engine() const { return tree.engine(); }
+
+    // Adding one command's latency to the statistics.
+    void recordLatency(int type, unsigned long long ns) {
+#if GATOR_STATS
+        counters.recordLatency(type, ns);
+#else
+        (void)type;
+        (void)ns;
+#endif
+    }
+
+    // Adding the statistics of this tree to stats: the collected counters, the hits of the book cache, and
+    // the shape of the tree measured by one walk over it.
+    void collectStats(LibraryStats &stats) const;
+
+    // Books with the greatest ID <= targetID and the smallest ID >= targetID, NULL where there is none.
+    // Both are the same book on an exact match.
+    void closestCandidates(int targetID, BookNode *&floorBook, BookNode *&ceilingBook) {
+        NodeIndex floorNode, ceilingNode;
+        floorCeiling(targetID, floorNode, ceilingNode);
+        floorBook = floorNode == NIL ? NULL : &book(floorNode);
+        ceilingBook = ceilingNode == NIL ? NULL : &book(ceilingNode);
+    }
+
+    // The books a patron holds and waits for, each list in increasing ID order.
+    void patronBooks(int patronID, vector<int> &borrowed, vector<int> &reserved) const {
+        patrons.books(patronID, borrowed, reserved);
+    }
+
+    // Appending the books SearchTitle and SearchAuthor would print for the prefix, in the same order.
+    void matchTitles(StringRef prefix, vector<BookNode*> &matches) {
+        titles.forEachPrefix(prefix, [&](NodeIndex index) { matches.push_back(&book(index)); });
+    }
+    void matchAuthors(StringRef prefix, vector<BookNode*> &matches) {
+        byAuthor.forEachPrefix(prefix, [&](NodeIndex index) { matches.push_back(&book(index)); });
+    }
+
+    // Memory held by the node store, and the pages of a B+tree.
+    AllocatorStats allocatorStats() const {
+        return tree.allocatorStats();
+    }
+
+    // This function will print the allocator statistics.
+    void printAllocatorStats(OutputBuffer &outputFile);
+};
+
+void printPatronBooks(int patronID, const vector<int> &borrowed, const vector<int> &reserved, OutputBuffer &outputFile);
+void printAllocatorStats(const AllocatorStats &s, OutputBuffer &outputFile);
+
+// Function to print information about a specific book
+void printBookInfo(BookNode* book, OutputBuffer &outputFile) {
+    outputFile << "BookID = " << book->BookId << "\n"
+         << "Title = " << book->BookName << "\n"
+         << "Author = " << *book->AuthorName << "\n"
+         << "Availability = " << (book->AvailabilityStatus ? "\"Yes\"" : "\"No\"") << "\n"
+         << "BorrowedBy = ";
+    if (book->BorrowedBy==-1)
+        outputFile << "None";
+    else
+        outputFile << book->BorrowedBy;
+    outputFile << "\n" << "Reservations = [";
+    book->reservationHeap.printPatrons(outputFile);
+    outputFile << "]\n\n";
+}
+
+// Public function to print information about all books with bookIDs in the range [bookID1, bookID2].
+void Library::printBooks(int bookID1, int bookID2, OutputBuffer &outputFile) {
+    if (frozen.built()) {
+        size_t end = frozen.countBelow(bookID2, true);
+        for (size_t rank = frozen.countBelow(bookID1, false); rank < end; rank++)
+            printBookInfo(&book(frozen.at(rank)), outputFile);
+        return;
+    }
+    tree.forEachInRange(bookID1, bookID2, [&](NodeIndex index) { printBookInfo(&book(index), outputFile); });
+}
+
+// Function to print one page of the books with bookIDs in the range [bookID1, bookID2].
+void Library::printBooksPage(int bookID1, int bookID2, long long offset, long long limit, OutputBuffer &outputFile) {
+    if (offset < 0 || limit <= 0 || bookID1 > bookID2)
+        return;
+    if (frozen.built()) {
+        long long first = frozen.countBelow(bookID1, false) + offset;
+        long long end = min((long long)frozen.countBelow(bookID2, true), first + limit);
+        for (long long rank = first; rank < end; rank++)
+            printBookInfo(&book(frozen.at(rank)), outputFile);
+        return;
+    }
+    NodeIndex index = tree.select(tree.countBelow(bookID1, false) + offset);
+    for (long long printed = 0; index != NIL && node(index).key <= bookID2 && printed < limit; printed++) {
+        printBookInfo(&book(index), outputFile);
+        index = tree.next(index);
+    }
+}
+
+// Public function to print information about a specific book identified by its unique bookID
+void Library::collectStats(LibraryStats &stats) const {
+#if GATOR_STATS
+    stats += counters;
+    const TreeCounters &treeCounters = tree.statistics();
+    for (int i = 0; i < 2; i++)
+        stats.rotations[i] += treeCounters.rotations[i];
+    for (int i = 0; i < RECOLOR_CAUSES; i++)
+        stats.recolors[i] += treeCounters.recolors[i];
+#endif
+    LibraryStats shape;
+    shape.books = tree.size();
+    shape.cacheHits = cache.hits();
+    shape.cacheLookups = cache.lookups();
+    shape.blackHeight = tree.blackHeight();
+    tree.forEachWithDepth([&](NodeIndex index, int depth) {
+        shape.height = max(shape.height, depth);
+        shape.depthSum += depth;
+        int reservations = tree.value(index).reservationHeap.size();
+        if ((size_t)reservations < shape.waitlists.size())
+            shape.waitlists[reservations]++;
+    });
+    stats += shape;
+}
+
+void Library::printBook(int bookID, OutputBuffer &outputFile) {
+    NodeIndex index = locate(bookID);
+    if (index == NIL)
+        outputFile << "Book " << bookID << " not found in the Library" << "\n";
+    else
+        printBookInfo(&book(index), outputFile);
+}
+
+// Function to search for a batch of books, the descents of the IDs the cache misses interleaved in groups.
+void Library::searchMany(const int *bookIds, size_t n, BookNode **books) {
+    const size_t GROUP = RedBlackBookTree::FIND_GROUP;
+    int missed[GROUP];
+    size_t missedAt[GROUP];
+    NodeIndex found[GROUP];
+    size_t pending = 0;
+    auto lookUpMissed = [&]() {
+        if (frozen.built()) {
+            for (size_t j = 0; j < pending; j++)
+                found[j] = frozen.find(missed[j]);
+        } else {
+            tree.findMany(missed, pending, found);
+        }
+        for (size_t j = 0; j < pending; j++) {
+            books[missedAt[j]] = found[j] == NIL ? NULL : &book(found[j]);
+            if (found[j] != NIL && (!repeatedIds || heldOnce(found[j])))
+                cache.remember(missed[j], found[j]);
+        }
+        pending = 0;
+    };
+    for (size_t i = 0; i < n; i++) {
+        NodeIndex index = cache.peek(bookIds[i]);
+        if (index != NIL) {
+            books[i] = &book(index);
+            continue;
+        }
+        missed[pending] = bookIds[i];
+        missedAt[pending++] = i;
+        if (pending == GROUP)
+            lookUpMissed();
+    }
+    if (pending > 0)
+        lookUpMissed();
+    // The commands go on to the books themselves
+    for (size_t i = 0; i < n; i++) {
+        if (books[i] != NULL)
+            __builtin_prefetch(books[i]);
+    }
+}
+
+// Function to build the frozen index from the nodes in ID order. Deleting books never clears repeatedIds,
+// so the walk works it out again first; a library whose repeated IDs are all gone can then be frozen.
+bool Library::freeze() {
+    vector<NodeIndex> nodes;
+    nodes.reserve(tree.size());
+    tree.collectInOrder(nodes);
+    repeatedIds = false;
+    noteRepeats(nodes);
+    if (repeatedIds)
+        return false;
+    frozen.build(nodes, [this](NodeIndex index) { return node(index).key; });
+    return true;
+}
+
+// Function to add a new book to the library. The duplicate check is made by the descent that inserts it.
+bool Library::insertBook(int id, string name, string author, bool available, int borrowedBy) {
+    WriteSection section(*this);
+    NodeIndex newNode = tree.create(id, id, std::move(name), authors.intern(std::move(author)), available, borrowedBy);
+    titles.insert(newNode);
+    byAuthor.insert(newNode);
+    if (borrowedBy != -1)
+        patrons.addBorrowed(borrowedBy, id);
+    frozen.clear();
+    if (tree.insertOrFind(newNode) == newNode) {
+        cache.remember(id, newNode);
+        return true;
+    }
+    tree.insert(newNode);
+    cache.forget(id);
+    repeatedIds = true;
+    return false;
+}
+
+static bool compareRecords(const BookRecord &a, const BookRecord &b) {
+    return a.BookId < b.BookId;
+}
+
+// Function to add a sorted (or sort-on-the-fly) batch of books to the library in linear time.
+// An empty tree is built directly from the batch. If the batch lies entirely below or above the existing
+// keys, a balanced tree is built from the batch and joined to the existing tree through its first or last
+// book. Otherwise the existing nodes are merged with the batch in key order and the tree is rebuilt.
+int Library::bulkInsert(vector<BookRecord> &books, vector<int> &duplicates) {
+    WriteSection section(*this);
+    if (!is_sorted(books.begin(), books.end(), compareRecords)) {
+        stable_sort(books.begin(), books.end(), compareRecords);
+    }
+
+    // Existing nodes in key order, only needed when the batch overlaps the tree.
+    vector<NodeIndex> existing;
+    bool overlaps = false;
+    if (tree.size() != 0 && !books.empty()) {
+        overlaps = books.front().BookId <= node(tree.last()).key && books.back().BookId >= node(tree.first()).key;
+        if (overlaps) {
+            tree.collectInOrder(existing);
+        }
+    }
+
+    // Merging the batch with the existing nodes, creating a node for every new book.
+    vector<NodeIndex> nodes, created;
+    nodes.reserve(books.size() + existing.size());
+    created.reserve(books.size());
+    size_t e = 0;
+    int inserted = 0;
+    for (size_t i = 0; i < books.size(); i++) {
+        BookRecord &record = books[i];
+        while (e < existing.size() && node(existing[e]).key < record.BookId) {
+            nodes.push_back(existing[e++]);
+        }
+        bool duplicate = (i > 0 && books[i - 1].BookId == record.BookId) ||
+                         (e < existing.size() && node(existing[e]).key == record.BookId);
+        if (duplicate) {
+            duplicates.push_back(record.BookId);
+            continue;
+        }
+        nodes.push_back(tree.create(record.BookId, record.BookId, std::move(record.BookName),
+                                    authors.intern(std::move(record.AuthorName)),
+                                    record.AvailabilityStatus, record.BorrowedBy));
+        created.push_back(nodes.back());
+        if (record.BorrowedBy != -1)
+            patrons.addBorrowed(record.BorrowedBy, record.BookId);
+        inserted++;
+    }
+    while (e < existing.size()) {
+        nodes.push_back(existing[e++]);
+    }
+    if (inserted == 0)
+        return inserted;
+    titles.insertMany(created);
+    byAuthor.insertMany(created);
+    frozen.clear();
+    tree.linkSorted(nodes, overlaps);
+    return inserted;
+}
+
+static bool compareTransfers(const BookTransfer &a, const BookTransfer &b) {
+    return a.book.BookId < b.book.BookId;
+}
+
+// Function to take the books of an ID range out of the library. The rest of the tree is rebuilt from the
+// remaining nodes, so this costs time linear in the size of the tree.
+void Library::extractBooks(int bookID1, int bookID2, vector<BookTransfer> &moved) {
+    if (bookID1 > bookID2 || countBooks(bookID1, bookID2) == 0)
+        return;
+    WriteSection section(*this);
+    vector<NodeIndex> nodes, kept;
+    tree.collectInOrder(nodes);
+    kept.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        NodeIndex index = nodes[i];
+        BookNode &target = book(index);
+        if (target.BookId < bookID1 || target.BookId > bookID2) {
+            kept.push_back(index);
+            continue;
+        }
+        if (target.BorrowedBy != -1)
+            patrons.removeBorrowed(target.BorrowedBy, target.BookId);
+        for (int r = 0; r < target.reservationHeap.size(); r++)
+            patrons.removeReservation(target.reservationHeap.entry(r).patronID, target.BookId, target.reservationHeap.handle(r));
+        titles.remove(index);
+        byAuthor.remove(index);
+        moved.push_back(BookTransfer(std::move(target), *target.AuthorName));
+        retire(index);
+    }
+    tree.linkSorted(kept, true);
+    cache.clear();
+    frozen.clear();
+}
+
+// Function to add books taken out of another library, keeping their borrowers and waitlists.
+void Library::adoptBooks(vector<BookTransfer> &moved) {
+    if (moved.empty())
+        return;
+    WriteSection section(*this);
+    if (!is_sorted(moved.begin(), moved.end(), compareTransfers))
+        stable_sort(moved.begin(), moved.end(), compareTransfers);
+    vector<NodeIndex> created;
+    created.reserve(moved.size());
+    for (size_t i = 0; i < moved.size(); i++) {
+        NodeIndex index = tree.create(moved[i].book.BookId, std::move(moved[i].book));
+        BookNode &added = book(index);
+        added.AuthorName = authors.intern(std::move(moved[i].author));
+        if (added.BorrowedBy != -1)
+            patrons.addBorrowed(added.BorrowedBy, added.BookId);
+        for (int r = 0; r < added.reservationHeap.size(); r++)
+            patrons.addReservation(added.reservationHeap.entry(r).patronID, added.BookId, added.reservationHeap.handle(r));
+        created.push_back(index);
+    }
+    moved.clear();
+    titles.insertMany(created);
+    byAuthor.insertMany(created);
+
+    bool overlaps = tree.size() != 0 && node(created.front()).key <= node(tree.last()).key &&
+                    node(created.back()).key >= node(tree.first()).key;
+    // A copy of a cached ID may have come in
+    cache.clear();
+    frozen.clear();
+    if (!overlaps) {
+        noteRepeats(created);
+        tree.linkSorted(created, false);
+        return;
+    }
+    vector<NodeIndex> existing, nodes;
+    tree.collectInOrder(existing);
+    nodes.resize(existing.size() + created.size());
+    merge(existing.begin(), existing.end(), created.begin(), created.end(), nodes.begin(),
+          [this](NodeIndex a, NodeIndex b) { return node(a).key < node(b).key; });
+    noteRepeats(nodes);
+    tree.linkSorted(nodes, true);
+}
+
+// Function to allow a patron to borrow a book
+void Library::borrowBook(int patronID, int bookID, int patronPriority, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    // Find the book
+    NodeIndex index = locate(bookID);
+    if (index == NIL)
+        return;
+    BookNode *target = &book(index);
+    if (target->AvailabilityStatus) {
+        // Book is available, update book status
+        target->AvailabilityStatus = false;
+        target->BorrowedBy = patronID;
+        patrons.addBorrowed(patronID, bookID);
+        outputFile << "Book "<<bookID<<" Borrowed by Patron "<<patronID << "\n";
+    } else {
+        // Book is not available, add reservation to the heap unless the waitlist is full
+        int handle = target->reservationHeap.insertReservation(patronID, patronPriority);
+        if (handle >= 0) {
+            patrons.addReservation(patronID, bookID, handle);
+            outputFile << "Book "<<bookID<<" Reserved by Patron "<<patronID << "\n";
+        } else
+            outputFile << "Book "<<bookID<<" waitlist is full, reservation by Patron "<<patronID << " rejected\n";
+    }
+}
+
+// Function to allow a patron to return a book
+void Library::returnBook(int patronID, int bookID, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    NodeIndex index = locate(bookID);
+    if (index == NIL)
+        return;
+    BookNode *target = &book(index);
+    // The index follows the recorded borrower, which is who actually gives the book back
+    if (target->BorrowedBy != -1)
+        patrons.removeBorrowed(target->BorrowedBy, bookID);
+    // Update book status
+    target->AvailabilityStatus = true;
+    target->BorrowedBy = -1;
+    outputFile << "Book "<<bookID<<" Returned by Patron "<<patronID<< "\n";
+    outputFile <<"\n";
+
+    // If there are reservations, assign the book to the patron with highest priority
+    if (!target->reservationHeap.isEmpty()) {
+        int handle = target->reservationHeap.handle(0);
+        ReservationNode reservation = target->reservationHeap.extractMin();
+        target->AvailabilityStatus = false;
+        target->BorrowedBy = reservation.patronID;
+        patrons.removeReservation(reservation.patronID, bookID, handle);
+        patrons.addBorrowed(reservation.patronID, bookID);
+        outputFile << "Book "<<bookID<<" Allotted to Patron "<< reservation.patronID<< "\n";
+        outputFile <<"\n";
+    }
+}
+
+// Function to cancel a reservation. The patron index gives the reservation's heap handle, so it is removed
+// in O(log n) without searching the heap.
+void Library::cancelReservation(int patronID, int bookID, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    NodeIndex index = locate(bookID);
+    int handle = patrons.reservationHandle(patronID, bookID);
+    if (index == NIL || handle < 0) {
+        outputFile << "Patron " << patronID << " has no reservation for Book " << bookID << "\n";
+        return;
+    }
+    book(index).reservationHeap.remove(handle);
+    patrons.removeReservation(patronID, bookID, handle);
+    outputFile << "Reservation of Patron " << patronID << " for Book " << bookID << " cancelled" << "\n";
+}
+
+// Function to change the priority of a reservation, found the same way as in cancelReservation.
+void Library::updatePriority(int patronID, int bookID, int newPriority, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    NodeIndex index = locate(bookID);
+    int handle = patrons.reservationHandle(patronID, bookID);
+    if (index == NIL || handle < 0) {
+        outputFile << "Patron " << patronID << " has no reservation for Book " << bookID << "\n";
+        return;
+    }
+    book(index).reservationHeap.updatePriority(handle, newPriority);
+    outputFile << "Priority of Patron " << patronID << " for Book " << bookID << " set to " << newPriority << "\n";
+}
+
+// Function to print the books whose titles start with the prefix, straight from the title index
+void Library::searchTitle(StringRef prefix, OutputBuffer &outputFile) {
+    size_t found = 0;
+    titles.forEachPrefix(prefix, [&](NodeIndex index) {
+        printBookInfo(&book(index), outputFile);
+        found++;
+    });
+    if (found == 0)
+        outputFile << "No book title starts with \"" << prefix << "\"" << "\n\n";
+}
+
+// Function to print the books of the authors whose names start with the prefix, from the author index
+void Library::searchAuthor(StringRef prefix, OutputBuffer &outputFile) {
+    size_t found = 0;
+    byAuthor.forEachPrefix(prefix, [&](NodeIndex index) {
+        printBookInfo(&book(index), outputFile);
+        found++;
+    });
+    if (found == 0)
+        outputFile << "No author name starts with \"" << prefix << "\"" << "\n\n";
+}
+
+// Function to print the books a patron has borrowed and reserved
+void Library::printPatron(int patronID, OutputBuffer &outputFile) const {
+    vector<int> borrowed, reserved;
+    patrons.books(patronID, borrowed, reserved);
+    printPatronBooks(patronID, borrowed, reserved, outputFile);
+}
+
+// Function to print a patron's borrowed and reserved books
+void printPatronBooks(int patronID, const vector<int> &borrowed, const vector<int> &reserved, OutputBuffer &outputFile) {
+    outputFile << "PatronID = " << patronID << "\n" << "Borrowed = [";
+    for (size_t i = 0; i < borrowed.size(); i++) {
+        if (i > 0) outputFile << ", ";
+        outputFile << borrowed[i];
+    }
+    outputFile << "]\n" << "Reservations = [";
+    for (size_t i = 0; i < reserved.size(); i++) {
+        if (i > 0) outputFile << ", ";
+        outputFile << reserved[i];
+    }
+    outputFile << "]\n\n";
+}
+
+// Function to return all the books a patron has borrowed
+void Library::returnAll(int patronID, OutputBuffer &outputFile) {
+    WriteSection section(*this);
+    vector<int> borrowed, reserved;
+    patrons.books(patronID, borrowed, reserved);
+    if (borrowed.empty()) {
+        outputFile << "Patron " << patronID << " has no borrowed books" << "\n\n";
+        return;
+    }
+    for (size_t i = 0; i < borrowed.size(); i++)
+        returnBook(patronID, borrowed[i], outputFile);
+}
+
+// Public function to find the book with an ID closest to the given ID. Ties are printed in increasing ID order.
+void Library::findClosestBook(int targetID, OutputBuffer &outputFile) {
+    NodeIndex floorNode, ceilingNode;
+    floorCeiling(targetID, floorNode, ceilingNode);
+    if (floorNode != NIL && floorNode == ceilingNode) {
+        printBookInfo(&book(floorNode), outputFile);
+        return;
+    }
+    // Distances in 64 bits so IDs at opposite ends of the int range cannot overflow
+    long long floorDistance = floorNode == NIL ? LLONG_MAX : (long long)targetID - node(floorNode).key;
+    long long ceilingDistance = ceilingNode == NIL ? LLONG_MAX : (long long)node(ceilingNode).key - targetID;
+    if (floorNode != NIL && floorDistance <= ceilingDistance)
+        printBookInfo(&book(floorNode), outputFile);
+    if (ceilingNode != NIL && ceilingDistance <= floorDistance)
+        printBookInfo(&book(ceilingNode), outputFile);
+}
+
+// Public function to find the k books closest to the given ID. Starting from the floor and ceiling, the
+// nearer of the two frontiers is printed and stepped outward until k books are printed; ties go to the
+// lower ID.
+void Library::findClosestBooks(int targetID, int k, OutputBuffer &outputFile) {
+    NodeIndex lower, upper;
+    floorCeiling(targetID, lower, upper);
+    if (lower != NIL && lower == upper)
+        upper = tree.next(upper);
+    for (int printed = 0; printed < k && (lower != NIL || upper != NIL); printed++) {
+        long long lowerDistance = lower == NIL ? LLONG_MAX : (long long)targetID - node(lower).key;
+        long long upperDistance = upper == NIL ? LLONG_MAX : (long long)node(upper).key - targetID;
+        if (lowerDistance <= upperDistance) {
+            printBookInfo(&book(lower), outputFile);
+            lower = tree.prev(lower);
+        } else {
+            printBookInfo(&book(upper), outputFile);
+            upper = tree.next(upper);
+        }
+    }
+}
+
+// Public function to print the color flip count
+void Library::countColorFlip(OutputBuffer &outputFile) {
+    outputFile << "Color Flip Count: " << tree.statistics().flips << "\n";
+}
+
+// Public function to print the allocator statistics
+void Library::printAllocatorStats(OutputBuffer &outputFile) {
+    ::printAllocatorStats(allocatorStats(), outputFile);
+}
+
+// Function to print allocator counters
+void printAllocatorStats(const AllocatorStats &s, OutputBuffer &outputFile) {
+    outputFile << "Live Nodes: " << s.liveNodes << "\n"
+               << "Live Bytes: " << s.bytesLive << "\n"
+               << "Reserved Bytes: " << s.bytesReserved << "\n"
+               << "Slabs: " << s.slabs << "\n";
+}
+
+// A reader thread's handle on the tree. Each reader thread attaches its own TreeReader, whose lookups may
+// run while one other thread applies commands to the tree, without taking a lock: a lookup descends
+// optimistically, copies the books it finds and starts over when a write touched the tree meanwhile, so it
+// prints the tree as it stood between two commands. Output matches the Library method of the same name.
+// On the B+tree engine the same is done over its pages, whose slabs stay mapped just like the nodes.
+class TreeReader {
+public:
+    // Books copied per pass of printBooks; a long range is printed as several consistent pieces.
+    static const size_t RANGE_CHUNK = 64;
+
+private:
+    // Longest path a descent follows. A red black tree of 2^31 nodes is at most 62 levels deep, so a longer
+    // path means links changed under the reader.
+    static const int MAX_DEPTH = 96;
+
+    Library &library;
+    const BookStore &store;
+    int slot;
+    vector<BookNode> copies;
+    unsigned long long retries;
+
+    TreeReader(const TreeReader &);
+    TreeReader &operator=(const TreeReader &);
+
+    // Repeating read until it completes on a tree no write touched, then calling emit before leaving the
+    // epoch, so the interned author names the copies point at stay alive. read returns false when its
+    // traversal went astray.
+    template <typename Read, typename Emit>
+    void optimistic(Read read, Emit emit) {
+        for (;;) {
+            uint64_t version = library.epochs.enter(slot);
+            if (version & 1) {
+                this_thread::yield();
+                continue;
+            }
+            if (read() && library.epochs.validate(version)) {
+                emit();
+                library.epochs.exit(slot);
+                return;
+            }
+            library.epochs.exit(slot);
+            retries++;
+        }
+    }
+
+    // Node holding the book ID, NIL when there is none. False when the descent went astray.
+    bool find(int bookID, NodeIndex &found) const {
+        if (const BPlusBookTree *pages = library.tree.bplusTree())
+            return findInPages(*pages, bookID, found);
+        NodeIndex current = library.tree.redBlackTree()->rootIndex();
+        for (int depth = 0; depth < MAX_DEPTH; depth++) {
+            if (current == NIL) {
+                found = NIL;
+                return true;
+            }
+            if (!store.allocated(current))
+                return false;
+            BookStore::Node n = store.node(current);
+            if (n.key == bookID) {
+                found = current;
+                return true;
+            }
+            current = bookID < n.key ? n.left : n.right;
+        }
+        return false;
+    }
+
+    // Copying the floor and ceiling of the target ID, in that order, as BookTree::floorCeiling finds them.
+    bool copyFloorCeiling(int targetID) {
+        if (const BPlusBookTree *pages = library.tree.bplusTree())
+            return copyFloorCeilingFromPages(*pages, targetID);
+        copies.clear();
+        NodeIndex floorNode = NIL, ceilingNode = NIL;
+        NodeIndex current = library.tree.redBlackTree()->rootIndex();
+        for (int depth = 0; current != NIL; depth++) {
+            if (depth == MAX_DEPTH || !store.allocated(current))
+                return false;
+            BookStore::Node n = store.node(current);
+            if (n.key == targetID) {
+                floorNode = ceilingNode = current;
+                break;
+            }
+            if (n.key < targetID) {
+                floorNode = current;
+                current = n.right;
+            } else {
+                ceilingNode = current;
+                current = n.left;
+            }
+        }
+        if (floorNode != NIL)
+            copies.push_back(store.value(floorNode));
+        if (ceilingNode != NIL && ceilingNode != floorNode)
+            copies.push_back(store.value(ceilingNode));
+        return true;
+    }
+
+    // Copying up to RANGE_CHUNK books of [bookID1, bookID2] in ID order; more is set when books are left.
+    bool copyRange(int bookID1, int bookID2, bool &more) {
+        if (const BPlusBookTree *pages = library.tree.bplusTree())
+            return copyRangeFromPages(*pages, bookID1, bookID2, more);
+        copies.clear();
+        more = false;
+        NodeIndex stack[MAX_DEPTH];
+        int depth = 0;
+        int steps = 0;
+        NodeIndex current = library.tree.redBlackTree()->rootIndex();
+        for (;;) {
+            // Stacking the path to the smallest key >= bookID1 under current
+            while (current != NIL) {
+                if (depth == MAX_DEPTH || ++steps > 4 * (MAX_DEPTH + (int)RANGE_CHUNK) ||
+                    !store.allocated(current))
+                    return false;
+                BookStore::Node n = store.node(current);
+                if (n.key >= bookID1) {
+                    stack[depth++] = current;
+                    current = n.left;
+                } else {
+                    current = n.right;
+                }
+            }
+            if (depth == 0)
+                return true;
+            NodeIndex next = stack[--depth];
+            BookStore::Node n = store.node(next);
+            if (n.key > bookID2)
+                return true;
+            if (copies.size() == RANGE_CHUNK) {
+                more = true;
+                return true;
+            }
+            copies.push_back(store.value(next));
+            current = n.right;
+        }
+    }
+
+    typedef BPlusBookTree::Leaf Leaf;
+
+    static int rankInPage(const int *keys, int count, int bookID, bool inclusive) {
+        return BPlusBookTree::Search::rank(less<int>(), keys, count, bookID, inclusive);
+    }
+
+    // A leaf of the B+tree and its count, NULL when either cannot be right.
+    static const Leaf *leafAt(const BPlusBookTree &tree, PageIndex page, int &count) {
+        if (!tree.leafAllocated(page))
+            return NULL;
+        const Leaf &leaf = tree.leaf(page);
+        count = leaf.count;
+        return count >= 0 && count <= BPlusBookTree::PAGE_KEYS ? &leaf : NULL;
+    }
+
+    // The leaf BPlusTree's descent for bookID ends in, NO_PAGE in an empty tree. False when the descent went
+    // astray.
+    static bool findLeaf(const BPlusBookTree &tree, int bookID, bool inclusive, PageIndex &leaf) {
+        int levels = tree.levelCount();
+        PageIndex page = tree.rootPage();
+        if (levels == 0) {
+            leaf = NO_PAGE;
+            return true;
+        }
+        if (levels > BPlusBookTree::MAX_LEVELS)
+            return false;
+        for (int depth = 0; depth + 1 < levels; depth++) {
+            if (!tree.innerAllocated(page))
+                return false;
+            const BPlusBookTree::Inner &n = tree.inner(page);
+            int count = n.count;
+            if (count < 1 || count > BPlusBookTree::PAGE_KEYS)
+                return false;
+            page = n.children[rankInPage(n.keys, count - 1, bookID, inclusive)];
+        }
+        leaf = page;
+        return page != NO_PAGE;
+    }
+
+    // find, copyFloorCeiling and copyRange on the B+tree engine.
+    bool findInPages(const BPlusBookTree &tree, int bookID, NodeIndex &found) const {
+        found = NIL;
+        PageIndex page;
+        if (!findLeaf(tree, bookID, true, page))
+            return false;
+        if (page == NO_PAGE)
+            return true;
+        int count;
+        const Leaf *leaf = leafAt(tree, page, count);
+        if (leaf == NULL)
+            return false;
+        int slot = rankInPage(leaf->keys, count, bookID, true);
+        if (slot == 0) {
+            if (leaf->prev == NO_PAGE)
+                return true;
+            leaf = leafAt(tree, leaf->prev, slot);
+            if (leaf == NULL || slot == 0)
+                return false;
+        }
+        if (leaf->keys[slot - 1] == bookID)
+            found = leaf->values[slot - 1];
+        return found == NIL || store.allocated(found);
+    }
+
+    bool copyFloorCeilingFromPages(const BPlusBookTree &tree, int targetID) {
+        copies.clear();
+        PageIndex page;
+        if (!findLeaf(tree, targetID, true, page))
+            return false;
+        if (page == NO_PAGE)
+            return true;
+        int count;
+        const Leaf *leaf = leafAt(tree, page, count);
+        if (leaf == NULL)
+            return false;
+        int slot = rankInPage(leaf->keys, count, targetID, true);
+        NodeIndex floorNode = NIL, ceilingNode = NIL;
+        int other;
+        if (slot > 0) {
+            floorNode = leaf->values[slot - 1];
+            if (leaf->keys[slot - 1] == targetID)
+                ceilingNode = floorNode;
+        } else if (leaf->prev != NO_PAGE) {
+            const Leaf *before = leafAt(tree, leaf->prev, other);
+            if (before == NULL || other == 0)
+                return false;
+            floorNode = before->values[other - 1];
+            if (before->keys[other - 1] == targetID)
+                ceilingNode = floorNode;
+        }
+        if (ceilingNode == NIL && slot < count) {
+            ceilingNode = leaf->values[slot];
+        } else if (ceilingNode == NIL && leaf->next != NO_PAGE) {
+            const Leaf *after = leafAt(tree, leaf->next, other);
+            if (after == NULL || other == 0)
+                return false;
+            ceilingNode = after->values[0];
+        }
+        if ((floorNode != NIL && !store.allocated(floorNode)) || (ceilingNode != NIL && !store.allocated(ceilingNode)))
+            return false;
+        if (floorNode != NIL)
+            copies.push_back(store.value(floorNode));
+        if (ceilingNode != NIL && ceilingNode != floorNode)
+            copies.push_back(store.value(ceilingNode));
+        return true;
+    }
+
+    bool copyRangeFromPages(const BPlusBookTree &tree, int bookID1, int bookID2, bool &more) {
+        copies.clear();
+        more = false;
+        PageIndex page;
+        if (!findLeaf(tree, bookID1, false, page))
+            return false;
+        if (page == NO_PAGE)
+            return true;
+        int count;
+        const Leaf *leaf = leafAt(tree, page, count);
+        if (leaf == NULL)
+            return false;
+        // Every leaf holds a book, so a chunk never spans more leaves than this
+        int leavesLeft = RANGE_CHUNK + 1;
+        for (int slot = rankInPage(leaf->keys, count, bookID1, false);; slot++) {
+            if (slot == count) {
+                if (leaf->next == NO_PAGE)
+                    return true;
+                leaf = leafAt(tree, leaf->next, count);
+                if (leaf == NULL || --leavesLeft == 0)
+                    return false;
+                slot = -1;
+                continue;
+            }
+            if (leaf->keys[slot] > bookID2)
+                return true;
+            if (copies.size() == RANGE_CHUNK) {
+                more = true;
+                return true;
+            }
+            NodeIndex found = leaf->values[slot];
+            if (!store.allocated(found))
+                return false;
+            copies.push_back(store.value(found));
+        }
+    }
+
+public:
+    // Attaching to the tree; at most ReaderEpochs::MAX_READERS readers can be attached at once.
+    explicit TreeReader(Library &library)
+        : library(library), store(library.tree.nodes()), slot(library.epochs.attach()), retries(0) {
+        if (slot < 0)
+            throw runtime_error("too many tree readers");
+    }
+
+    ~TreeReader() { library.epochs.detach(slot); }
+
+    // Whether the book is in the library.
+    bool search(int bookID);
+
+    // Printing the book with the given ID.
+    void printBook(int bookID, OutputBuffer &outputFile);
+
+    // Printing the books with IDs in [bookID1, bookID2]. Every RANGE_CHUNK books are one consistent piece.
+    void printBooks(int bookID1, int bookID2, OutputBuffer &outputFile);
+
+    // Printing the books closest to the target ID.
+    void findClosestBook(int targetID, OutputBuffer &outputFile);
+
+    // Lookups repeated because a write got in the way.
+    unsigned long long retryCount() const { return retries; }
+};
+
+bool TreeReader::search(int bookID) {
+    NodeIndex found = NIL;
+    optimistic([&]() { return find(bookID, found); }, []() {});
+    return found != NIL;
+}
+
+void TreeReader::printBook(int bookID, OutputBuffer &outputFile) {
+    optimistic(
+        [&]() {
+            copies.clear();
+            NodeIndex found;
+            if (!find(bookID, found))
+                return false;
+            if (found != NIL)
+                copies.push_back(store.value(found));
+            return true;
+        },
+        [&]() {
+            if (copies.empty())
+                outputFile << "Book " << bookID << " not found in the Library" << "\n";
+            else
+                printBookInfo(&copies[0], outputFile);
+        });
+}
+
+void TreeReader::printBooks(int bookID1, int bookID2, OutputBuffer &outputFile) {
+    long long from = bookID1;
+    bool more = true;
+    while (more && from <= bookID2) {
+        optimistic([&]() { return copyRange((int)from, bookID2, more); },
+                   [&]() {
+                       for (size_t i = 0; i < copies.size(); i++)
+                           printBookInfo(&copies[i], outputFile);
+                   });
+        if (more)
+            from = (long long)copies.back().BookId + 1;
+    }
+}
+
+void TreeReader::findClosestBook(int targetID, OutputBuffer &outputFile) {
+    optimistic([&]() { return copyFloorCeiling(targetID); },
+               [&]() {
+                   if (copies.size() == 1) {
+                       printBookInfo(&copies[0], outputFile);
+                       return;
+                   }
+                   if (copies.empty())
+                       return;
+                   // Same tie rule as Library::findClosestBook: both are printed, lower ID first
+                   long long floorDistance = (long long)targetID - copies[0].BookId;
+                   long long ceilingDistance = (long long)copies[1].BookId - targetID;
+                   if (floorDistance <= ceilingDistance)
+                       printBookInfo(&copies[0], outputFile);
+                   if (ceilingDistance <= floorDistance)
+                       printBookInfo(&copies[1], outputFile);
+               });
+}
+
+// Operations understood by the command parser.
+enum CommandType {
+    CMD_UNKNOWN,
+    CMD_INSERT_BOOK,
+    CMD_PRINT_BOOK,
+    CMD_PRINT_BOOKS,
+    CMD_BORROW_BOOK,
+    CMD_RETURN_BOOK,
+    CMD_DELETE_BOOK,
+    CMD_FIND_CLOSEST_BOOK,
+    CMD_FIND_CLOSEST_BOOKS,
+    CMD_PRINT_PATRON,
+    CMD_CANCEL_RESERVATION,
+    CMD_SEARCH_TITLE,
+    CMD_SEARCH_AUTHOR,
+    CMD_UPDATE_PRIORITY,
+    CMD_RETURN_ALL,
+    CMD_COLOR_FLIP_COUNT,
+    CMD_ALLOCATOR_STATS,
+    CMD_BULK_INSERT_BEGIN,
+    CMD_BULK_INSERT_END,
+    CMD_COUNT_BOOKS,
+    CMD_RANK_OF,
+    CMD_SELECT_BOOK,
+    CMD_SAVE_SNAPSHOT,
+    CMD_LOAD_SNAPSHOT,
+    CMD_CHECKPOINT,
+    CMD_STATS,
+    CMD_FREEZE,
+    CMD_QUIT,
+    CMD_TYPES
+};
+
+// Operation names by CommandType, as they appear in input files.
+static const char *const COMMAND_NAMES[] = {
+    "", "InsertBook", "PrintBook", "PrintBooks", "BorrowBook", "ReturnBook", "DeleteBook", "FindClosestBook",
+    "FindClosestBooks", "PrintPatron", "CancelReservation", "SearchTitle", "SearchAuthor", "UpdatePriority",
+    "ReturnAll", "ColorFlipCount", "AllocatorStats", "BulkInsertBegin", "BulkInsertEnd", "CountBooks", "RankOf",
+    "SelectBook", "SaveSnapshot", "LoadSnapshot", "Checkpoint", "Stats", "Freeze", "Quit"
+};
+static_assert(sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]) == CMD_TYPES, "a name for every command type");
+
+// A decoded command. String fields point into the line they were parsed from.
+struct Command {
+    CommandType type;
+    int args[4];
+    int argCount;
+    StringRef title;
+    StringRef author;
+    StringRef availability;
+    StringRef path;
+
+    Command() : type(CMD_UNKNOWN), argCount(0) {
+        args[0] = args[1] = args[2] = args[3] = 0;
+    }
+};
+
+// Mapping the operation name to its command type. The name length and first character select a single
+// candidate which is then confirmed with one memcmp, instead of comparing against every name in turn.
+CommandType lookupOperation(const char *name, size_t length) {
+    CommandType type = CMD_UNKNOWN;
+    const char *expected = NULL;
+    switch (length) {
+    case 4:
+        type = CMD_QUIT; expected = "Quit";
+        break;
+    case 5:
+        type = CMD_STATS; expected = "Stats";
+        break;
+    case 6:
+        switch (name[0]) {
+        case 'R': type = CMD_RANK_OF; expected = "RankOf"; break;
+        case 'F': type = CMD_FREEZE; expected = "Freeze"; break;
+        }
+        break;
+    case 9:
+        switch (name[0]) {
+        case 'P': type = CMD_PRINT_BOOK; expected = "PrintBook"; break;
+        case 'R': type = CMD_RETURN_ALL; expected = "ReturnAll"; break;
+        }
+        break;
+    case 10:
+        switch (name[0]) {
+        case 'I': type = CMD_INSERT_BOOK; expected = "InsertBook"; break;
+        case 'P': type = CMD_PRINT_BOOKS; expected = "PrintBooks"; break;
+        case 'B': type = CMD_BORROW_BOOK; expected = "BorrowBook"; break;
+        case 'R': type = CMD_RETURN_BOOK; expected = "ReturnBook"; break;
+        case 'D': type = CMD_DELETE_BOOK; expected = "DeleteBook"; break;
+        case 'C':
+            if (name[1] == 'h') {
+                type = CMD_CHECKPOINT; expected = "Checkpoint";
+            } else {
+                type = CMD_COUNT_BOOKS; expected = "CountBooks";
+            }
+            break;
+        case 'S': type = CMD_SELECT_BOOK; expected = "SelectBook"; break;
+        }
+        break;
+    case 11:
+        switch (name[0]) {
+        case 'P': type = CMD_PRINT_PATRON; expected = "PrintPatron"; break;
+        case 'S': type = CMD_SEARCH_TITLE; expected = "SearchTitle"; break;
+        }
+        break;
+    case 12:
+        switch (name[1]) {
+        case 'a': type = CMD_SAVE_SNAPSHOT; expected = "SaveSnapshot"; break;
+        case 'o': type = CMD_LOAD_SNAPSHOT; expected = "LoadSnapshot"; break;
+        case 'e': type = CMD_SEARCH_AUTHOR; expected = "SearchAuthor"; break;
+        }
+        break;
+    case 14:
+        switch (name[0]) {
+        case 'C': type = CMD_COLOR_FLIP_COUNT; expected = "ColorFlipCount"; break;
+        case 'A': type = CMD_ALLOCATOR_STATS; expected = "AllocatorStats"; break;
+        case 'U': type = CMD_UPDATE_PRIORITY; expected = "UpdatePriority"; break;
+        }
+        break;
+
+    case 13:
+        type = CMD_BULK_INSERT_END; expected = "BulkInsertEnd";
+        break;
+    case 15:
+        switch (name[0]) {
+        case 'F': type = CMD_FIND_CLOSEST_BOOK; expected = "FindClosestBook"; break;
+        case 'B': type = CMD_BULK_INSERT_BEGIN; expected = "BulkInsertBegin"; break;
+        }
+        break;
+    case 16:
+        type = CMD_FIND_CLOSEST_BOOKS; expected = "FindClosestBooks";
+        break;
+    case 17:
+        type = CMD_CANCEL_RESERVATION; expected = "CancelReservation";
+        break;
+    }
+    if (expected == NULL || memcmp(name, expected, length) != 0)
+        return CMD_UNKNOWN;
+    return type;
+}
+
+// In place tokenizer for one command line. It follows the stream extraction rules the parser has always
+// used (skip whitespace, read an integer, drop the single separator after it, read strings up to the next
+// delimiter) without allocating.
+class CommandScanner {
+private:
+    const char *pos;
+    const char *end;
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    void skipSpace() {
+        while (pos < end && isSpace(*pos))
+            pos++;
+    }
+
+    // Same as `iss >> ws >> value`; leaves the value untouched when no digits follow.
+    // An out-of-range number saturates to INT_MAX or INT_MIN as the stream does.
+    void readInt(int &value) {
+        skipSpace();
+        const char *p = pos;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = (*p == '-');
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            pos = end;
+            return;
+        }
+        long long result = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            result = result * 10 + (*p - '0');
+            if (result > (long long)INT_MAX + 1)
+                result = (long long)INT_MAX + 1;
+            p++;
+        }
+        if (negative)
+            value = (int)-result;
+        else
+            value = (int)min(result, (long long)INT_MAX);
+        pos = p;
+    }
+
+    // Same as `iss.ignore()`.
+    void skipOne() {
+        if (pos < end)
+            pos++;
+    }
+
+    // Same as `getline(iss >> ws, field, delimiter)`.
+    StringRef readField(char delimiter) {
+        skipSpace();
+        const char *start = pos;
+        if (start >= end)
+            return StringRef(end, 0);
+        const char *stop = static_cast<const char*>(memchr(pos, delimiter, end - pos));
+        if (stop == NULL) {
+            pos = end;
+            return StringRef(start, end - start);
+        }
+        pos = stop + 1;
+        return StringRef(start, stop - start);
+    }
+
+    // A file name or search prefix up to the closing parenthesis, with surrounding blanks and quotes removed.
+    StringRef readPath() {
+        StringRef field = readField(')');
+        const char *first = field.data;
+        const char *last = field.data + field.length;
+        while (last > first && isSpace(last[-1]))
+            last--;
+        if (last - first >= 2 && *first == '"' && last[-1] == '"') {
+            first++;
+            last--;
+        }
+        return StringRef(first, last - first);
+    }
+
+public:
+    // Decoding the line [begin, end) into a command.
+    Command parse(const char *begin, const char *lineEnd) {
+        Command cmd;
+        pos = begin;
+        end = lineEnd;
+        const char *paren = static_cast<const char*>(memchr(begin, '(', lineEnd - begin));
+        const char *nameEnd = paren ? paren : lineEnd;
+        cmd.type = lookupOperation(begin, nameEnd - begin);
+        pos = paren ? paren + 1 : lineEnd;
+
+        switch (cmd.type) {
+        case CMD_INSERT_BOOK:
+            readInt(cmd.args[0]);
+            skipOne();
+            cmd.title = readField(',');
+            cmd.author = readField(',');
+            cmd.availability = readField(')');
+            break;
+        case CMD_PRINT_BOOK:
+        case CMD_DELETE_BOOK:
+        case CMD_FIND_CLOSEST_BOOK:
+        case CMD_RANK_OF:
+        case CMD_SELECT_BOOK:
+        case CMD_PRINT_PATRON:
+        case CMD_RETURN_ALL:
+            readInt(cmd.args[0]);
+            break;
+        case CMD_PRINT_BOOKS:
+            readInt(cmd.args[0]);
+            skipOne();
+            readInt(cmd.args[1]);
+            cmd.argCount = 2;
+            // Optional offset and limit
+            skipSpace();
+            if (pos < end && *pos == ',') {
+                skipOne();
+                readInt(cmd.args[2]);
+                skipOne();
+                readInt(cmd.args[3]);
+                cmd.argCount = 4;
+            }
+            break;
+        case CMD_RETURN_BOOK:
+        case CMD_COUNT_BOOKS:
+        case CMD_FIND_CLOSEST_BOOKS:
+        case CMD_CANCEL_RESERVATION:
+            readInt(cmd.args[0]);
+            skipOne();
+            readInt(cmd.args[1]);
+            break;
+        case CMD_BORROW_BOOK:
+        case CMD_UPDATE_PRIORITY:
+            readInt(cmd.args[0]);
+            skipOne();
+            readInt(cmd.args[1]);
+            skipOne();
+            readInt(cmd.args[2]);
+            break;
+        case CMD_SAVE_SNAPSHOT:
+        case CMD_LOAD_SNAPSHOT:
+        case CMD_STATS:
+            cmd.path = readPath();
+            break;
+        case CMD_SEARCH_TITLE:
+            cmd.title = readPath();
+            break;
+        case CMD_SEARCH_AUTHOR:
+            cmd.author = readPath();
+            break;
+        default:
+            break;
+        }
+        return cmd;
+    }
+};
+
+// Read only view of a whole input file. Regular files are memory mapped so commands can be tokenized in
+// place; anything that cannot be mapped (pipes, empty files) is read into a private buffer instead.
+class InputFile {
+private:
+    const char *data;
+    size_t length;
+    bool mapped;
+    vector<char> buffer;
+
+    InputFile(const InputFile &);
+    InputFile &operator=(const InputFile &);
+
+public:
+    InputFile() : data(NULL), length(0), mapped(false) {}
+
+    ~InputFile() {
+        if (mapped)
+            munmap(const_cast<char*>(data), length);
+    }
+
+    bool open(const string &fileName) {
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *address = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                madvise(address, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(address);
+                length = st.st_size;
+                mapped = true;
+                close(fd);
+                return true;
+            }
+        }
+        char chunk[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        }
+        close(fd);
+        if (n < 0)
+            return false;
+        data = buffer.empty() ? "" : &buffer[0];
+        length = buffer.size();
+        return true;
+    }
+
+    const char *begin() const { return data; }
+    const char *end() const { return data + length; }
+};
+
+// Writing the statistics as text, or as one line of JSON.
+void printStats(const LibraryStats &s, bool json, OutputBuffer &outputFile) {
+    // Average search depth with two decimals
+    long long hundredths = s.books > 0 ? (s.depthSum * 100 + s.books / 2) / s.books : 0;
+    char averageDepth[32];
+    snprintf(averageDepth, sizeof(averageDepth), "%lld.%02lld", hundredths / 100, hundredths % 100);
+    if (json) {
+        outputFile << "{\"books\":" << s.books << ",\"height\":" << s.height << ",\"blackHeight\":" << s.blackHeight
+                   << ",\"averageSearchDepth\":" << averageDepth << ",\"waitlists\":[";
+        for (size_t i = 0; i < s.waitlists.size(); i++)
+            outputFile << (i > 0 ? "," : "") << s.waitlists[i];
+        outputFile << "],\"bookCache\":{\"hits\":" << s.cacheHits << ",\"lookups\":" << s.cacheLookups << "}";
+#if GATOR_STATS
+        outputFile << ",\"rotations\":{\"left\":" << s.rotations[0] << ",\"right\":" << s.rotations[1] << "}"
+                   << ",\"recolors\":{";
+        for (int i = 0; i < RECOLOR_CAUSES; i++)
+            outputFile << (i > 0 ? "," : "") << "\"" << RECOLOR_NAMES[i] << "\":" << s.recolors[i];
+        outputFile << "},\"latencyNs\":{";
+        bool first = true;
+        for (size_t type = 0; type < s.latency.size(); type++) {
+            const LatencyHistogram &h = s.latency[type];
+            if (h.count() == 0)
+                continue;
+            outputFile << (first ? "" : ",") << "\"" << COMMAND_NAMES[type] << "\":{\"count\":" << h.count()
+                       << ",\"p50\":" << h.percentile(0.50) << ",\"p99\":" << h.percentile(0.99)
+                       << ",\"p999\":" << h.percentile(0.999) << ",\"max\":" << h.percentile(1.0) << "}";
+            first = false;
+        }
+        outputFile << "}";
+#endif
+        outputFile << "}\n";
+        return;
+    }
+    outputFile << "Books: " << s.books << ", height " << s.height << ", black height " << s.blackHeight
+               << ", average search depth " << averageDepth << "\n";
+    outputFile << "Waitlist sizes:";
+    const char *separator = " ";
+    for (size_t i = 0; i < s.waitlists.size(); i++) {
+        if (s.waitlists[i] != 0) {
+            outputFile << separator << (int)i << ": " << s.waitlists[i];
+            separator = ", ";
+        }
+    }
+    outputFile << "\n";
+    outputFile << "Book cache: " << s.cacheHits << " hits in " << s.cacheLookups << " lookups" << "\n";
+#if GATOR_STATS
+    outputFile << "Rotations: " << s.rotations[0] << " left, " << s.rotations[1] << " right" << "\n";
+    outputFile << "Recolors:";
+    for (int i = 0; i < RECOLOR_CAUSES; i++)
+        outputFile << (i > 0 ? "," : "") << " " << s.recolors[i] << " " << RECOLOR_NAMES[i];
+    outputFile << "\n";
+    outputFile << "Latency in ns (count, p50, p99, p99.9, max):" << "\n";
+    for (size_t type = 0; type < s.latency.size(); type++) {
+        const LatencyHistogram &h = s.latency[type];
+        if (h.count() != 0)
+            outputFile << COMMAND_NAMES[type] << ": " << h.count() << ", " << h.percentile(0.50) << ", "
+                       << h.percentile(0.99) << ", " << h.percentile(0.999) << ", " << h.percentile(1.0) << "\n";
+    }
+#else
+    outputFile << "Rotations, recolors and latencies are not collected in this build" << "\n";
+#endif
+}
+
+// Measuring one command and adding its latency to the library's statistics when it ends.
+class CommandTimer {
+#if GATOR_STATS
+private:
+    Library &library;
+    CommandType type;
+    chrono::steady_clock::time_point start;
+
+public:
+    CommandTimer(Library &library, CommandType type)
+        : library(library), type(type), start(chrono::steady_clock::now()) {}
+
+    ~CommandTimer() {
+        if (type != CMD_UNKNOWN)
+            library.recordLatency(type, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+#else
+public:
+    CommandTimer(Library &, CommandType) {}
+#endif
+};
+
+class WriteAheadLog;
+
+// Commands read ahead at a time, so that the books they name are looked up together; see
+// CommandExecutor::prefetch.
+static const size_t COMMAND_WINDOW = 16;
+
+// The book a command looks up before acting on it; false for commands that look up none.
+static bool lookedUpBook(const Command &cmd, int &bookID) {
+    switch (cmd.type) {
+    case CMD_PRINT_BOOK:
+    case CMD_DELETE_BOOK:
+        bookID = cmd.args[0];
+        return true;
+    case CMD_BORROW_BOOK:
+    case CMD_RETURN_BOOK:
+    case CMD_CANCEL_RESERVATION:
+    case CMD_UPDATE_PRIORITY:
+        bookID = cmd.args[1];
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Applies decoded commands to the library and writes their output. Between BulkInsertBegin() and
+// BulkInsertEnd() the InsertBook commands are collected and added with one Library::bulkInsert. Any other
+// command in between first inserts the books collected so far, so it sees them as if added one by one.
+class CommandExecutor {
+private:
+    Library &library;
+    OutputBuffer &outputFile;
+    bool collecting;
+    vector<BookRecord> batch;
+    WriteAheadLog *log;    // records every command that changes the library, when set
+    uint32_t session;      // tells the records of this executor apart from others sharing the log
+
+    // Appending cmd to the log before it runs, if it changes the library. Returns false when cmd changes the
+    // library but the log cannot be written, so it must not run.
+    bool record(const Command &cmd);
+
+    // Starting a new log generation; see WriteAheadLog::checkpoint.
+    bool checkpoint(string &error);
+    void checkpointIfDue();
+
+    // Inserting the collected batch, reporting every duplicate the way InsertBook does.
+    void insertBatch() {
+        vector<int> duplicates;
+        library.bulkInsert(batch, duplicates);
+        for (size_t i = 0; i < duplicates.size(); i++) {
+            outputFile << "Book already exists";
+        }
+        batch.clear();
+    }
+
+    void finishBatch() {
+        insertBatch();
+        collecting = false;
+    }
+
+public:
+    CommandExecutor(Library &library, OutputBuffer &outputFile)
+        : library(library), outputFile(outputFile), collecting(false), log(NULL), session(0) {}
+
+    // Writing every change made through this executor to wal, as the given session.
+    void logTo(WriteAheadLog *wal, uint32_t sessionID) {
+        log = wal;
+        session = sessionID;
+    }
+
+    // Completing any pending work once the input ends.
+    void finish() {
+        if (collecting) {
+            if (log != NULL) {
+                Command end;
+                end.type = CMD_BULK_INSERT_END;
+                record(end);
+            }
+            finishBatch();
+        }
+    }
+
+    // Inserting the books collected so far while the bulk insert stays open, which any command but InsertBook
+    // does first; for callers that spread one input over several executors.
+    void insertCollected() {
+        if (!batch.empty())
+            insertBatch();
+    }
+
+    // Looking up together the books the next n commands name, before they are applied one by one; see
+    // Library::searchMany.
+    void prefetch(const Command *cmds, size_t n);
+
+    // Applying one command. Returns false once the input asks to quit.
+    bool execute(const Command &cmd);
+};
+
+void CommandExecutor::prefetch(const Command *cmds, size_t n) {
+    int ids[COMMAND_WINDOW];
+    size_t count = 0;
+    for (size_t i = 0; i < n && count < COMMAND_WINDOW; i++) {
+        if (lookedUpBook(cmds[i], ids[count]))
+            count++;
+    }
+    BookNode *books[COMMAND_WINDOW];
+    if (count > 1)
+        library.searchMany(ids, count, books);
+}
+
+bool CommandExecutor::execute(const Command &cmd) {
+    CommandTimer timer(library, cmd.type);
+    if (log != NULL && !record(cmd)) {
+        outputFile << "Command not run: the write-ahead log cannot be written" << "\n\n";
+        return true;
+    }
+    if (!batch.empty() && cmd.type != CMD_INSERT_BOOK && cmd.type != CMD_BULK_INSERT_END)
+        insertBatch();
+    switch (cmd.type) {
+    case CMD_INSERT_BOOK:
+        if (collecting) {
+            batch.push_back(BookRecord(cmd.args[0], cmd.title.str(), cmd.author.str(), true, -1));
+            break;
+        }
+        if (!library.insertBook(cmd.args[0], cmd.title.str(), cmd.author.str(), true, -1))
+            outputFile << "Book already exists";
+        break;
+    case CMD_PRINT_BOOK:
+        if (!library.search(cmd.args[0]))
+        {
+            outputFile << "Book "<<cmd.args[0]<<" not found in the Library"<<"\n\n";
+        }
+        else{
+            library.printBook(cmd.args[0], outputFile);
+        }
+        break;
+    case CMD_PRINT_BOOKS:
+        if (cmd.argCount == 4)
+            library.printBooksPage(cmd.args[0], cmd.args[1], cmd.args[2], cmd.args[3], outputFile);
+        else
+            library.printBooks(cmd.args[0], cmd.args[1], outputFile);
+        break;
+    case CMD_COUNT_BOOKS:
+        outputFile << "Books in range [" << cmd.args[0] << ", " << cmd.args[1] << "]: "
+                   << library.countBooks(cmd.args[0], cmd.args[1]) << "\n\n";
+        break;
+    case CMD_RANK_OF: {
+        int rank = library.rankOf(cmd.args[0]);
+        if (rank == 0)
+            outputFile << "Book " << cmd.args[0] << " not found in the Library" << "\n\n";
+        else
+            outputFile << "Rank of Book " << cmd.args[0] << ": " << rank << "\n\n";
+        break;
+    }
+    case CMD_SELECT_BOOK: {
+        BookNode *selected = library.selectBook(cmd.args[0]);
+        if (selected == NULL)
+            outputFile << "No book at rank " << cmd.args[0] << "\n\n";
+        else
+            printBookInfo(selected, outputFile);
+        break;
+    }
+    case CMD_BORROW_BOOK:
+        library.borrowBook(cmd.args[0], cmd.args[1], cmd.args[2], outputFile);
+        outputFile <<"\n";
+        break;
+    case CMD_RETURN_BOOK:
+        library.returnBook(cmd.args[0], cmd.args[1], outputFile);
+        break;
+    case CMD_COLOR_FLIP_COUNT:
+        library.countColorFlip(outputFile);
+        outputFile<<"\n";
+        break;
+    case CMD_ALLOCATOR_STATS:
+        library.printAllocatorStats(outputFile);
+        outputFile << "\n";
+        break;
+    case CMD_DELETE_BOOK:
+        library.deleteBook(cmd.args[0], outputFile);
+        outputFile <<"\n";
+        break;
+    case CMD_FIND_CLOSEST_BOOK:
+        library.findClosestBook(cmd.args[0], outputFile);
+        outputFile << "\n";
+        break;
+    case CMD_FIND_CLOSEST_BOOKS:
+        library.findClosestBooks(cmd.args[0], cmd.args[1], outputFile);
+        outputFile << "\n";
+        break;
+    case CMD_PRINT_PATRON:
+        library.printPatron(cmd.args[0], outputFile);
+        break;
+    case CMD_SEARCH_TITLE:
+        library.searchTitle(cmd.title, outputFile);
+        break;
+    case CMD_SEARCH_AUTHOR:
+        library.searchAuthor(cmd.author, outputFile);
+        break;
+    case CMD_CANCEL_RESERVATION:
+        library.cancelReservation(cmd.args[0], cmd.args[1], outputFile);
+        outputFile << "\n";
+        break;
+    case CMD_UPDATE_PRIORITY:
+        library.updatePriority(cmd.args[0], cmd.args[1], cmd.args[2], outputFile);
+        outputFile << "\n";
+        break;
+    case CMD_RETURN_ALL:
+        library.returnAll(cmd.args[0], outputFile);
+        break;
+    case CMD_BULK_INSERT_BEGIN:
+        collecting = true;
+        break;
+    case CMD_BULK_INSERT_END:
+        if (collecting)
+            finishBatch();
+        break;
+    case CMD_SAVE_SNAPSHOT:
+    case CMD_LOAD_SNAPSHOT: {
+        finish();
+        string error;
+        string path = cmd.path.str();
+        if (cmd.type == CMD_SAVE_SNAPSHOT) {
+            if (library.saveSnapshot(path, error))
+                outputFile << "Library saved to snapshot " << path << "\n";
+            else
+                outputFile << "Snapshot " << path << " could not be saved: " << error << "\n";
+        } else {
+            if (library.loadSnapshot(path, error)) {
+                outputFile << "Library loaded from snapshot " << path << "\n";
+                // The log must not depend on the snapshot file staying around
+                if (log != NULL && !checkpoint(error))
+                    outputFile << "Checkpoint failed: " << error << "\n";
+            } else {
+                outputFile << "Snapshot " << path << " could not be loaded: " << error << "\n";
+            }
+        }
+        outputFile << "\n";
+        break;
+    }
+    case CMD_STATS: {
+        LibraryStats stats;
+        library.collectStats(stats);
+        printStats(stats, compareText(cmd.path, StringRef("json", 4)) == 0, outputFile);
+        outputFile << "\n";
+        break;
+    }
+    case CMD_FREEZE:
+        if (library.freeze())
+            outputFile << "Library frozen: " << library.bookCount() << " books" << "\n\n";
+        else
+            outputFile << "Library not frozen: some book IDs are held by more than one book" << "\n\n";
+        break;
+    case CMD_CHECKPOINT: {
+        string error;
+        if (checkpoint(error))
+            outputFile << "Checkpoint written" << "\n\n";
+        else
+            outputFile << "Checkpoint failed: " << error << "\n\n";
+        break;
+    }
+    case CMD_QUIT:
+        finish();
+        outputFile << "Program Terminated!!";
+        return false;
+    default:
+        break;
+    }
+    if (log != NULL)
+        checkpointIfDue();
+    return true;
+}
+
+// The library split by BookId range over several trees, each owned by a worker thread, so commands on
+// different books run in parallel. Commands are taken in batches. A command about one book goes to the
+// shard owning its ID; PrintBooks, FindClosestBook and ColorFlipCount go to every shard involved and their
+// results are merged. Once the workers finish a batch its output is written in command order, so it reads
+// exactly like a serial run. The other commands need the whole library and run on the calling thread
+// between batches. When one shard receives far more commands than the average, the boundaries are
+// recomputed from recently routed keys and books are moved to their new shards.
+class ShardedLibrary {
+public:
+    static const int MAX_SHARDS = 64;
+
+private:
+    static const size_t BATCH_SIZE = 4096;              // commands handed to the workers at once
+    static const long long REBALANCE_WINDOW = 1 << 16;  // routed commands between load checks
+    static const size_t KEY_SAMPLES = 1024;             // recent keys remembered per shard
+
+    // What a shard does for one command.
+    enum TaskKind {
+        TASK_EXECUTE,      // run the command through the shard's CommandExecutor
+        TASK_CLOSEST,      // print the shard's floor and ceiling of the target ID
+        TASK_COLOR_FLIPS,  // report the shard's color flip count
+        TASK_FLUSH_BULK    // insert what the shard's executor collected, keeping the bulk insert open
+    };
+
+    struct Task {
+        const Command *command;
+        TaskKind kind;
+        size_t begin;          // output of the task in the shard's buffer
+        size_t end;
+        size_t floorEnd;       // TASK_CLOSEST: floor printed in [begin, floorEnd), ceiling in [floorEnd, end)
+        long long floorID;     // TASK_CLOSEST: LLONG_MIN when the shard has no floor
+        long long ceilingID;   // TASK_CLOSEST: LLONG_MAX when the shard has no ceiling
+        long long flips;       // TASK_COLOR_FLIPS
+    };
+
+    struct Shard {
+        Library library;
+        OutputBuffer output;
+        CommandExecutor executor;
+        vector<Task> tasks;
+        size_t merged;         // tasks whose output has been written
+        long long load;        // commands routed here in the current window
+        vector<int> samples;   // ring of recently routed keys
+        size_t sampled;
+        thread worker;
+
+        explicit Shard(EngineKind engine)
+            : library(engine), executor(library, output), merged(0), load(0), sampled(0) {
+            output.collectInMemory();
+        }
+    };
+
+    // Which shards a batched command went to, and what kind of work.
+    struct Routing {
+        TaskKind kind;
+        int first;
+        int last;
+    };
+
+    OutputBuffer &outputFile;
+    vector<Shard*> shards;
+    vector<int> lowerBounds;   // smallest ID of every shard; the first is INT_MIN
+    vector<Command> commands;
+    vector<Routing> routes;
+    long long windowCommands;
+    bool collecting;           // inside BulkInsertBegin ... BulkInsertEnd; the shards hold unsorted books
+    bool collected;            // an InsertBook went to the shards since they last inserted what they collected
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable done;
+    uint64_t generation;
+    int pending;
+    bool stopping;
+
+    ShardedLibrary(const ShardedLibrary &);
+    ShardedLibrary &operator=(const ShardedLibrary &);
+
+    int shardOf(int bookID) const {
+        return (int)(upper_bound(lowerBounds.begin(), lowerBounds.end(), bookID) - lowerBounds.begin()) - 1;
+    }
+
+    int upperBoundOf(int shard) const {
+        return shard + 1 < (int)shards.size() ? lowerBounds[shard + 1] - 1 : INT_MAX;
+    }
+
+    Library &library(int shard) { return shards[shard]->library; }
+
+    void workerLoop(Shard *shard);
+    void prefetchTasks(Shard &shard, size_t first);
+    void runTask(Shard &shard, Task &task);
+    void enqueue(const Command &cmd, TaskKind kind, int first, int last);
+    void route(const Command &cmd, int bookID);
+    void flush();
+    void mergeOutput(const Routing &routing);
+    void finishShards();
+    bool runGlobal(const Command &cmd);
+    void rebalance();
+    void repartition(const vector<int> &newBounds);
+
+public:
+    ShardedLibrary(int shardCount, OutputBuffer &outputFile, EngineKind engine = ENGINE_RBTREE);
+    ~ShardedLibrary();
+
+    // Nothing to do: the workers look up the books of their commands ahead themselves.
+    void prefetch(const Command *, size_t) {}
+
+    // Applying one command. Returns false once the input asks to quit.
+    bool execute(const Command &cmd);
+
+    // Completing every queued command once the input ends.
+    void finish() {
+        flush();
+        finishShards();
+    }
+
+    // Smallest ID of every shard, for reporting.
+    const vector<int> &boundaries() const { return lowerBounds; }
+};
+
+ShardedLibrary::ShardedLibrary(int shardCount, OutputBuffer &outputFile, EngineKind engine)
+    : outputFile(outputFile), windowCommands(0), collecting(false), collected(false), generation(0), pending(0), stopping(false) {
+    if (shardCount < 1)
+        shardCount = 1;
+    if (shardCount > MAX_SHARDS)
+        shardCount = MAX_SHARDS;
+    // Until the first rebalance the shards split the non-negative IDs evenly
+    for (int s = 0; s < shardCount; s++) {
+        shards.push_back(new Shard(engine));
+        lowerBounds.push_back(s == 0 ? INT_MIN : (int)((long long)INT_MAX / shardCount * s));
+    }
+    commands.reserve(BATCH_SIZE);
+    for (int s = 0; s < shardCount; s++)
+        shards[s]->worker = thread(&ShardedLibrary::workerLoop, this, shards[s]);
+}
+
+ShardedLibrary::~ShardedLibrary() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t s = 0; s < shards.size(); s++) {
+        shards[s]->worker.join();
+        delete shards[s];
+    }
+}
+
+// Running the shard's tasks of every batch until the library is destroyed.
+void ShardedLibrary::workerLoop(Shard *shard) {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        for (size_t t = 0; t < shard->tasks.size(); t++) {
+            if (t % COMMAND_WINDOW == 0)
+                prefetchTasks(*shard, t);
+            runTask(*shard, shard->tasks[t]);
+        }
+        lock_guard<mutex> guard(lock);
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+// Looking up together the books named by the shard's next COMMAND_WINDOW tasks from first on.
+void ShardedLibrary::prefetchTasks(Shard &shard, size_t first) {
+    int ids[COMMAND_WINDOW];
+    size_t count = 0;
+    for (size_t t = first; t < shard.tasks.size() && t < first + COMMAND_WINDOW; t++) {
+        if (shard.tasks[t].kind == TASK_EXECUTE && lookedUpBook(*shard.tasks[t].command, ids[count]))
+            count++;
+    }
+    BookNode *books[COMMAND_WINDOW];
+    if (count > 1)
+        shard.library.searchMany(ids, count, books);
+}
+
+void ShardedLibrary::runTask(Shard &shard, Task &task) {
+    task.begin = shard.output.size();
+    switch (task.kind) {
+    case TASK_EXECUTE:
+        shard.executor.execute(*task.command);
+        break;
+    case TASK_CLOSEST: {
+        BookNode *floorBook, *ceilingBook;
+        shard.library.closestCandidates(task.command->args[0], floorBook, ceilingBook);
+        task.floorID = floorBook == NULL ? LLONG_MIN : floorBook->BookId;
+        task.ceilingID = ceilingBook == NULL ? LLONG_MAX : ceilingBook->BookId;
+        if (floorBook != NULL)
+            printBookInfo(floorBook, shard.output);
+        task.floorEnd = shard.output.size();
+        if (ceilingBook != NULL && ceilingBook != floorBook)
+            printBookInfo(ceilingBook, shard.output);
+        break;
+    }
+    case TASK_COLOR_FLIPS:
+        task.flips = shard.library.colorFlips();
+        break;
+    case TASK_FLUSH_BULK:
+        shard.executor.insertCollected();
+        break;
+    }
+    task.end = shard.output.size();
+}
+
+void ShardedLibrary::enqueue(const Command &cmd, TaskKind kind, int first, int last) {
+    commands.push_back(cmd);
+    Routing routing = {kind, first, last};
+    routes.push_back(routing);
+    for (int s = first; s <= last; s++) {
+        Task task;
+        task.command = &commands.back();
+        task.kind = kind;
+        shards[s]->tasks.push_back(task);
+    }
+}
+
+// Sending a single book command to its shard and remembering the key for rebalancing.
+void ShardedLibrary::route(const Command &cmd, int bookID) {
+    int s = shardOf(bookID);
+    Shard &shard = *shards[s];
+    shard.load++;
+    if (shard.samples.size() < KEY_SAMPLES)
+        shard.samples.push_back(bookID);
+    else
+        shard.samples[shard.sampled % KEY_SAMPLES] = bookID;
+    shard.sampled++;
+    windowCommands++;
+    enqueue(cmd, TASK_EXECUTE, s, s);
+}
+
+bool ShardedLibrary::execute(const Command &cmd) {
+    // Inside a bulk insert any other command first has every shard insert what it collected
+    if (collected && cmd.type != CMD_INSERT_BOOK && cmd.type != CMD_BULK_INSERT_END) {
+        enqueue(Command(), TASK_FLUSH_BULK, 0, shards.size() - 1);
+        collected = false;
+        if (commands.size() == BATCH_SIZE)
+            flush();
+    }
+    switch (cmd.type) {
+    case CMD_INSERT_BOOK:
+        collected = collecting;
+        route(cmd, cmd.args[0]);
+        break;
+    case CMD_PRINT_BOOK:
+    case CMD_DELETE_BOOK:
+        route(cmd, cmd.args[0]);
+        break;
+    case CMD_BORROW_BOOK:
+    case CMD_RETURN_BOOK:
+    case CMD_CANCEL_RESERVATION:
+    case CMD_UPDATE_PRIORITY:
+        route(cmd, cmd.args[1]);
+        break;
+    case CMD_PRINT_BOOKS:
+        if (cmd.argCount == 4) {
+            flush();
+            return runGlobal(cmd);
+        }
+        if (cmd.args[0] <= cmd.args[1])
+            enqueue(cmd, TASK_EXECUTE, shardOf(cmd.args[0]), shardOf(cmd.args[1]));
+        break;
+    case CMD_FIND_CLOSEST_BOOK:
+        enqueue(cmd, TASK_CLOSEST, 0, shards.size() - 1);
+        break;
+    case CMD_COLOR_FLIP_COUNT:
+        enqueue(cmd, TASK_COLOR_FLIPS, 0, shards.size() - 1);
+        break;
+    case CMD_BULK_INSERT_BEGIN:
+    case CMD_BULK_INSERT_END:
+        collecting = cmd.type == CMD_BULK_INSERT_BEGIN;
+        collected = false;
+        enqueue(cmd, TASK_EXECUTE, 0, shards.size() - 1);
+        break;
+    case CMD_UNKNOWN:
+        break;
+    default:
+        flush();
+        return runGlobal(cmd);
+    }
+    if (commands.size() == BATCH_SIZE)
+        flush();
+    return true;
+}
+
+// Running the queued batch on the workers and writing its output in command order.
+void ShardedLibrary::flush() {
+    if (commands.empty())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        pending = shards.size();
+        generation++;
+    }
+    wake.notify_all();
+    {
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&]() { return pending == 0; });
+    }
+    for (size_t c = 0; c < routes.size(); c++)
+        mergeOutput(routes[c]);
+    for (size_t s = 0; s < shards.size(); s++) {
+        shards[s]->tasks.clear();
+        shards[s]->merged = 0;
+        shards[s]->output.clear();
+    }
+    commands.clear();
+    routes.clear();
+    if (windowCommands >= REBALANCE_WINDOW && !collecting)
+        rebalance();
+}
+
+void ShardedLibrary::mergeOutput(const Routing &routing) {
+    if (routing.kind == TASK_EXECUTE || routing.kind == TASK_FLUSH_BULK) {
+        for (int s = routing.first; s <= routing.last; s++) {
+            const Task &task = shards[s]->tasks[shards[s]->merged++];
+            outputFile.append(shards[s]->output.data() + task.begin, task.end - task.begin);
+        }
+        return;
+    }
+    if (routing.kind == TASK_COLOR_FLIPS) {
+        long long flips = 0;
+        for (int s = routing.first; s <= routing.last; s++)
+            flips += shards[s]->tasks[shards[s]->merged++].flips;
+        outputFile << "Color Flip Count: " << flips << "\n" << "\n";
+        return;
+    }
+    // The overall floor is the highest shard floor and the ceiling the lowest shard ceiling
+    const Task *floorTask = NULL, *ceilingTask = NULL;
+    int floorShard = -1, ceilingShard = -1;
+    for (int s = routing.first; s <= routing.last; s++) {
+        const Task &task = shards[s]->tasks[shards[s]->merged++];
+        if (task.floorID != LLONG_MIN && (floorTask == NULL || task.floorID > floorTask->floorID)) {
+            floorTask = &task;
+            floorShard = s;
+        }
+        if (task.ceilingID != LLONG_MAX && (ceilingTask == NULL || task.ceilingID < ceilingTask->ceilingID)) {
+            ceilingTask = &task;
+            ceilingShard = s;
+        }
+    }
+    long long targetID = floorTask != NULL ? floorTask->command->args[0] : (ceilingTask != NULL ? ceilingTask->command->args[0] : 0);
+    long long floorDistance = floorTask == NULL ? LLONG_MAX : targetID - floorTask->floorID;
+    long long ceilingDistance = ceilingTask == NULL ? LLONG_MAX : ceilingTask->ceilingID - targetID;
+    if (floorTask != NULL && (floorDistance == 0 || floorDistance <= ceilingDistance))
+        outputFile.append(shards[floorShard]->output.data() + floorTask->begin, floorTask->floorEnd - floorTask->begin);
+    if (ceilingTask != NULL && floorDistance != 0 && ceilingDistance <= floorDistance)
+        outputFile.append(shards[ceilingShard]->output.data() + ceilingTask->floorEnd, ceilingTask->end - ceilingTask->floorEnd);
+    outputFile << "\n";
+}
+
+// Completing a bulk insert every shard may be collecting, as CommandExecutor::finish does.
+void ShardedLibrary::finishShards() {
+    collecting = false;
+    collected = false;
+    for (size_t s = 0; s < shards.size(); s++) {
+        shards[s]->executor.finish();
+        outputFile.append(shards[s]->output.data(), shards[s]->output.size());
+        shards[s]->output.clear();
+    }
+}
+
+// Running a command that needs the whole library, with the workers idle. Output matches CommandExecutor.
+bool ShardedLibrary::runGlobal(const Command &cmd) {
+    int n = shards.size();
+    switch (cmd.type) {
+    case CMD_PRINT_BOOKS: {
+        // One page: the offset is skipped over whole shards before printing starts
+        long long offset = cmd.args[2], limit = cmd.args[3];
+        if (offset < 0 || limit <= 0 || cmd.args[0] > cmd.args[1])
+            break;
+        for (int s = shardOf(cmd.args[0]); s <= shardOf(cmd.args[1]) && limit > 0; s++) {
+            long long count = library(s).countBooks(cmd.args[0], cmd.args[1]);
+            if (offset >= count) {
+                offset -= count;
+                continue;
+            }
+            long long printed = min(limit, count - offset);
+            library(s).printBooksPage(cmd.args[0], cmd.args[1], offset, printed, outputFile);
+            limit -= printed;
+            offset = 0;
+        }
+        break;
+    }
+    case CMD_COUNT_BOOKS: {
+        long long count = 0;
+        for (int s = 0; s < n; s++)
+            count += library(s).countBooks(cmd.args[0], cmd.args[1]);
+        outputFile << "Books in range [" << cmd.args[0] << ", " << cmd.args[1] << "]: " << count << "\n\n";
+        break;
+    }
+    case CMD_RANK_OF: {
+        int owner = shardOf(cmd.args[0]);
+        long long rank = library(owner).rankOf(cmd.args[0]);
+        if (rank == 0) {
+            outputFile << "Book " << cmd.args[0] << " not found in the Library" << "\n\n";
+            break;
+        }
+        for (int s = 0; s < owner; s++)
+            rank += library(s).bookCount();
+        outputFile << "Rank of Book " << cmd.args[0] << ": " << rank << "\n\n";
+        break;
+    }
+    case CMD_SELECT_BOOK: {
+        long long rank = cmd.args[0];
+        BookNode *selected = NULL;
+        for (int s = 0; s < n && selected == NULL; s++) {
+            if (rank <= library(s).bookCount())
+                selected = library(s).selectBook(rank);
+            rank -= library(s).bookCount();
+        }
+        if (selected == NULL)
+            outputFile << "No book at rank " << cmd.args[0] << "\n\n";
+        else
+            printBookInfo(selected, outputFile);
+        break;
+    }
+    case CMD_FIND_CLOSEST_BOOKS: {
+        // The same two frontiers as Library::findClosestBooks, as (shard, rank) positions that step
+        // across shard boundaries. Rank 0 or a shard past either end means the frontier is exhausted.
+        int targetID = cmd.args[0];
+        int lowerShard = shardOf(targetID), upperShard;
+        long long lowerRank = library(lowerShard).countBooks(INT_MIN, targetID), upperRank = lowerRank + 1;
+        upperShard = lowerShard;
+        while (lowerShard >= 0 && lowerRank == 0 && --lowerShard >= 0)
+            lowerRank = library(lowerShard).bookCount();
+        for (int printed = 0; printed < cmd.args[1]; printed++) {
+            while (upperShard < n && upperRank > library(upperShard).bookCount()) {
+                upperShard++;
+                upperRank = 1;
+            }
+            BookNode *lower = lowerShard >= 0 ? library(lowerShard).selectBook(lowerRank) : NULL;
+            BookNode *upper = upperShard < n ? library(upperShard).selectBook(upperRank) : NULL;
+            if (lower == NULL && upper == NULL)
+                break;
+            long long lowerDistance = lower == NULL ? LLONG_MAX : (long long)targetID - lower->BookId;
+            long long upperDistance = upper == NULL ? LLONG_MAX : (long long)upper->BookId - targetID;
+            if (lowerDistance <= upperDistance) {
+                printBookInfo(lower, outputFile);
+                while (lowerShard >= 0 && --lowerRank == 0 && --lowerShard >= 0)
+                    lowerRank = library(lowerShard).bookCount() + 1;
+            } else {
+                printBookInfo(upper, outputFile);
+                upperRank++;
+            }
+        }
+        outputFile << "\n";
+        break;
+    }
+    case CMD_PRINT_PATRON:
+    case CMD_RETURN_ALL: {
+        vector<int> borrowed, reserved, shardBorrowed, shardReserved;
+        vector<bool> holds(n, false);
+        for (int s = 0; s < n; s++) {
+            library(s).patronBooks(cmd.args[0], shardBorrowed, shardReserved);
+            holds[s] = !shardBorrowed.empty();
+            borrowed.insert(borrowed.end(), shardBorrowed.begin(), shardBorrowed.end());
+            reserved.insert(reserved.end(), shardReserved.begin(), shardReserved.end());
+        }
+        if (cmd.type == CMD_PRINT_PATRON) {
+            printPatronBooks(cmd.args[0], borrowed, reserved, outputFile);
+        } else if (borrowed.empty()) {
+            outputFile << "Patron " << cmd.args[0] << " has no borrowed books" << "\n\n";
+        } else {
+            for (int s = 0; s < n; s++) {
+                if (holds[s])
+                    library(s).returnAll(cmd.args[0], outputFile);
+            }
+        }
+        break;
+    }
+    case CMD_SEARCH_TITLE:
+    case CMD_SEARCH_AUTHOR: {
+        bool byTitle = cmd.type == CMD_SEARCH_TITLE;
+        StringRef prefix = byTitle ? cmd.title : cmd.author;
+        vector<BookNode*> matches;
+        for (int s = 0; s < n; s++) {
+            if (byTitle)
+                library(s).matchTitles(prefix, matches);
+            else
+                library(s).matchAuthors(prefix, matches);
+        }
+        // Every shard's matches are already in (text, ID) order; the shards are interleaved by text
+        stable_sort(matches.begin(), matches.end(), [byTitle](const BookNode *a, const BookNode *b) {
+            int c = byTitle ? compareText(searchText(a->BookName), searchText(b->BookName))
+                            : compareText(searchText(*a->AuthorName), searchText(*b->AuthorName));
+            return c != 0 ? c < 0 : a->BookId < b->BookId;
+        });
+        for (size_t i = 0; i < matches.size(); i++)
+            printBookInfo(matches[i], outputFile);
+        if (matches.empty() && byTitle)
+            outputFile << "No book title starts with \"" << prefix << "\"" << "\n\n";
+        else if (matches.empty())
+            outputFile << "No author name starts with \"" << prefix << "\"" << "\n\n";
+        break;
+    }
+    case CMD_ALLOCATOR_STATS: {
+        AllocatorStats total;
+        for (int s = 0; s < n; s++)
+            total += library(s).allocatorStats();
+        printAllocatorStats(total, outputFile);
+        outputFile << "\n";
+        break;
+    }
+    case CMD_SAVE_SNAPSHOT:
+    case CMD_LOAD_SNAPSHOT: {
+        finishShards();
+        string error;
+        string path = cmd.path.str();
+        if (cmd.type == CMD_SAVE_SNAPSHOT) {
+            vector<Library*> parts;
+            for (int s = 0; s < n; s++)
+                parts.push_back(&library(s));
+            if (Library::saveSnapshot(parts, path, error))
+                outputFile << "Library saved to snapshot " << path << "\n";
+            else
+                outputFile << "Snapshot " << path << " could not be saved: " << error << "\n";
+        } else if (library(0).loadSnapshot(path, error)) {
+            // Everything is loaded into the first shard, then spread evenly by count
+            for (int s = 1; s < n; s++)
+                library(s).removeAll();
+            vector<int> bounds(1, INT_MIN);
+            int books = library(0).bookCount();
+            for (int s = 1; s < n; s++) {
+                int bound = books == 0 ? bounds.back() + 1 : library(0).selectBook((long long)books * s / n + 1)->BookId;
+                bounds.push_back(max(bound, bounds.back() + 1));
+            }
+            repartition(bounds);
+            outputFile << "Library loaded from snapshot " << path << "\n";
+        } else {
+            outputFile << "Snapshot " << path << " could not be loaded: " << error << "\n";
+        }
+        outputFile << "\n";
+        break;
+    }
+    case CMD_STATS: {
+        // A command that ran on several shards is counted once by each of them
+        LibraryStats stats;
+        for (int s = 0; s < n; s++)
+            library(s).collectStats(stats);
+        printStats(stats, compareText(cmd.path, StringRef("json", 4)) == 0, outputFile);
+        outputFile << "\n";
+        break;
+    }
+    case CMD_FREEZE: {
+        long long books = 0;
+        bool frozen = true;
+        for (int s = 0; s < n; s++) {
+            frozen = library(s).freeze() && frozen;
+            books += library(s).bookCount();
+        }
+        if (frozen)
+            outputFile << "Library frozen: " << books << " books" << "\n\n";
+        else
+            outputFile << "Library not frozen: some book IDs are held by more than one book" << "\n\n";
+        break;
+    }
+    case CMD_CHECKPOINT:
+        outputFile << "Checkpoint failed: no write-ahead log is open" << "\n\n";
+        break;
+    case CMD_QUIT:
+        finishShards();
+        outputFile << "Program Terminated!!";
+        return false;
+    default:
+        break;
+    }
+    return true;
+}
+
+// Moving books so that shard s holds the IDs from newBounds[s] up to the next bound.
+void ShardedLibrary::repartition(const vector<int> &newBounds) {
+    vector<BookTransfer> moving;
+    int n = shards.size();
+    // Moving books does not change the library as a whole, so frozen shards are frozen again afterwards
+    vector<bool> frozen(n);
+    for (int s = 0; s < n; s++)
+        frozen[s] = library(s).frozenIndex();
+    for (int s = 0; s < n; s++) {
+        int upper = s + 1 < n ? newBounds[s + 1] - 1 : INT_MAX;
+        if (newBounds[s] > INT_MIN)
+            library(s).extractBooks(INT_MIN, newBounds[s] - 1, moving);
+        if (upper < INT_MAX)
+            library(s).extractBooks(upper + 1, INT_MAX, moving);
+    }
+    lowerBounds = newBounds;
+    sort(moving.begin(), moving.end(), compareTransfers);
+    size_t next = 0;
+    for (int s = 0; s < n; s++) {
+        vector<BookTransfer> adopted;
+        while (next < moving.size() && moving[next].book.BookId <= upperBoundOf(s))
+            adopted.push_back(std::move(moving[next++]));
+        library(s).adoptBooks(adopted);
+        if (frozen[s] && !library(s).frozenIndex())
+            library(s).freeze();
+    }
+}
+
+// Moving shard boundaries when the last window of routed commands left one shard hot. The recent keys of
+// every shard, each standing for an equal part of that shard's load, approximate where the load lies; new
+// boundaries cut it into equal parts. Nothing moves unless that clearly lowers the hottest shard's load,
+// which is not the case when most commands hit a handful of IDs.
+void ShardedLibrary::rebalance() {
+    int n = shards.size();
+    long long total = 0, hottest = 0;
+    vector<pair<int, double> > weighted;
+    for (int s = 0; s < n; s++) {
+        Shard &shard = *shards[s];
+        total += shard.load;
+        hottest = max(hottest, shard.load);
+        for (size_t i = 0; i < shard.samples.size(); i++)
+            weighted.push_back(make_pair(shard.samples[i], (double)shard.load / shard.samples.size()));
+        shard.load = 0;
+        shard.samples.clear();
+        shard.sampled = 0;
+    }
+    windowCommands = 0;
+    if (n < 2 || hottest * 2 <= total * 3 / n)
+        return;
+
+    sort(weighted.begin(), weighted.end());
+    vector<int> bounds(1, INT_MIN);
+    vector<double> loads(n, 0);
+    double seen = 0;
+    for (size_t i = 0; i < weighted.size(); i++) {
+        // A key starts the next shard once the ones before it carry that shard's share of the load
+        if ((int)bounds.size() < n && seen >= (double)total * bounds.size() / n && weighted[i].first > bounds.back() &&
+            (i == 0 || weighted[i].first != weighted[i - 1].first))
+            bounds.push_back(weighted[i].first);
+        loads[bounds.size() - 1] += weighted[i].second;
+        seen += weighted[i].second;
+    }
+    while ((int)bounds.size() < n)
+        bounds.push_back(bounds.back() == INT_MAX ? INT_MAX : bounds.back() + 1);
+    double estimate = *max_element(loads.begin(), loads.end());
+    if (estimate > hottest * 0.8 || !is_sorted(bounds.begin(), bounds.end()) ||
+        adjacent_find(bounds.begin(), bounds.end()) != bounds.end())
+        return;
+    repartition(bounds);
+}
+
+// Bounded queue between exactly one producing and one consuming thread, without locks. Each side owns
+// one index and only reads the other's, and keeps a cached copy of it so the shared cache line is only
+// read again when the queue looks full or empty. A blocked side spins briefly and then yields, so a
+// pipeline with more stages than cores still moves along.
+template <typename T, size_t CAPACITY>
+class SpscRing {
+private:
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "ring capacity must be a power of two");
+
+    static const int SPINS_BEFORE_YIELD = 64;
+
+    T slots[CAPACITY];
+    alignas(64) atomic<size_t> tail;   // next slot to fill; written by the producer
+    size_t cachedHead;                 // producer's last view of head
+    alignas(64) atomic<size_t> head;   // next slot to take; written by the consumer
+    size_t cachedTail;                 // consumer's last view of tail
+
+    SpscRing(const SpscRing &);
+    SpscRing &operator=(const SpscRing &);
+
+    static void backoff(int &spins) {
+        if (++spins >= SPINS_BEFORE_YIELD) {
+            this_thread::yield();
+            spins = 0;
+        }
+    }
+
+public:
+    SpscRing() : tail(0), cachedHead(0), head(0), cachedTail(0) {}
+
+    // Adding an item; false when the ring is full. Producer only.
+    bool tryPush(const T &item) {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position - cachedHead == CAPACITY) {
+            cachedHead = head.load(memory_order_acquire);
+            if (position - cachedHead == CAPACITY)
+                return false;
+        }
+        slots[position & (CAPACITY - 1)] = item;
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // Taking the oldest item; false when the ring is empty. Consumer only.
+    bool tryPop(T &item) {
+        size_t position = head.load(memory_order_relaxed);
+        if (position == cachedTail) {
+            cachedTail = tail.load(memory_order_acquire);
+            if (position == cachedTail)
+                return false;
+        }
+        item = slots[position & (CAPACITY - 1)];
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // Waiting until the item fits.
+    void push(const T &item) {
+        for (int spins = 0; !tryPush(item);)
+            backoff(spins);
+    }
+
+    // Waiting until an item arrives.
+    T pop() {
+        T item;
+        for (int spins = 0; !tryPop(item);)
+            backoff(spins);
+        return item;
+    }
+};
+
+// Running an input file through three threads: a parser thread decodes lines into batches of Commands,
+// the calling thread applies them with an executor, and a writer thread writes the output to the file.
+// Batches and output chunks travel through SpscRings and come back empty through a second ring each,
+// so nothing is allocated once the pipeline is running. The executor renders its output into an in-memory
+// OutputBuffer as usual; that text is handed to the writer in chunks, so file writes never stall the tree.
+class CommandPipeline {
+public:
+    static const size_t BATCH_COMMANDS = 1024;   // commands decoded per batch
+    static const size_t CHUNK_BYTES = 1 << 16;   // output gathered before it is handed to the writer
+
+private:
+    static const size_t IN_FLIGHT = 8;           // batches and chunks owned by each pair of rings
+
+    struct CommandBatch {
+        vector<Command> commands;
+        bool last;   // nothing follows; the input ended or asked to quit
+    };
+
+    const InputFile &inputFile;
+    OutputBuffer &staged;       // the executor's output
+    OutputBuffer &outputFile;
+
+    CommandBatch batches[IN_FLIGHT];
+    OutputBuffer chunks[IN_FLIGHT];
+    SpscRing<CommandBatch*, IN_FLIGHT> parsed;       // parser -> executor
+    SpscRing<CommandBatch*, IN_FLIGHT> emptyBatches; // executor -> parser
+    SpscRing<OutputBuffer*, IN_FLIGHT> rendered;     // executor -> writer; NULL ends the stream
+    SpscRing<OutputBuffer*, IN_FLIGHT> emptyChunks;  // writer -> executor
+
+    CommandPipeline(const CommandPipeline &);
+    CommandPipeline &operator=(const CommandPipeline &);
+
+    void parseAll();
+    void writeAll();
+    void handOff();
+
+public:
+    // The executor must write to staged, which is switched to in-memory collection.
+    CommandPipeline(const InputFile &inputFile, OutputBuffer &staged, OutputBuffer &outputFile);
+
+    // Applying every command of the input, stopping at Quit, as runCommands does on one thread.
+    template <typename Executor>
+    void run(Executor &executor);
+};
+
+CommandPipeline::CommandPipeline(const InputFile &inputFile, OutputBuffer &staged, OutputBuffer &outputFile)
+    : inputFile(inputFile), staged(staged), outputFile(outputFile) {
+    staged.collectInMemory();
+    for (size_t i = 0; i < IN_FLIGHT; i++) {
+        batches[i].commands.reserve(BATCH_COMMANDS);
+        emptyBatches.push(&batches[i]);
+        chunks[i].collectInMemory();
+        emptyChunks.push(&chunks[i]);
+    }
+}
+
+// Parser thread: decoding lines until the input ends or a Quit is decoded, since nothing after it runs.
+void CommandPipeline::parseAll() {
+    CommandScanner scanner;
+    const char *line = inputFile.begin();
+    const char *end = inputFile.end();
+    bool last = false;
+    while (!last) {
+        CommandBatch *batch = emptyBatches.pop();
+        batch->commands.clear();
+        while (batch->commands.size() < BATCH_COMMANDS && line < end) {
+            const char *newline = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char *lineEnd = newline ? newline : end;
+            batch->commands.push_back(scanner.parse(line, lineEnd));
+            line = lineEnd + 1;
+            if (batch->commands.back().type == CMD_QUIT)
+                break;
+        }
+        last = line >= end || batch->commands.back().type == CMD_QUIT;
+        batch->last = last;
+        parsed.push(batch);
+    }
+}
+
+// Writer thread: writing chunks in order until the NULL that ends the stream.
+void CommandPipeline::writeAll() {
+    for (OutputBuffer *chunk; (chunk = rendered.pop()) != NULL;) {
+        outputFile.append(chunk->data(), chunk->size());
+        chunk->clear();
+        emptyChunks.push(chunk);
+    }
+}
+
+// Passing what the executor has written so far to the writer.
+void CommandPipeline::handOff() {
+    if (staged.size() == 0)
+        return;
+    OutputBuffer *chunk = emptyChunks.pop();
+    chunk->swapContents(staged);
+    rendered.push(chunk);
+}
+
+template <typename Executor>
+void CommandPipeline::run(Executor &executor) {
+    thread parser(&CommandPipeline::parseAll, this);
+    thread writer(&CommandPipeline::writeAll, this);
+    bool running = true, ended = false;
+    while (!ended) {
+        CommandBatch *batch = parsed.pop();
+        for (size_t i = 0; i < batch->commands.size() && running; i++) {
+            if (i % COMMAND_WINDOW == 0)
+                executor.prefetch(&batch->commands[i], min(COMMAND_WINDOW, batch->commands.size() - i));
+            running = executor.execute(batch->commands[i]);
+            if (staged.size() >= CHUNK_BYTES)
+                handOff();
+        }
+        // Once the executor stops, the rest of the input is drained so the parser can finish
+        ended = batch->last;
+        emptyBatches.push(batch);
+        handOff();
+    }
+    executor.finish();
+    handOff();
+    rendered.push(NULL);
+    parser.join();
+    writer.join();
+}
+
+// Binary snapshot of the library, format version 2 (version 1 stored a reservation time instead of the
+// reservation sequence number and is no longer read):
+//   SnapshotHeader
+//   SnapshotBook        x bookCount         books in increasing BookId order
+//   SnapshotReservation x reservationCount  each book's heap array in order, books one after another
+//   string table        stringBytes bytes   titles and author names, each distinct string stored once
+// Integers use the native (x86-64 little endian) layout. The checksum covers every byte after the header.
+// Because books are sorted and heaps are stored as arrays, loading rebuilds the tree and the reservation
+// heaps in linear time without sorting, heapifying or re-executing any command.
+static const char SNAPSHOT_MAGIC[8] = {'G', 'A', 'T', 'O', 'R', 'S', 'N', 'P'};
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t bookCount;
+    uint64_t reservationCount;
+    uint64_t stringBytes;
+    int64_t colorFlipCount;
+    uint64_t checksum;
+};
+
+struct SnapshotBook {
+    int32_t bookId;
+    int32_t borrowedBy;
+    uint64_t titleOffset;
+    uint64_t authorOffset;
+    uint32_t titleLength;
+    uint32_t authorLength;
+    uint32_t reservationCount;
+    uint8_t available;
+    uint8_t padding[3];
+};
+
+struct SnapshotReservation {
+    int32_t patronID;
+    int32_t priorityNumber;
+    uint32_t sequence;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56, "snapshot header layout");
+static_assert(sizeof(SnapshotBook) == 40, "snapshot book layout");
+static_assert(sizeof(SnapshotReservation) == 16, "snapshot reservation layout");
+
+// 64-bit FNV-1a variant that folds in eight bytes per step.
+static uint64_t snapshotChecksum(const char *data, size_t length, uint64_t hash = 14695981039346656037ULL) {
+    const uint64_t prime = 1099511628211ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * prime;
+    }
+    return hash;
+}
+
+// Function to write the library to a snapshot file. The file is written next to the target, synced and
+// renamed over it, so a crash never leaves a half written snapshot behind.
+bool Library::saveSnapshot(const string &path, string &error) {
+    return saveSnapshot(vector<Library*>(1, this), path, error);
+}
+
+bool Library::saveSnapshot(const vector<Library*> &parts, const string &path, string &error) {
+    vector<const BookNode*> nodes;
+    int colorFlipCount = 0;
+    for (size_t p = 0; p < parts.size(); p++) {
+        vector<NodeIndex> indexes;
+        parts[p]->tree.collectInOrder(indexes);
+        for (size_t i = 0; i < indexes.size(); i++)
+            nodes.push_back(&parts[p]->book(indexes[i]));
+        colorFlipCount += parts[p]->colorFlips();
+    }
+
+    vector<SnapshotBook> books(nodes.size());
+    vector<SnapshotReservation> reservations;
+    string strings;
+    unordered_map<string, uint64_t> interned;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const BookNode *book = nodes[i];
+        SnapshotBook &entry = books[i];
+        memset(&entry, 0, sizeof(entry));
+        entry.bookId = book->BookId;
+        entry.borrowedBy = book->BorrowedBy;
+        entry.available = book->AvailabilityStatus ? 1 : 0;
+        const string *fields[2] = {&book->BookName, book->AuthorName};
+        uint64_t offsets[2];
+        for (int f = 0; f < 2; f++) {
+            unordered_map<string, uint64_t>::iterator it = interned.find(*fields[f]);
+            if (it == interned.end()) {
+                it = interned.insert(make_pair(*fields[f], (uint64_t)strings.size())).first;
+                strings += *fields[f];
+            }
+            offsets[f] = it->second;
+        }
+        entry.titleOffset = offsets[0];
+        entry.titleLength = book->BookName.size();
+        entry.authorOffset = offsets[1];
+        entry.authorLength = book->AuthorName->size();
+        entry.reservationCount = book->reservationHeap.size();
+        for (int r = 0; r < book->reservationHeap.size(); r++) {
+            ReservationNode node = book->reservationHeap.entry(r);
+            SnapshotReservation reservation;
+            memset(&reservation, 0, sizeof(reservation));
+            reservation.patronID = node.patronID;
+            reservation.priorityNumber = node.priorityNumber;
+            reservation.sequence = node.sequence;
+            reservations.push_back(reservation);
+        }
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.bookCount = books.size();
+    header.reservationCount = reservations.size();
+    header.stringBytes = strings.size();
+    header.colorFlipCount = colorFlipCount;
+    uint64_t checksum = snapshotChecksum(books.empty() ? NULL : (const char*)&books[0], books.size() * sizeof(SnapshotBook));
+    checksum = snapshotChecksum(reservations.empty() ? NULL : (const char*)&reservations[0],
+                                reservations.size() * sizeof(SnapshotReservation), checksum);
+    header.checksum = snapshotChecksum(strings.data(), strings.size(), checksum);
+
+    string temporary = path + ".tmp";
+    OutputBuffer out;
+    if (!out.open(temporary)) {
+        error = "cannot create " + temporary;
+        return false;
+    }
+    out.append((const char*)&header, sizeof(header));
+    if (!books.empty())
+        out.append((const char*)&books[0], books.size() * sizeof(SnapshotBook));
+    if (!reservations.empty())
+        out.append((const char*)&reservations[0], reservations.size() * sizeof(SnapshotReservation));
+    out.append(strings.data(), strings.size());
+    out.sync();
+    out.close();
+    if (!out.good() || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+// Checking a mapped snapshot file: header, sizes, checksum and then every record, so a corrupt but
+// checksummed file cannot produce an invalid tree. Fills in header on success.
+static bool validSnapshot(const char *data, size_t length, SnapshotHeader &header, string &error) {
+    if (length < sizeof(header)) {
+        error = "file is too short";
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        error = "not a snapshot file";
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION || header.headerSize != sizeof(SnapshotHeader)) {
+        error = "unsupported snapshot version";
+        return false;
+    }
+    size_t payload = length - sizeof(header);
+    if (header.bookCount > payload / sizeof(SnapshotBook) ||
+        header.reservationCount > payload / sizeof(SnapshotReservation) ||
+        header.bookCount * sizeof(SnapshotBook) + header.reservationCount * sizeof(SnapshotReservation) +
+            header.stringBytes != payload) {
+        error = "truncated or oversized snapshot";
+        return false;
+    }
+    if (snapshotChecksum(data + sizeof(header), payload) != header.checksum) {
+        error = "checksum mismatch";
+        return false;
+    }
+    const char *bookData = data + sizeof(header);
+    uint64_t reservationTotal = 0;
+    for (uint64_t i = 0; i < header.bookCount; i++) {
+        SnapshotBook entry;
+        memcpy(&entry, bookData + i * sizeof(SnapshotBook), sizeof(entry));
+        SnapshotBook previous;
+        if (i > 0) {
+            memcpy(&previous, bookData + (i - 1) * sizeof(SnapshotBook), sizeof(previous));
         }
-        else if (oldNode == oldNode->parent->left)
-        {
-            oldNode->parent->left = newNode;
+        if ((i > 0 && previous.bookId > entry.bookId) ||
+            entry.titleOffset > header.stringBytes || entry.titleLength > header.stringBytes - entry.titleOffset ||
+            entry.authorOffset > header.stringBytes || entry.authorLength > header.stringBytes - entry.authorOffset ||
+            entry.reservationCount > (uint32_t)ReservationHeap::CAPACITY) {
+            error = "corrupt book record";
+            return false;
         }
-        else
-        {
-            oldNode->parent->right = newNode;
+        reservationTotal += entry.reservationCount;
+    }
+    if (reservationTotal != header.reservationCount) {
+        error = "corrupt reservation table";
+        return false;
+    }
+    return true;
+}
+
+bool Library::checkSnapshot(const string &path, string &error) {
+    InputFile file;
+    if (!file.open(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+    SnapshotHeader header;
+    return validSnapshot(file.begin(), file.end() - file.begin(), header, error);
+}
+
+// Function to replace the library with a snapshot. The file is mapped and fully validated before the
+// current tree is touched; records are then copied straight out of the mapping.
+bool Library::loadSnapshot(const string &path, string &error) {
+    InputFile file;
+    if (!file.open(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+    const char *data = file.begin();
+    SnapshotHeader header;
+    if (!validSnapshot(data, file.end() - file.begin(), header, error))
+        return false;
+    const char *bookData = data + sizeof(header);
+    const char *reservationData = bookData + header.bookCount * sizeof(SnapshotBook);
+    const char *strings = reservationData + header.reservationCount * sizeof(SnapshotReservation);
+
+    WriteSection section(*this);
+    clear();
+    vector<NodeIndex> nodes;
+    nodes.reserve(header.bookCount);
+    uint64_t nextReservation = 0;
+    // Authors are stored once in the string table, so their offset identifies them
+    unordered_map<uint64_t, AuthorTable::Entry> authorAt;
+    for (uint64_t i = 0; i < header.bookCount; i++) {
+        SnapshotBook entry;
+        memcpy(&entry, bookData + i * sizeof(SnapshotBook), sizeof(entry));
+        unordered_map<uint64_t, AuthorTable::Entry>::iterator author = authorAt.find(entry.authorOffset);
+        if (author == authorAt.end()) {
+            AuthorTable::Entry interned = authors.entry(string(strings + entry.authorOffset, entry.authorLength));
+            author = authorAt.insert(make_pair(entry.authorOffset, interned)).first;
+        }
+        NodeIndex index = tree.create(entry.bookId, entry.bookId,
+                                      string(strings + entry.titleOffset, entry.titleLength),
+                                      authors.addBook(author->second), entry.available != 0, entry.borrowedBy);
+        BookNode *book = &this->book(index);
+        if (entry.borrowedBy != -1)
+            patrons.addBorrowed(entry.borrowedBy, entry.bookId);
+        for (uint32_t r = 0; r < entry.reservationCount; r++) {
+            SnapshotReservation saved;
+            memcpy(&saved, reservationData + (nextReservation++) * sizeof(SnapshotReservation), sizeof(saved));
+            int handle = book->reservationHeap.restore(ReservationNode(saved.patronID, saved.priorityNumber, saved.sequence));
+            patrons.addReservation(saved.patronID, entry.bookId, handle);
         }
+        nodes.push_back(index);
+    }
+    tree.linkSorted(nodes, true);
+    noteRepeats(nodes);
+    titles.insertMany(nodes);
+    byAuthor.insertMany(nodes);
+    tree.restoreColorFlips(header.colorFlipCount);
+    return true;
+}
 
-        if (newNode)
-        {
-            newNode->parent = oldNode->parent;
+// Write-ahead log of the commands that change the library, kept in one directory together with the snapshot
+// it starts from. Generation G of the library is the snapshot file snapshot.G (absent for generation 0, the
+// empty library) followed by every command recorded in log.G. A checkpoint first creates log.G+1, then
+// writes snapshot.G+1; renaming that snapshot into place is what switches generations, and only then is
+// generation G removed. A crash at any point therefore leaves one complete generation, and recovery loads
+// the newest snapshot and replays its log.
+//
+// Records are appended to memory on the thread running the commands. When they reach the disk depends on
+// the sync policy:
+//   SYNC_ALWAYS  every record is written and fdatasync'ed before its command runs
+//   SYNC_GROUP   a flusher thread writes what is pending once groupOps records wait or the oldest has
+//                waited groupMicros, and covers the whole group with one fdatasync
+//   SYNC_NONE    the flusher thread writes on the same schedule but never syncs
+// Every record gets a log sequence number (LSN); durableLsn() is the last one the policy has made durable,
+// so a server can hold back replies until their command is safe.
+//
+// Log file format:
+//   LogHeader
+//   LogRecord + text    repeated; the checksum covers the record after the checksum field and its text
+// A record that is cut short or fails its checksum ends the log, unless valid records follow it: then the
+// log is damaged rather than torn, and recovery refuses it.
+static const char LOG_MAGIC[8] = {'G', 'A', 'T', 'O', 'R', 'W', 'A', 'L'};
+static const uint32_t LOG_VERSION = 1;
+
+struct LogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t generation;
+};
+
+struct LogRecord {
+    uint64_t checksum;
+    uint32_t length;         // bytes of the record including its text
+    uint32_t session;        // executor that ran the command
+    int32_t type;            // CommandType
+    int32_t args[3];
+    uint32_t textLength[2];  // title and author, or the snapshot path
+};
+
+static_assert(sizeof(LogHeader) == 24, "log header layout");
+static_assert(sizeof(LogRecord) == 40, "log record layout");
+
+class WriteAheadLog {
+public:
+    enum SyncPolicy {
+        SYNC_ALWAYS,
+        SYNC_GROUP,
+        SYNC_NONE
+    };
+
+private:
+    static const size_t CHECKPOINT_BYTES = 1 << 28;   // log growth that triggers an automatic checkpoint
+
+    Library &library;
+    string directory;
+    SyncPolicy policy;
+    size_t groupOps;
+    long long groupMicros;
+    uint64_t generation;
+    int fd;
+    size_t logBytes;              // size of log.G, counting records not written yet
+    size_t checkpointAt;          // logBytes at which checkpointDue() turns true
+    uint64_t appended;            // LSN of the last record
+    uint64_t recovered;           // records replayed when the log was opened
+    atomic<uint64_t> durable;
+    atomic<uint64_t> syncs;
+    map<uint32_t, string> openBulks;   // records of each session's bulk insert that is still collecting
+    string encoded;
+
+    // Shared with the flusher thread. lock guards the pending records; ioLock is held while writing to fd
+    // and is always taken after lock, so groups reach the file in order.
+    mutex lock;
+    mutex ioLock;
+    condition_variable wake;
+    string pending;
+    size_t pendingRecords;
+    uint64_t pendingLsn;
+    bool stopping;
+    atomic<bool> failed;          // a write or sync failed; nothing is appended from then on
+    thread flusher;
+    int notifyFd;                 // eventfd counting groups made durable
+
+    WriteAheadLog(const WriteAheadLog &);
+    WriteAheadLog &operator=(const WriteAheadLog &);
+
+    string fileName(const char *kind, uint64_t number) const {
+        return directory + "/" + kind + "." + to_string(number);
+    }
+
+    static bool writeFully(int fd, const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t n = write(fd, data, length);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            length -= n;
         }
+        return true;
     }
 
-// Compare the nodes to sort.
-bool static compare(RBNode *node1, RBNode *node2)
-{
-    return (node1->book->BookId <= node2->book->BookId);
-}
+    // Making renames and new files in the log directory durable.
+    bool syncDirectory() const {
+        int dirFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0)
+            return false;
+        bool synced = fsync(dirFd) == 0;
+        ::close(dirFd);
+        return synced;
+    }
+
+    // Writing every pending record to the file; the caller holds lock and ioLock.
+    bool writePending() {
+        bool written = writeFully(fd, pending.data(), pending.size());
+        pending.clear();
+        pendingRecords = 0;
+        return written;
+    }
+
+    // Whether a whole record with a matching checksum starts at offset; copies its header into entry.
+    static bool validRecord(const char *data, size_t length, size_t offset, LogRecord &entry) {
+        if (length - offset < sizeof(LogRecord))
+            return false;
+        memcpy(&entry, data + offset, sizeof(entry));
+        size_t textBytes = (size_t)entry.textLength[0] + entry.textLength[1];
+        return entry.length == sizeof(LogRecord) + textBytes && entry.length <= length - offset &&
+               logs((CommandType)entry.type) && snapshotChecksum(data + offset + 8, entry.length - 8) == entry.checksum;
+    }
+
+    void flusherLoop();
+    bool replay(const string &path, string &error);
+    int createLog(uint64_t number, string &error);
+    bool startGeneration(string &error);
 
 public:
-    RedBlackTree() : root(nullptr), colorFlipCount(0) {}
+    WriteAheadLog(Library &library, const string &directory, SyncPolicy policy, size_t groupOps,
+                  long long groupMicros)
+        : library(library), directory(directory), policy(policy), groupOps(max(groupOps, (size_t)1)),
+          groupMicros(groupMicros), generation(0), fd(-1), logBytes(0), checkpointAt(CHECKPOINT_BYTES),
+          appended(0), recovered(0), durable(0), syncs(0), pendingRecords(0), pendingLsn(0), stopping(false),
+          failed(false), notifyFd(-1) {}
 
-    // Public functions
+    ~WriteAheadLog() {
+        string error;
+        close(error);
+    }
 
-    //Searching for a book in the tree.
-    RBNode *search(int bookId)
-    {
-        RBNode *current = root;
-        while (current && current->book->BookId != bookId)
-        {
-            if (bookId < current->book->BookId)
-            {
-                current = current->left;
-            }
-            else
-            {
-                current = current->right;
-            }
+    // Parsing a --sync argument: always, none, group, group:N or group:N:T.
+    static bool parsePolicy(const string &text, SyncPolicy &policy, size_t &groupOps, long long &groupMicros) {
+        if (text == "always" || text == "none") {
+            policy = text == "always" ? SYNC_ALWAYS : SYNC_NONE;
+            return true;
         }
-        return current;
+        if (text.compare(0, 5, "group") != 0)
+            return false;
+        policy = SYNC_GROUP;
+        long long ops = (long long)groupOps, micros = groupMicros;
+        int consumed = 0;
+        if (text.size() > 5 && sscanf(text.c_str() + 5, ":%lld%n:%lld%n", &ops, &consumed, &micros, &consumed) < 1)
+            return false;
+        if ((size_t)(5 + consumed) != text.size() || ops < 1 || micros < 0)
+            return false;
+        groupOps = (size_t)ops;
+        groupMicros = micros;
+        return true;
     }
 
-    //Deleting a book in the tree.
-    void deleteBook(int bookID, ofstream &outputFile) {
-    if (root == NULL)
-         return;
-    RBNode *node = search(bookID);
-    if(node->book->reservationHeap.isEmpty()){
-                outputFile << "Book " << bookID << " is no longer available." <<endl;
-            }
-            else if(!node->book->reservationHeap.isEmpty()){
-                string s= node->book->reservationHeap.getHeapString();
-                outputFile << "Book " << bookID << " is no longer available. Reservations made by patrons " 
-                << s.substr(1,s.length()-2) << " have been cancelled!" << endl;
-            }
-    deleteNode(node);
-}
-    // Printing books within the 2 given bookID's.
-    void printBooks(int bookID1, int bookID2, ofstream &outputFile);
+    // Whether commands of this type are recorded.
+    static bool logs(CommandType type) {
+        switch (type) {
+        case CMD_INSERT_BOOK:
+        case CMD_BORROW_BOOK:
+        case CMD_RETURN_BOOK:
+        case CMD_DELETE_BOOK:
+        case CMD_CANCEL_RESERVATION:
+        case CMD_UPDATE_PRIORITY:
+        case CMD_RETURN_ALL:
+        case CMD_BULK_INSERT_BEGIN:
+        case CMD_BULK_INSERT_END:
+        case CMD_LOAD_SNAPSHOT:
+            return true;
+        default:
+            return false;
+        }
+    }
 
-    // Printing book with the given bookID.
-    void printBook(int bookID, ofstream &outputFile);
+    // Recovering the library from the directory, which is created if missing, and starting a new generation
+    // to log to. Returns false and sets error when the directory or its files cannot be used.
+    bool open(string &error);
 
-    // Inserting book into the tree.
-    void insertBook(int id, string name, string author, bool available, int borrowedBy);
+    // Recording a command of the given session. Returns its LSN. Once writeFailed(), nothing is recorded.
+    uint64_t append(uint32_t session, const Command &cmd);
 
-    // Allowing the patron to borrow the book or adding the patron to reservation heap.
-    void borrowBook(int patronID, int bookID, int patronPriority, ofstream &outputFile);
+    // Writing the library to a new snapshot and continuing in a new, nearly empty log. The records of bulk
+    // inserts still collecting are carried over.
+    bool checkpoint(string &error);
 
-    // Updating the book status by making the patron return the book so that it is available.
-    void returnBook(int patronID, int bookID, ofstream &outputFile);
+    bool checkpointDue() const { return logBytes >= checkpointAt; }
 
-    // Finding the closest books to the target ID in the tree.
-    void findClosestBook(int targetID, ofstream &outputFile);
+    // Writing and syncing everything pending and stopping the flusher. Returns false if any write failed.
+    bool close(string &error);
 
-    // This function will print the color flip count.
-    void countColorFlip(ofstream &outputFile);  
+    uint64_t lastLsn() const { return appended; }
+    uint64_t durableLsn() const { return durable.load(memory_order_acquire); }
+    uint64_t syncCount() const { return syncs.load(memory_order_relaxed); }
+    uint64_t recoveredRecords() const { return recovered; }
+
+    // Whether writing or syncing the log failed. The records appended since the last sync may then be lost,
+    // and later ones are not written at all.
+    bool writeFailed() const { return failed.load(memory_order_acquire); }
+
+    // Readable whenever durableLsn() has advanced under SYNC_GROUP, or writing the log failed; -1 under the
+    // other policies, where records are durable as soon as append returns.
+    int durabilityFd() const { return notifyFd; }
 };
 
-// Function to print information about a specific book
-void printBookInfo(BookNode* book, ofstream &outputFile) {
-    outputFile << "BookID = " << book->BookId << "\n"
-         << "Title = " << book->BookName << "\n"
-         << "Author = " << book->AuthorName << "\n"
-         << "Availability = " << (book->AvailabilityStatus ? "\"Yes\"" : "\"No\"") << "\n"
-         << "BorrowedBy = " << (book->BorrowedBy==-1 ?  "None" : to_string(book->BorrowedBy)) << "\n"
-         << "Reservations = " << book->reservationHeap.getHeapString() << "\n";
-         outputFile << "\n";
+bool WriteAheadLog::open(string &error) {
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        error = "cannot create " + directory + ": " + strerror(errno);
+        return false;
+    }
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) {
+        error = "cannot read " + directory + ": " + strerror(errno);
+        return false;
+    }
+    bool hasSnapshot = false;
+    while (struct dirent *entry = readdir(dir)) {
+        const char *name = entry->d_name;
+        if (strncmp(name, "snapshot.", 9) != 0 || name[9] < '0' || name[9] > '9')
+            continue;
+        char *end;
+        uint64_t number = strtoull(name + 9, &end, 10);
+        if (*end == '\0' && (!hasSnapshot || number > generation)) {
+            generation = number;
+            hasSnapshot = true;
+        }
+    }
+    closedir(dir);
+
+    if (hasSnapshot && !library.loadSnapshot(fileName("snapshot", generation), error))
+        return false;
+    if (!replay(fileName("log", generation), error))
+        return false;
+    if (!startGeneration(error))
+        return false;
+    if (policy != SYNC_ALWAYS) {
+        if (policy == SYNC_GROUP)
+            notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        flusher = thread(&WriteAheadLog::flusherLoop, this);
+    }
+    return true;
 }
 
-// Function to print information about all books with bookIDs in the range [bookID1, bookID2].
-void RedBlackTree::print(int bookID1, int bookID2, RBNode* node, ofstream &outputFile) {
-    if (node == nullptr) return;
+// Replaying the log of the current generation on top of the library. Each session gets its own executor, so
+// interleaved bulk inserts come apart again; one still collecting when the log ends is completed.
+bool WriteAheadLog::replay(const string &path, string &error) {
+    if (access(path.c_str(), F_OK) != 0)
+        return true;
+    InputFile file;
+    if (!file.open(path)) {
+        error = "cannot open " + path;
+        return false;
+    }
+    const char *data = file.begin();
+    size_t length = file.end() - file.begin();
+    LogHeader header;
+    if (length < sizeof(header)) {
+        error = path + " is too short";
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0 || header.version != LOG_VERSION ||
+        header.headerSize != sizeof(LogHeader) || header.generation != generation) {
+        error = path + " is not a log of generation " + to_string(generation);
+        return false;
+    }
 
-    if (node->book->BookId > bookID1) {
-        print(bookID1, bookID2, node->left, outputFile);
+    // A crash can only cut the log short, so a bad record with a good one anywhere after it means the file
+    // was damaged. Replaying around the damage would lose commands without a word, so recovery stops and
+    // the directory is left as it is.
+    size_t offset = sizeof(LogHeader), end = sizeof(LogHeader);
+    LogRecord entry;
+    while (validRecord(data, length, end, entry))
+        end += entry.length;
+    for (size_t later = end + 1; later + sizeof(LogRecord) <= length; later++) {
+        if (validRecord(data, length, later, entry)) {
+            error = path + " is damaged at byte " + to_string(end) + " with valid records after it";
+            return false;
+        }
     }
 
-    if (node->book->BookId >= bookID1 && node->book->BookId <= bookID2) {
-        printBookInfo(node->book, outputFile);
+    OutputBuffer discarded;
+    map<uint32_t, CommandExecutor*> sessions;
+    while (offset < end) {
+        memcpy(&entry, data + offset, sizeof(entry));
+        Command cmd;
+        cmd.type = (CommandType)entry.type;
+        memcpy(cmd.args, entry.args, sizeof(entry.args));
+        const char *text = data + offset + sizeof(LogRecord);
+        if (cmd.type == CMD_LOAD_SNAPSHOT) {
+            cmd.path = StringRef(text, entry.textLength[0]);
+        } else {
+            cmd.title = StringRef(text, entry.textLength[0]);
+            cmd.author = StringRef(text + entry.textLength[0], entry.textLength[1]);
+        }
+        CommandExecutor *&executor = sessions[entry.session];
+        if (executor == NULL)
+            executor = new CommandExecutor(library, discarded);
+        executor->execute(cmd);
+        discarded.flush();
+        offset += entry.length;
+        recovered++;
+    }
+    for (map<uint32_t, CommandExecutor*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        it->second->finish();
+        delete it->second;
     }
+    return true;
+}
 
-    if (node->book->BookId < bookID2) {
-        print(bookID1, bookID2, node->right, outputFile);
+// Creating log.number holding the header and the records of open bulk inserts, synced to disk.
+int WriteAheadLog::createLog(uint64_t number, string &error) {
+    string path = fileName("log", number);
+    int newFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (newFd < 0) {
+        error = "cannot create " + path + ": " + strerror(errno);
+        return -1;
+    }
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header.version = LOG_VERSION;
+    header.headerSize = sizeof(LogHeader);
+    header.generation = number;
+    bool written = writeFully(newFd, (const char*)&header, sizeof(header));
+    logBytes = sizeof(header);
+    for (map<uint32_t, string>::iterator it = openBulks.begin(); written && it != openBulks.end(); ++it) {
+        written = writeFully(newFd, it->second.data(), it->second.size());
+        logBytes += it->second.size();
     }
+    if (!written || fdatasync(newFd) != 0) {
+        error = "cannot write " + path + ": " + strerror(errno);
+        ::close(newFd);
+        unlink(path.c_str());
+        return -1;
+    }
+    return newFd;
 }
 
-// Public function to print information about all books with bookIDs in the range [bookID1, bookID2].
-void RedBlackTree::printBooks(int bookID1, int bookID2, ofstream &outputFile) {
-    print(bookID1, bookID2, root, outputFile);
+// Moving from generation G to G+1: log.G+1 is created, then snapshot.G+1 renamed into place and checked to
+// load, then the files of G and anything older are removed. The caller has written every pending record of log.G.
+bool WriteAheadLog::startGeneration(string &error) {
+    uint64_t next = generation + 1;
+    size_t oldBytes = logBytes;
+    string snapshot = fileName("snapshot", next);
+    int newFd = createLog(next, error);
+    if (newFd >= 0 && !library.saveSnapshot(snapshot, error)) {
+        ::close(newFd);
+        unlink(fileName("log", next).c_str());
+        newFd = -1;
+    } else if (newFd >= 0 && !Library::checkSnapshot(snapshot, error)) {
+        // Recovery would stop at a snapshot it cannot load, so it goes before G is given up
+        error = snapshot + " does not load back: " + error;
+        ::close(newFd);
+        unlink(snapshot.c_str());
+        unlink(fileName("log", next).c_str());
+        syncDirectory();
+        newFd = -1;
+    } else if (newFd >= 0 && !syncDirectory()) {
+        // The rename may or may not survive a crash; generation G stays authoritative either way
+        error = "cannot sync " + directory + ": " + strerror(errno);
+        ::close(newFd);
+        unlink(snapshot.c_str());
+        unlink(fileName("log", next).c_str());
+        syncDirectory();
+        newFd = -1;
+    }
+    if (newFd < 0) {
+        logBytes = oldBytes;
+        checkpointAt = logBytes + CHECKPOINT_BYTES;
+        return false;
+    }
+    if (fd >= 0)
+        ::close(fd);
+    fd = newFd;
+    for (uint64_t old = 0; old <= generation; old++) {
+        unlink(fileName("snapshot", old).c_str());
+        unlink(fileName("log", old).c_str());
+    }
+    generation = next;
+    checkpointAt = logBytes + CHECKPOINT_BYTES;
+    return true;
 }
 
-// Function to print information about a specific book identified by its unique bookID
-void RedBlackTree::printInfo(int bookID, RBNode* node, ofstream &outputFile) {
-    if (node == nullptr) {
-        outputFile << "Book " << bookID << " not found in the Library" << endl;
-        return;
+uint64_t WriteAheadLog::append(uint32_t session, const Command &cmd) {
+    // Any command but InsertBook has the executor insert the books it collected, which from then on are
+    // in the library a checkpoint saves, so only the BulkInsertBegin record is left to carry over
+    if (failed)
+        return appended;
+    map<uint32_t, string>::iterator bulk = openBulks.find(session);
+    if (bulk != openBulks.end() && cmd.type != CMD_INSERT_BOOK)
+        bulk->second.resize(sizeof(LogRecord));
+    if (!logs(cmd.type))
+        return appended;
+    StringRef text[2] = {cmd.title, cmd.author};
+    if (cmd.type == CMD_LOAD_SNAPSHOT) {
+        text[0] = cmd.path;
+        text[1] = StringRef(cmd.path.data, 0);
+    } else if (cmd.type != CMD_INSERT_BOOK) {
+        text[0] = text[1] = StringRef("", 0);
     }
+    LogRecord entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.length = sizeof(LogRecord) + text[0].length + text[1].length;
+    entry.session = session;
+    entry.type = cmd.type;
+    memcpy(entry.args, cmd.args, sizeof(entry.args));
+    entry.textLength[0] = text[0].length;
+    entry.textLength[1] = text[1].length;
+    encoded.assign((const char*)&entry, sizeof(entry));
+    encoded.append(text[0].data, text[0].length);
+    encoded.append(text[1].data, text[1].length);
+    entry.checksum = snapshotChecksum(encoded.data() + 8, encoded.size() - 8);
+    memcpy(&encoded[0], &entry.checksum, sizeof(entry.checksum));
 
-    if (node->book->BookId == bookID) {
-        printBookInfo(node->book, outputFile);
-    } else if (node->book->BookId > bookID) {
-        printInfo(bookID, node->left, outputFile);
-    } else {
-        printInfo(bookID, node->right, outputFile);
+    if (cmd.type == CMD_BULK_INSERT_BEGIN) {
+        if (bulk == openBulks.end())
+            openBulks[session] = encoded;
+    } else if (cmd.type == CMD_BULK_INSERT_END) {
+        if (bulk != openBulks.end())
+            openBulks.erase(bulk);
+    } else if (cmd.type == CMD_INSERT_BOOK && bulk != openBulks.end()) {
+        bulk->second += encoded;
     }
-}
+    logBytes += encoded.size();
+    uint64_t lsn = ++appended;
 
-// Public function to print information about a specific book identified by its unique bookID
-void RedBlackTree::printBook(int bookID, ofstream &outputFile) {
-    printInfo(bookID, root, outputFile);
-}
-
-// Function to add a new book to the library
-void RedBlackTree::insertBook(int id, string name, string author, bool available, int borrowedBy) {
-    BookNode* newBook = new BookNode(id, name, author, available, borrowedBy);
-    RBNode* newNode = new RBNode(newBook);
-    RBNode* parent = nullptr;
-    RBNode* temp = root;
-    while (temp != nullptr) {
-        parent = temp;
-        if (id < temp->book->BookId)
-            temp = temp->left;
+    if (policy == SYNC_ALWAYS) {
+        if (!writeFully(fd, encoded.data(), encoded.size()) || fdatasync(fd) != 0)
+            failed = true;
         else
-            temp = temp->right;
+            durable.store(lsn, memory_order_release);
+        syncs.fetch_add(1, memory_order_relaxed);
+        return lsn;
     }
-
-    newNode->parent = parent;
-    if (parent == nullptr)
-        root = newNode;
-    else if (id < parent->book->BookId)
-        parent->left = newNode;
-    else
-        parent->right = newNode;
-    fixInsert(newNode);
+    lock_guard<mutex> guard(lock);
+    pending += encoded;
+    pendingLsn = lsn;
+    if (++pendingRecords == 1 || pendingRecords == groupOps)
+        wake.notify_one();
+    if (policy == SYNC_NONE)
+        durable.store(lsn, memory_order_release);
+    return lsn;
 }
 
-// Function to allow a patron to borrow a book
-void RedBlackTree::borrowBook(int patronID, int bookID, int patronPriority, ofstream &outputFile) {
-    // Find the book
-    RBNode* node = root;
-    while (node != nullptr) {
-        if (bookID == node->book->BookId) {
-            if (node->book->AvailabilityStatus) {
-                // Book is available, update book status
-                node->book->AvailabilityStatus = false;
-                node->book->BorrowedBy = patronID;
-                outputFile << "Book "<<bookID<<" Borrowed by Patron "<<patronID << "\n";
-            } else {
-                // Book is not available, add reservation to the heap
-                node->book->reservationHeap.insertReservation(patronID, patronPriority);
-                outputFile << "Book "<<bookID<<" Reserved by Patron "<<patronID << "\n";
-            }
+// Writing pending records in groups: the first record of a group starts the groupMicros wait, which ends
+// early once groupOps records are pending.
+void WriteAheadLog::flusherLoop() {
+    // Signals are left to the thread that started the log, e.g. for LibraryServer's signalfd
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    string writing;
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this]() { return stopping || pendingRecords > 0; });
+        if (pendingRecords == 0)
             return;
-        } else if (bookID < node->book->BookId)
-            node = node->left;
+        wake.wait_for(guard, chrono::microseconds(groupMicros),
+                      [this]() { return stopping || pendingRecords >= groupOps; });
+        if (pendingRecords == 0)
+            continue;   // a checkpoint wrote them
+        unique_lock<mutex> io(ioLock);
+        writing.swap(pending);
+        pendingRecords = 0;
+        uint64_t lsn = pendingLsn;
+        guard.unlock();
+        bool written = writeFully(fd, writing.data(), writing.size());
+        if (policy == SYNC_GROUP) {
+            written = written && fdatasync(fd) == 0;
+            syncs.fetch_add(1, memory_order_relaxed);
+        }
+        writing.clear();
+        if (written)
+            durable.store(lsn, memory_order_release);
         else
-            node = node->right;
+            failed = true;
+        if (notifyFd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(notifyFd, &one, sizeof(one));
+            (void)ignored;
+        }
+        io.unlock();
+        guard.lock();
     }
+}
 
+bool WriteAheadLog::checkpoint(string &error) {
+    lock_guard<mutex> guard(lock);
+    lock_guard<mutex> io(ioLock);
+    if (failed || !writePending() || fdatasync(fd) != 0) {
+        failed = true;
+        error = "cannot write " + fileName("log", generation);
+        return false;
+    }
+    syncs.fetch_add(1, memory_order_relaxed);
+    durable.store(appended, memory_order_release);
+    return startGeneration(error);
 }
 
-// Function to allow a patron to return a book
-void RedBlackTree::returnBook(int patronID, int bookID, ofstream &outputFile) {
-    
-    RBNode* node = root;
-    while (node != nullptr) {
-        if (bookID == node->book->BookId) {
-            // Update book status
-            node->book->AvailabilityStatus = true;
-            node->book->BorrowedBy = -1;
-            outputFile << "Book "<<bookID<<" Returned by Patron "<<patronID<< "\n";
-            outputFile <<"\n";
-
-            // If there are reservations, assign the book to the patron with highest priority
-            if (!node->book->reservationHeap.isEmpty()) {
-                ReservationNode reservation = node->book->reservationHeap.extractMin();
-                node->book->AvailabilityStatus = false;
-                node->book->BorrowedBy = reservation.patronID;
-                outputFile << "Book "<<bookID<<" Allotted to Patron "<< reservation.patronID<< "\n";
-                outputFile <<"\n";
+bool WriteAheadLog::close(string &error) {
+    if (fd < 0)
+        return true;
+    if (flusher.joinable()) {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+    }
+    if (!writePending() || fdatasync(fd) != 0)
+        failed = true;
+    ::close(fd);
+    fd = -1;
+    if (notifyFd >= 0) {
+        ::close(notifyFd);
+        notifyFd = -1;
+    }
+    if (failed)
+        error = "writing " + fileName("log", generation) + " failed";
+    return !failed;
+}
+
+bool CommandExecutor::record(const Command &cmd) {
+    log->append(session, cmd);
+    return !WriteAheadLog::logs(cmd.type) || !log->writeFailed();
+}
+
+bool CommandExecutor::checkpoint(string &error) {
+    if (log == NULL) {
+        error = "no write-ahead log is open";
+        return false;
+    }
+    return log->checkpoint(error);
+}
+
+void CommandExecutor::checkpointIfDue() {
+    string error;
+    if (log->checkpointDue() && !log->checkpoint(error))
+        outputFile << "Checkpoint failed: " << error << "\n\n";
+}
+
+// Serving the library from a long-running process over a Unix domain socket, in the command grammar of
+// input files. One thread runs an epoll loop over the listening socket and every connection. Clients may
+// pipeline: every complete line received is executed in arrival order and its output is followed by a NUL
+// byte, which ends that command's response. Each connection has its own CommandExecutor, so the bulk insert
+// of one client is not mixed with the commands of another, and its own response buffer, which is written
+// as the socket accepts it. A connection with too much unsent output is not read from until it drains.
+// Quit closes the connection that sent it; SIGINT or SIGTERM stops the server. With a write-ahead log each
+// connection logs as its own session, and a response to a command that changed the library is held back,
+// together with everything after it, until the log reports that command durable. If writing the log fails,
+// the server stops without sending them.
+class LibraryServer {
+private:
+    static const size_t READ_CHUNK = 1 << 16;       // bytes read from a socket at once
+    static const size_t MAX_LINE = 1 << 20;         // longer lines close the connection
+    static const size_t MAX_UNSENT = 1 << 20;       // unsent output above which reading pauses
+    static const int MAX_EVENTS = 256;
+
+    struct Connection {
+        int fd;
+        vector<char> input;
+        size_t received;       // bytes of input holding data
+        OutputBuffer output;
+        size_t sent;           // bytes of output already written to the socket
+        CommandExecutor executor;
+        bool inputEnded;       // the client shut down its side; every line left is complete
+        bool ending;           // Quit or the last line executed; close once the output is sent
+        uint32_t events;       // epoll interest
+        deque<pair<size_t, uint64_t> > unacknowledged;   // output offset and LSN of responses awaiting the log
+
+        Connection(int fd, Library &library)
+            : fd(fd), received(0), sent(0), executor(library, output), inputEnded(false), ending(false), events(0) {
+            output.collectInMemory();
+        }
+    };
+
+    Library &library;
+    WriteAheadLog *log;
+    uint32_t sessions;
+    int epollFd;
+    int listenFd;
+    int signalFd;
+    string socketPath;
+    vector<Connection*> connections;   // indexed by file descriptor
+    CommandScanner scanner;
+
+    LibraryServer(const LibraryServer &);
+    LibraryServer &operator=(const LibraryServer &);
+
+    void acceptClients();
+    void receive(Connection &c);
+    void executeLines(Connection &c);
+    void holdForLog(Connection &c, size_t start, uint64_t previousLsn);
+    size_t releasable(Connection &c);
+    bool send(Connection &c);
+    void update(Connection &c);
+    void closeConnection(Connection &c);
+
+public:
+    explicit LibraryServer(Library &library, WriteAheadLog *log = NULL)
+        : library(library), log(log), sessions(0), epollFd(-1), listenFd(-1), signalFd(-1) {}
+    ~LibraryServer();
+
+    // Listening on a Unix domain socket at path, replacing a stale socket file. Fails, setting error, when
+    // path is not a socket or another server is still listening on it.
+    bool listen(const string &path, string &error);
+
+    // Serving clients until SIGINT or SIGTERM. Returns false and sets error when the event loop fails.
+    bool run(string &error);
+};
+
+LibraryServer::~LibraryServer() {
+    for (size_t fd = 0; fd < connections.size(); fd++) {
+        if (connections[fd] != NULL)
+            closeConnection(*connections[fd]);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+    if (signalFd >= 0)
+        close(signalFd);
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+// Removing the socket file at path left behind by a server that is gone. Anything that is not a socket is
+// left alone, and so is a socket that still accepts connections.
+static bool removeStaleSocket(const string &path, const struct sockaddr_un &address, string &error) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+        return true;
+    if (!S_ISSOCK(st.st_mode)) {
+        error = path + " exists and is not a socket";
+        return false;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    bool stale = connect(probe, (const struct sockaddr*)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+    close(probe);
+    if (!stale) {
+        error = "a server is already listening on " + path;
+        return false;
+    }
+    if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+        error = strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool LibraryServer::listen(const string &path, string &error) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        error = "socket path must have 1 to " + to_string(sizeof(address.sun_path) - 1) + " characters";
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    // SIGINT and SIGTERM are taken from a signalfd in the event loop instead of interrupting it
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stopSignals, NULL);
+    signalFd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (signalFd < 0 || epollFd < 0 || listenFd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    if (!removeStaleSocket(path, address, error))
+        return false;
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+        error = strerror(errno);
+        return false;
+    }
+    socketPath = path;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.fd = signalFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event);
+    if (log != NULL && log->durabilityFd() >= 0) {
+        event.data.fd = log->durabilityFd();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, event.data.fd, &event);
+    }
+    return true;
+}
+
+bool LibraryServer::run(string &error) {
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            error = strerror(errno);
+            return false;
+        }
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == signalFd)
+                return true;
+            if (fd == listenFd) {
+                acceptClients();
+                continue;
             }
+            if (log != NULL && fd == log->durabilityFd()) {
+                // A group of log records became durable: release the responses waiting for it. A failed
+                // log is handled once the other events are
+                uint64_t groups;
+                if (read(fd, &groups, sizeof(groups)) < 0 && errno != EAGAIN)
+                    continue;
+                for (size_t waiting = 0; waiting < connections.size(); waiting++) {
+                    if (connections[waiting] != NULL && !connections[waiting]->unacknowledged.empty())
+                        update(*connections[waiting]);
+                }
+                continue;
+            }
+            Connection *c = (size_t)fd < connections.size() ? connections[fd] : NULL;
+            if (c == NULL)
+                continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                closeConnection(*c);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                receive(*c);
+            if (connections[fd] == c && (events[i].events & EPOLLOUT))
+                update(*c);
+        }
+        // The library now holds changes the log may never have, so the responses still waiting for it are
+        // dropped with their connections
+        if (log != NULL && log->writeFailed()) {
+            error = "the write-ahead log cannot be written";
+            return false;
+        }
+    }
+}
+
+void LibraryServer::acceptClients() {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
             return;
-        } else if (bookID < node->book->BookId)
-            node = node->left;
-        else
-            node = node->right;
+        if ((size_t)fd >= connections.size())
+            connections.resize(fd + 1, NULL);
+        Connection *c = new Connection(fd, library);
+        if (log != NULL)
+            c->executor.logTo(log, ++sessions);
+        connections[fd] = c;
+        struct epoll_event event;
+        event.events = c->events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
     }
 }
 
-// Function to allow a patron to find the closest books to the targetID.
-void RedBlackTree::find(int targetID, RBNode* node, ofstream &outputFile, int minans) {
-   RBNode* temp=node;
-   vector<RBNode*>ans;
-    while(temp){
-        if (abs(temp->book->BookId - targetID) < minans) {
-            minans = abs(temp->book->BookId - targetID);
-        } 
-        if (temp->book->BookId < targetID) {
-            temp = temp->right;
-        } else {
-            temp = temp->left;
+// Reading what the socket holds and executing every complete line, until the output backs up.
+void LibraryServer::receive(Connection &c) {
+    while (!c.ending && c.output.size() - c.sent < MAX_UNSENT) {
+        if (c.input.size() - c.received < READ_CHUNK)
+            c.input.resize(c.received + READ_CHUNK);
+        ssize_t n = read(c.fd, &c.input[c.received], c.input.size() - c.received);
+        if (n > 0) {
+            c.received += n;
+            executeLines(c);
+            if (c.received > MAX_LINE && c.output.size() - c.sent < MAX_UNSENT) {
+                closeConnection(c);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0) {
+            closeConnection(c);
+            return;
         }
+        // End of input: a last line without a newline is still a command, as in an input file
+        if (c.received > 0 && c.input[c.received - 1] != '\n')
+            c.input[c.received++] = '\n';
+        c.inputEnded = true;
+        executeLines(c);
+        break;
     }
-    while(node){
-         if (abs(node->book->BookId - targetID) == minans) {
-            ans.push_back(node);
+    update(c);
+}
+
+// Executing the complete lines received, in order, while the unsent output stays below MAX_UNSENT.
+void LibraryServer::executeLines(Connection &c) {
+    const char *begin = c.received > 0 ? &c.input[0] : NULL;
+    const char *line = begin;
+    const char *end = begin + c.received;
+    while (!c.ending && line < end && c.output.size() - c.sent < MAX_UNSENT) {
+        const char *newline = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (newline == NULL)
+            break;
+        size_t start = c.output.size();
+        uint64_t lsn = log != NULL ? log->lastLsn() : 0;
+        if (!c.executor.execute(scanner.parse(line, newline))) {
+            c.ending = true;
+            c.executor.finish();
         }
-        if (node->book->BookId > targetID) {
-            node = node->left;
-        } else {
-            node = node->right;
+        holdForLog(c, start, lsn);
+        c.output << '\0';
+        line = newline + 1;
+    }
+    c.received = c.ending ? 0 : end - line;
+    if (c.received > 0 && line != begin)
+        memmove(&c.input[0], line, c.received);
+    if (!c.ending && c.inputEnded && c.received == 0) {
+        // A bulk insert left open is completed; what it prints is one more response
+        size_t before = c.output.size();
+        uint64_t lsn = log != NULL ? log->lastLsn() : 0;
+        c.ending = true;
+        c.executor.finish();
+        holdForLog(c, before, lsn);
+        if (c.output.size() != before)
+            c.output << '\0';
+    }
+}
+
+// Holding back the output from start on if the command just run logged records that are not durable yet.
+void LibraryServer::holdForLog(Connection &c, size_t start, uint64_t previousLsn) {
+    if (log != NULL && log->lastLsn() != previousLsn && log->durableLsn() < log->lastLsn())
+        c.unacknowledged.push_back(make_pair(start, log->lastLsn()));
+}
+
+// End of the output that may be sent: everything before the first response still waiting for the log.
+size_t LibraryServer::releasable(Connection &c) {
+    uint64_t durable = log != NULL ? log->durableLsn() : 0;
+    while (!c.unacknowledged.empty() && c.unacknowledged.front().second <= durable)
+        c.unacknowledged.pop_front();
+    return c.unacknowledged.empty() ? c.output.size() : c.unacknowledged.front().first;
+}
+
+// Writing as much pending output as the socket takes. Returns false when the connection failed.
+bool LibraryServer::send(Connection &c) {
+    size_t limit = releasable(c);
+    while (c.sent < limit) {
+        ssize_t n = ::send(c.fd, c.output.data() + c.sent, limit - c.sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.sent += n;
+            continue;
         }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
     }
-    sort(ans.begin(), ans.end(),compare);
-    int n=ans.size();
-    for(int i=0;i<n;i++){
-        printBookInfo(ans[i]->book, outputFile);
+    if (c.sent == c.output.size()) {
+        c.output.clear();
+        c.sent = 0;
     }
+    return true;
 }
 
-// Public function to find the book with an ID closest to the given ID
-void RedBlackTree::findClosestBook(int targetID, ofstream &outputFile) {
-    int minans=INT_MAX;
-    find(targetID, root, outputFile, minans);
+// Sending pending output, executing lines held back while it was large, and choosing what to wait for next.
+void LibraryServer::update(Connection &c) {
+    for (;;) {
+        if (!send(c)) {
+            closeConnection(c);
+            return;
+        }
+        if (c.output.size() > 0 || c.ending || c.received == 0 || memchr(&c.input[0], '\n', c.received) == NULL)
+            break;
+        executeLines(c);
+    }
+    size_t unsent = c.output.size() - c.sent;
+    if (c.ending && unsent == 0) {
+        closeConnection(c);
+        return;
+    }
+    uint32_t wanted = 0;
+    if (releasable(c) > c.sent)
+        wanted |= EPOLLOUT;
+    if (!c.ending && !c.inputEnded && unsent < MAX_UNSENT)
+        wanted |= EPOLLIN;
+    if (wanted != c.events) {
+        struct epoll_event event;
+        event.events = c.events = wanted;
+        event.data.fd = c.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &event);
+    }
 }
 
-// Public function to print the color flip count
-void RedBlackTree::countColorFlip(ofstream &outputFile) {
-    outputFile << "Color Flip Count: " << colorFlipCount << endl;
+void LibraryServer::closeConnection(Connection &c) {
+    if (!c.ending)
+        c.executor.finish();
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, NULL);
+    close(c.fd);
+    connections[c.fd] = NULL;
+    delete &c;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2)
+#ifndef GATOR_LIBRARY_NO_MAIN
+// Applying every command of the input file, stopping at Quit. Commands are decoded COMMAND_WINDOW at a
+// time, so the executor can look up their books together first.
+template <typename Executor>
+void runCommands(const InputFile &inputFile, Executor &executor) {
+    CommandScanner scanner;
+    const char *line = inputFile.begin();
+    const char *end = inputFile.end();
+    Command window[COMMAND_WINDOW];
+    bool running = true;
+    while (running && line < end)
     {
-        std::cout << "Usage: " << argv[0] << " file_name" << std::endl;
-        return 1;
+        size_t count = 0;
+        while (count < COMMAND_WINDOW && line < end) {
+            const char *newline = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char *lineEnd = newline ? newline : end;
+            window[count++] = scanner.parse(line, lineEnd);
+            line = lineEnd + 1;
+            if (window[count - 1].type == CMD_QUIT)
+                break;
+        }
+        executor.prefetch(window, count);
+        for (size_t i = 0; i < count && running; i++)
+            running = executor.execute(window[i]);
     }
+    executor.finish();
+}
 
-    string fileName = argv[1];
-    int fileLength=fileName.length();
-    ifstream inputFile(fileName);
-    ofstream outputFile(fileName.substr(0,fileLength-4)+"_output_file.txt");
+// Running the commands on this thread, or through a CommandPipeline when pipelined is set.
+template <typename Executor>
+void runCommands(const InputFile &inputFile, Executor &executor, OutputBuffer &staged, OutputBuffer &outputFile,
+                 bool pipelined) {
+    if (!pipelined) {
+        runCommands(inputFile, executor);
+        return;
+    }
+    CommandPipeline pipeline(inputFile, staged, outputFile);
+    pipeline.run(executor);
+}
 
-    if (!inputFile.is_open())
-    {
-        std::cout << "Error opening file: " << fileName << std::endl;
-        return 1;
+// Sending the commands of the input file to a server started with --serve and writing its responses to
+// outputFile, so the output matches a local run. The file is written while responses are read, as the server
+// stops reading from a connection whose responses are not collected. Returns false and sets error when the
+// server cannot be reached.
+bool sendToServer(const string &socketPath, const InputFile &inputFile, OutputBuffer &outputFile, string &error) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+        error = "socket path must have 1 to " + to_string(sizeof(address.sun_path) - 1) + " characters";
+        return false;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        error = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
     }
-    RedBlackTree library;
-    string line; 
-    while (getline(inputFile, line))
-    {
-        istringstream iss(line);
-        string operation;
-        getline(iss, operation, '(');
-
-        if (operation == "InsertBook")
-        {   int bookId;
-            string title, author, availability;
-            iss >> ws >> bookId;  // Read the integer
-            iss.ignore();  // Ignore the comma
-            getline(iss >> ws, title, ',');  // Read the title
-            getline(iss >> ws, author, ',');  // Read the author
-            getline(iss >> ws, availability, ')');
-            if (library.search(bookId))
-            {
-                outputFile << "Book already exists";
-            }
 
-            library.insertBook(bookId, title, author, true, -1);
+    const char *next = inputFile.begin();
+    const char *end = inputFile.end();
+    if (next == end)
+        shutdown(fd, SHUT_WR);
+    char buffer[1 << 16];
+    for (;;)
+    {
+        struct pollfd ready;
+        ready.fd = fd;
+        ready.events = POLLIN | (next < end ? POLLOUT : 0);
+        ready.revents = 0;
+        if (poll(&ready, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error = strerror(errno);
+            close(fd);
+            return false;
         }
-        else if (operation == "PrintBook")
-        {
-            int bookId;
-            iss >> bookId;
-            if (!library.search(bookId))
-            {
-                outputFile << "Book "<<bookId<<" not found in the Library"<<endl<<endl;
-            }
-            else{
-            library.printBook(bookId, outputFile);
+        if (next < end && (ready.revents & (POLLOUT | POLLERR | POLLHUP))) {
+            // The server stops reading after Quit, so a failed send only ends the input
+            ssize_t sent = send(fd, next, end - next, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent > 0)
+                next += sent;
+            else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                next = end;
+            if (next == end)
+                shutdown(fd, SHUT_WR);
         }
+        if (ready.revents & (POLLIN | POLLERR | POLLHUP)) {
+            ssize_t got = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (got <= 0)
+                break;
+            // Each response ends with a NUL, which the output file does not have
+            const char *piece = buffer;
+            const char *received = buffer + got;
+            while (piece < received) {
+                const char *nul = static_cast<const char*>(memchr(piece, '\0', received - piece));
+                const char *pieceEnd = nul ? nul : received;
+                outputFile.append(piece, pieceEnd - piece);
+                piece = pieceEnd + (nul ? 1 : 0);
+            }
         }
-        else if (operation == "PrintBooks")
-        {
-            int bookID1, bookID2;
-            iss >> ws >> bookID1;
-            iss.ignore();
-            iss >> ws>> bookID2;
-            library.printBooks(bookID1,bookID2, outputFile);
+    }
+    close(fd);
+    return true;
+}
 
-        }
-        else if (operation == "BorrowBook")
-        {
-            int patronID, bookID, patronPriority;
-            iss >> ws >> patronID;
-            iss.ignore();
-            iss >> ws>> bookID;
-            iss.ignore();
-            iss >> ws >> patronPriority;
-            library.borrowBook(patronID, bookID, patronPriority, outputFile);
-            outputFile <<"\n";
-        }
-        else if (operation == "ReturnBook")
-        {
-            int patronID, bookID;
-            iss >> ws >> patronID;
-            iss.ignore();
-            iss >> ws>> bookID;
-            library.returnBook(patronID, bookID, outputFile);
-        }
-        else if (operation == "ColorFlipCount")
-        {
-            library.countColorFlip(outputFile);
-            outputFile<<"\n";
-        }
-         else if (operation == "DeleteBook")
+int main(int argc, char *argv[]) {
+    int shardCount = 1;
+    EngineKind engine = ENGINE_RBTREE;
+    bool validEngine = true;
+    bool pipelined = false;
+    string socketPath, serverPath, logDirectory;
+    WriteAheadLog::SyncPolicy policy = WriteAheadLog::SYNC_GROUP;
+    size_t groupOps = 64;
+    long long groupMicros = 100;
+    bool validSync = true;
+    int arg = 1;
+    for (; arg < argc; arg++)
+    {
+        string option = argv[arg];
+        bool hasValue = arg + 1 < argc;
+        if (option == "--shards" && hasValue)
+            shardCount = atoi(argv[++arg]);
+        else if (option.compare(0, 9, "--engine=") == 0)
+            validEngine = parseEngine(option.substr(9), engine);
+        else if (option == "--engine" && hasValue)
+            validEngine = parseEngine(argv[++arg], engine);
+        else if (option == "--pipeline")
+            pipelined = true;
+        else if (option == "--serve" && hasValue)
+            socketPath = argv[++arg];
+        else if (option == "--connect" && hasValue)
+            serverPath = argv[++arg];
+        else if (option == "--wal" && hasValue)
+            logDirectory = argv[++arg];
+        else if (option == "--sync" && hasValue)
+            validSync = WriteAheadLog::parsePolicy(argv[++arg], policy, groupOps, groupMicros);
+        else
+            break;
+    }
+    bool serving = !socketPath.empty();
+    bool logging = !logDirectory.empty();
+    bool connecting = !serverPath.empty();
+    if (arg != (serving ? argc : argc - 1) || !validSync || !validEngine || shardCount < 1 || shardCount > ShardedLibrary::MAX_SHARDS ||
+        (serving && (shardCount > 1 || pipelined)) || (logging && shardCount > 1) ||
+        (connecting && (serving || logging || shardCount > 1 || pipelined)))
+    {
+        std::cout << "Usage: " << argv[0] << " [--engine=ENGINE] [--shards N] [--pipeline] [--wal DIR [--sync POLICY]] file_name"
+                  << std::endl
+                  << "       " << argv[0] << " [--engine=ENGINE] --serve socket_path [--wal DIR [--sync POLICY]]" << std::endl
+                  << "       " << argv[0] << " --connect socket_path file_name" << std::endl
+                  << "ENGINE is rbtree (default) or bplustree" << std::endl
+                  << "POLICY is always, none or group[:N[:T]] (sync every N records or T microseconds; default group:64:100)"
+                  << std::endl;
+        return 1;
+    }
+
+    // With a log, the library starts from what the log directory recovers
+    Library library(engine);
+    WriteAheadLog log(library, logDirectory, policy, groupOps, groupMicros);
+    string error;
+    if (logging && !log.open(error))
+    {
+        std::cout << "Error recovering from " << logDirectory << ": " << error << std::endl;
+        return 1;
+    }
+
+    if (serving)
+    {
+        LibraryServer server(library, logging ? &log : NULL);
+        if (!server.listen(socketPath, error) || !server.run(error))
         {
-            int bookID;
-            iss >> ws >> bookID;
-            library.deleteBook(bookID, outputFile);
-            outputFile <<"\n";
+            std::cout << "Error serving on " << socketPath << ": " << error << std::endl;
+            return 1;
         }
-         else if (operation == "FindClosestBook")
+        if (logging && !log.close(error))
         {
-            int targetID;
-            iss >> ws >> targetID;
-            library.findClosestBook(targetID, outputFile);
-            outputFile << "\n";
+            std::cout << "Error closing " << logDirectory << ": " << error << std::endl;
+            return 1;
         }
-        else if (operation == "Quit")
+        return 0;
+    }
+
+    string fileName = argv[arg];
+    int fileLength=fileName.length();
+    InputFile inputFile;
+    OutputBuffer outputFile;
+    string outputName = fileName.substr(0,fileLength-4)+"_output_file.txt";
+
+    if (!inputFile.open(fileName))
+    {
+        std::cout << "Error opening file: " << fileName << std::endl;
+        return 1;
+    }
+    if (!outputFile.open(outputName))
+    {
+        std::cout << "Error opening file: " << outputName << std::endl;
+        return 1;
+    }
+    if (connecting)
+    {
+        if (!sendToServer(serverPath, inputFile, outputFile, error))
         {
-            outputFile << "Program Terminated!!";
-            break;
+            std::cout << "Error connecting to " << serverPath << ": " << error << std::endl;
+            return 1;
         }
+        outputFile.close();
+        return 0;
+    }
+    // A pipelined run renders into staged, which the pipeline drains into outputFile
+    OutputBuffer staged;
+    OutputBuffer &commandOutput = pipelined ? staged : outputFile;
+    if (shardCount == 1)
+    {
+        CommandExecutor executor(library, commandOutput);
+        if (logging)
+            executor.logTo(&log, 0);
+        runCommands(inputFile, executor, staged, outputFile, pipelined);
+    }
+    else
+    {
+        ShardedLibrary shards(shardCount, commandOutput, engine);
+        runCommands(inputFile, shards, staged, outputFile, pipelined);
     }
-    inputFile.close();
     outputFile.close();
+    if (logging && !log.close(error))
+    {
+        std::cout << "Error closing " << logDirectory << ": " << error << std::endl;
+        return 1;
+    }
     return 0;
 }
+#endif
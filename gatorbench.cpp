@@ -0,0 +1,1184 @@
+// gatorbench: synthetic workload generator and benchmark for the GatorLibrary red black tree.
+// It preloads a catalog, generates a stream of library commands with a configurable mix and key
+// distribution, runs them against Library directly and reports throughput, per operation
+// latency percentiles, peak RSS and the tree height. With --connect it instead drives a running
+// `gatorLibrary --serve` daemon from many client connections, and with --wal it compares the write-ahead
+// log's durability levels.
+
+#define GATOR_LIBRARY_NO_MAIN
+#include "gatorLibrary.cpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Operations the generator can emit.
+enum BenchOp {
+    OP_INSERT,
+    OP_BORROW,
+    OP_RETURN,
+    OP_DELETE,
+    OP_PRINT,
+    OP_RANGE,
+    OP_CLOSEST,
+    OP_COUNT
+};
+
+static const char *OP_NAMES[OP_COUNT] = {
+    "InsertBook", "BorrowBook", "ReturnBook", "DeleteBook", "PrintBook", "PrintBooks", "FindClosestBook"
+};
+
+// Key distributions used to pick the book an operation targets.
+enum KeyDistribution {
+    DIST_UNIFORM,
+    DIST_SEQUENTIAL,
+    DIST_ZIPFIAN
+};
+
+// Benchmark configuration, filled from the command line.
+struct BenchConfig {
+    long long books;
+    long long ops;
+    KeyDistribution dist;
+    double zipfTheta;
+    int rangeWidth;
+    int closestCount;
+    long long heapOps;
+    long long treeOps;
+    long long batchOps;
+    long long frozenOps;
+    long long searchOps;
+    vector<int> readerCounts;
+    int readsPerWrite;
+    string socketPath;
+    vector<int> clientCounts;
+    int depth;
+    string logDirectory;
+    vector<string> syncLevels;
+    unsigned seed;
+    bool bulkPreload;
+    EngineKind engine;
+    double mix[OP_COUNT];
+    string outputPath;
+
+    BenchConfig() : books(100000), ops(1000000), dist(DIST_UNIFORM), zipfTheta(0.99), rangeWidth(10), closestCount(1), heapOps(0), treeOps(0), batchOps(0), frozenOps(0), searchOps(0), readsPerWrite(50), depth(16), seed(42), bulkPreload(false), engine(ENGINE_RBTREE) {
+        double defaults[OP_COUNT] = {10, 20, 20, 10, 30, 5, 5};
+        for (int i = 0; i < OP_COUNT; i++) {
+            mix[i] = defaults[i];
+        }
+        outputPath = "/dev/null";
+    }
+};
+
+// Zipfian generator over [0, n) following Gray et al., "Quickly generating billion-record synthetic
+// databases". Ranks are scrambled with a multiplicative hash so the hot keys are spread over the tree.
+class ZipfianGenerator {
+private:
+    long long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+
+    static double zeta(long long n, double theta) {
+        double sum = 0;
+        for (long long i = 1; i <= n; i++) {
+            sum += 1.0 / pow((double)i, theta);
+        }
+        return sum;
+    }
+
+public:
+    ZipfianGenerator(long long n, double theta) : n(n), theta(theta) {
+        double zeta2 = zeta(2, theta);
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template <typename Rng>
+    long long next(Rng &rng) {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        long long rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < 1.0 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = (long long)(n * pow(eta * u - eta + 1, alpha));
+        }
+        if (rank >= n)
+            rank = n - 1;
+        return (long long)(((unsigned long long)rank * 0x9E3779B97F4A7C15ULL) % (unsigned long long)n);
+    }
+};
+
+// A single generated command.
+struct BenchCommand {
+    BenchOp op;
+    int bookID;
+    int arg1;
+    int arg2;
+};
+
+// Produces the command stream for the configured mix and distribution.
+class WorkloadGenerator {
+private:
+    const BenchConfig &config;
+    mt19937_64 rng;
+    ZipfianGenerator *zipf;
+    discrete_distribution<int> opPicker;
+    long long sequentialCursor;
+    int nextNewID;
+
+public:
+    WorkloadGenerator(const BenchConfig &config)
+        : config(config), rng(config.seed), zipf(NULL),
+          opPicker(config.mix, config.mix + OP_COUNT), sequentialCursor(0), nextNewID((int)config.books + 1) {
+        if (config.dist == DIST_ZIPFIAN) {
+            zipf = new ZipfianGenerator(config.books, config.zipfTheta);
+        }
+    }
+
+    ~WorkloadGenerator() { delete zipf; }
+
+    // Book ID in the preloaded catalog [1, books] picked by the key distribution.
+    int pickBook() {
+        long long index;
+        switch (config.dist) {
+        case DIST_SEQUENTIAL:
+            index = sequentialCursor++ % config.books;
+            break;
+        case DIST_ZIPFIAN:
+            index = zipf->next(rng);
+            break;
+        default:
+            index = (long long)(rng() % (unsigned long long)config.books);
+            break;
+        }
+        return (int)index + 1;
+    }
+
+    BenchCommand next() {
+        BenchCommand cmd;
+        cmd.op = (BenchOp)opPicker(rng);
+        cmd.arg1 = 0;
+        cmd.arg2 = 0;
+        switch (cmd.op) {
+        case OP_INSERT:
+            cmd.bookID = nextNewID++;
+            break;
+        case OP_BORROW:
+            cmd.bookID = pickBook();
+            cmd.arg1 = (int)(rng() % 1000000) + 1;
+            cmd.arg2 = (int)(rng() % 10) + 1;
+            break;
+        case OP_RETURN:
+            cmd.bookID = pickBook();
+            cmd.arg1 = (int)(rng() % 1000000) + 1;
+            break;
+        case OP_RANGE:
+            cmd.bookID = pickBook();
+            cmd.arg1 = cmd.bookID + config.rangeWidth - 1;
+            break;
+        default:
+            cmd.bookID = pickBook();
+            break;
+        }
+        return cmd;
+    }
+};
+
+// Pronounceable made-up word for the n-th entry of a 4096 word vocabulary.
+static string syntheticWord(unsigned n) {
+    static const char *SYLLABLES[16] = {"ka", "lo", "mi", "ne", "ru", "sa", "te", "vo",
+                                        "bel", "dor", "fin", "gar", "hul", "mor", "pen", "zit"};
+    string word;
+    for (int i = 0; i < 3; i++, n >>= 4)
+        word += SYLLABLES[n & 15];
+    word[0] = toupper(word[0]);
+    return word;
+}
+
+// Title and author of a book in the search catalog, quoted like InsertBook arguments. Titles are unique;
+// authors are shared by about 25 books each.
+static string catalogTitle(int id) {
+    return "\"" + syntheticWord((unsigned)id * 2654435761u >> 20) + " " + syntheticWord(id % 4096) + " " +
+           to_string(id) + "\"";
+}
+
+static string catalogAuthor(int id, long long books) {
+    unsigned author = (unsigned)(((unsigned long long)id * 0x9E3779B97F4A7C15ULL) % (unsigned long long)max(1LL, books / 25));
+    return "\"" + syntheticWord(author % 4096) + " " + syntheticWord(author / 4096 + 1) + "\"";
+}
+
+static double elapsedSeconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static long peakRSSKilobytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void usage(const char *program) {
+    cout << "Usage: " << program << " [options]\n"
+         << "  --books N          catalog size preloaded before the run (default 100000)\n"
+         << "  --ops N            number of generated commands (default 1000000)\n"
+         << "  --dist D           key distribution: uniform, sequential or zipf (default uniform)\n"
+         << "  --theta T          zipf skew (default 0.99)\n"
+         << "  --mix I,B,R,D,P,S,F  weights of InsertBook, BorrowBook, ReturnBook, DeleteBook,\n"
+         << "                     PrintBook, PrintBooks and FindClosestBook (default 10,20,20,10,30,5,5)\n"
+         << "  --range W          width of PrintBooks ranges (default 10)\n"
+         << "  --closest K        books returned per FindClosestBook; above 1 runs FindClosestBooks (default 1)\n"
+         << "  --seed S           random seed (default 42)\n"
+         << "  --preload P        build the catalog with insert (one InsertBook per book) or bulk\n"
+         << "  --out FILE         where command output is written (default /dev/null)\n"
+         << "  --heap-ops N       instead of the workload, time N reservation cancels on --books full waitlists\n"
+         << "  --tree-ops N       instead of the workload, time N inserts, lookups, delete+insert churn with N new\n"
+         << "                     IDs, and deletes on the bare red-black tree under each stats policy and on the\n"
+         << "                     bare B+tree, in shuffled order (sequential with --dist)\n"
+         << "  --batch-ops N      instead of the workload, time N lookups of random IDs on a bare tree of each engine\n"
+         << "                     holding --books keys, one at a time and in interleaved groups (findMany)\n"
+         << "  --frozen-ops N     after the preload, time N lookups (the P,S,F part of --mix) on the live tree,\n"
+         << "                     then Freeze and time N more on the frozen index\n"
+         << "  --engine E         book tree of the library: rbtree or bplustree (default rbtree)\n"
+         << "  --search-ops N     give the catalog distinct titles and ~25 books per author, then time\n"
+         << "                     N SearchTitle and N SearchAuthor queries after the workload\n"
+         << "  --readers LIST     instead of the workload, run --ops lookups (the P,S,F part of --mix) on each\n"
+         << "                     listed number of reader threads, e.g. 1,2,4,8,16,32, beside one writer thread\n"
+         << "  --reads-per-write N  lookups per BorrowBook/ReturnBook/InsertBook/DeleteBook of the writer (default 50)\n"
+         << "  --connect PATH     instead of the in-process run, bulk load the catalog into the daemon serving the\n"
+         << "                     Unix socket PATH and send it --ops commands from each --clients count in turn\n"
+         << "  --clients LIST     concurrent connections with --connect, e.g. 1,16,64 (default 1)\n"
+         << "  --depth N          commands each connection keeps in flight (default 16)\n"
+         << "  --wal DIR          instead of the workload, run --ops commands through a write-ahead log in DIR\n"
+         << "                     at each --sync level and compare throughput and latency\n"
+         << "  --sync LIST        durability levels for --wal: off (no log), none, group[:N[:T]] or always\n"
+         << "                     (default off,none,group:64:100,always)\n";
+}
+
+static bool parseArgs(int argc, char *argv[], BenchConfig &config) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        string value = argv[++i];
+        if (arg == "--books") {
+            config.books = atoll(value.c_str());
+        } else if (arg == "--ops") {
+            config.ops = atoll(value.c_str());
+        } else if (arg == "--dist") {
+            if (value == "uniform")
+                config.dist = DIST_UNIFORM;
+            else if (value == "sequential")
+                config.dist = DIST_SEQUENTIAL;
+            else if (value == "zipf")
+                config.dist = DIST_ZIPFIAN;
+            else
+                return false;
+        } else if (arg == "--theta") {
+            config.zipfTheta = atof(value.c_str());
+        } else if (arg == "--mix") {
+            stringstream ss(value);
+            string weight;
+            for (int op = 0; op < OP_COUNT; op++) {
+                if (!getline(ss, weight, ','))
+                    return false;
+                config.mix[op] = atof(weight.c_str());
+            }
+        } else if (arg == "--range") {
+            config.rangeWidth = atoi(value.c_str());
+        } else if (arg == "--search-ops") {
+            config.searchOps = atoll(value.c_str());
+        } else if (arg == "--readers") {
+            stringstream ss(value);
+            string count;
+            while (getline(ss, count, ',')) {
+                int readers = atoi(count.c_str());
+                if (readers <= 0 || readers > ReaderEpochs::MAX_READERS)
+                    return false;
+                config.readerCounts.push_back(readers);
+            }
+        } else if (arg == "--connect") {
+            config.socketPath = value;
+        } else if (arg == "--clients") {
+            stringstream ss(value);
+            string count;
+            while (getline(ss, count, ',')) {
+                int clients = atoi(count.c_str());
+                if (clients <= 0)
+                    return false;
+                config.clientCounts.push_back(clients);
+            }
+        } else if (arg == "--wal") {
+            config.logDirectory = value;
+        } else if (arg == "--sync") {
+            stringstream ss(value);
+            string level;
+            while (getline(ss, level, ',')) {
+                WriteAheadLog::SyncPolicy policy;
+                size_t groupOps = 64;
+                long long groupMicros = 100;
+                if (level != "off" && !WriteAheadLog::parsePolicy(level, policy, groupOps, groupMicros))
+                    return false;
+                config.syncLevels.push_back(level);
+            }
+        } else if (arg == "--depth") {
+            config.depth = atoi(value.c_str());
+        } else if (arg == "--reads-per-write") {
+            config.readsPerWrite = atoi(value.c_str());
+        } else if (arg == "--heap-ops") {
+            config.heapOps = atoll(value.c_str());
+        } else if (arg == "--tree-ops") {
+            config.treeOps = atoll(value.c_str());
+        } else if (arg == "--batch-ops") {
+            config.batchOps = atoll(value.c_str());
+        } else if (arg == "--frozen-ops") {
+            config.frozenOps = atoll(value.c_str());
+        } else if (arg == "--closest") {
+            config.closestCount = atoi(value.c_str());
+        } else if (arg == "--seed") {
+            config.seed = (unsigned)atoi(value.c_str());
+        } else if (arg == "--preload") {
+            if (value == "bulk")
+                config.bulkPreload = true;
+            else if (value == "insert")
+                config.bulkPreload = false;
+            else
+                return false;
+        } else if (arg == "--engine") {
+            if (!parseEngine(value, config.engine))
+                return false;
+        } else if (arg == "--out") {
+            config.outputPath = value;
+        } else {
+            return false;
+        }
+    }
+    if (config.clientCounts.empty())
+        config.clientCounts.push_back(1);
+    if (config.syncLevels.empty()) {
+        const char *levels[] = {"off", "none", "group:64:100", "always"};
+        config.syncLevels.assign(levels, levels + 4);
+    }
+    return config.books > 0 && config.ops >= 0 && config.closestCount > 0 && config.readsPerWrite > 0 && config.depth > 0;
+}
+
+// Applying one command to the tree the same way main does.
+static void execute(Library &library, const BenchCommand &cmd, const BenchConfig &config, OutputBuffer &out) {
+    switch (cmd.op) {
+    case OP_INSERT:
+        library.insertBook(cmd.bookID, "\"Title\"", "\"Author\"", true, -1);
+        break;
+    case OP_BORROW:
+        library.borrowBook(cmd.arg1, cmd.bookID, cmd.arg2, out);
+        break;
+    case OP_RETURN:
+        library.returnBook(cmd.arg1, cmd.bookID, out);
+        break;
+    case OP_DELETE:
+        if (library.search(cmd.bookID))
+            library.deleteBook(cmd.bookID, out);
+        break;
+    case OP_PRINT:
+        library.printBook(cmd.bookID, out);
+        break;
+    case OP_RANGE:
+        library.printBooks(cmd.bookID, cmd.arg1, out);
+        break;
+    case OP_CLOSEST:
+        if (config.closestCount > 1)
+            library.findClosestBooks(cmd.bookID, config.closestCount, out);
+        else
+            library.findClosestBook(cmd.bookID, out);
+        break;
+    default:
+        break;
+    }
+}
+
+// Ways to take one patron's reservation out of a waitlist.
+enum CancelMethod {
+    CANCEL_BY_HANDLE,   // the indexed heap: the handle gives the position directly
+    CANCEL_BY_SCAN,     // search the heap array for the patron, then remove that position
+    CANCEL_BY_REBUILD,  // drain the heap and restore everyone else, all a plain insert/extractMin heap allows
+    CANCEL_METHODS
+};
+
+static const char *CANCEL_METHOD_NAMES[CANCEL_METHODS] = {"handle", "scan", "rebuild"};
+
+// Reservation heap microbenchmark. Every book gets a full waitlist of patrons 1..CAPACITY; each operation
+// cancels a random patron's reservation on a random book and adds it back with a new priority, so the
+// heaps stay full. All methods replay the same sequence of operations.
+static void runHeapBenchmark(const BenchConfig &config) {
+    const int capacity = ReservationHeap::CAPACITY;
+    vector<ReservationHeap> initial(config.books);
+    vector<int> initialHandles(config.books * capacity);
+    mt19937_64 fillRng(config.seed);
+    for (long long b = 0; b < config.books; b++) {
+        for (int p = 0; p < capacity; p++) {
+            initialHandles[b * capacity + p] = initial[b].insertReservation(p + 1, (int)(fillRng() % 5) + 1);
+        }
+    }
+
+    printf("reservation heap   %lld cancels on %lld waitlists of %d\n", config.heapOps, config.books, capacity);
+    for (int method = 0; method < CANCEL_METHODS; method++) {
+        vector<ReservationHeap> heaps(initial);
+        vector<int> handles(initialHandles);
+        mt19937_64 rng(config.seed + 1);
+        vector<ReservationNode> drained(capacity, ReservationNode(0, 0));
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (long long op = 0; op < config.heapOps; op++) {
+            long long b = (long long)(rng() % config.books);
+            int patron = (int)(rng() % capacity);
+            int priority = (int)(rng() % 5) + 1;
+            ReservationHeap &heap = heaps[b];
+            if (method == CANCEL_BY_HANDLE) {
+                heap.remove(handles[b * capacity + patron]);
+            } else if (method == CANCEL_BY_SCAN) {
+                int position = 0;
+                while (heap.entry(position).patronID != patron + 1) position++;
+                heap.remove(heap.handle(position));
+            } else {
+                int kept = 0;
+                while (!heap.isEmpty()) {
+                    ReservationNode next = heap.extractMin();
+                    if (next.patronID != patron + 1) drained[kept++] = next;
+                }
+                // extractMin yields sorted order, which is already a valid heap array
+                for (int i = 0; i < kept; i++) {
+                    handles[b * capacity + drained[i].patronID - 1] = heap.restore(drained[i]);
+                }
+            }
+            handles[b * capacity + patron] = heap.insertReservation(patron + 1, priority);
+        }
+        double seconds = elapsedSeconds(start);
+        printf("  %-16s %8.1f ns/op\n", CANCEL_METHOD_NAMES[method], config.heapOps > 0 ? seconds * 1e9 / config.heapOps : 0.0);
+    }
+}
+
+// Timing inserts and lookups of ids on a bare book tree, then churn, where each book of
+// ids in turn is deleted and one of incoming inserted, then deletes of incoming, and printing the cost of
+// each phase.
+template <typename Tree>
+static void runTreeBenchmark(const vector<int> &ids, const vector<int> &incoming, const char *name) {
+    Tree tree;
+    string author = "Author";
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i++)
+        tree.insert(tree.create(ids[i], ids[i], "Title", &author, true, -1));
+    double insertSeconds = elapsedSeconds(start);
+    int height = tree.height();
+
+    long long found = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i++)
+        found += tree.value(tree.find(ids[i])).BookId == ids[i];
+    double findSeconds = elapsedSeconds(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ids.size(); i++) {
+        NodeIndex index = tree.find(ids[i]);
+        tree.erase(index);
+        tree.release(index);
+        tree.insert(tree.create(incoming[i], incoming[i], "Title", &author, true, -1));
+    }
+    double churnSeconds = elapsedSeconds(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < incoming.size(); i++) {
+        NodeIndex index = tree.find(incoming[i]);
+        tree.erase(index);
+        tree.release(index);
+    }
+    double eraseSeconds = elapsedSeconds(start);
+
+    double n = ids.size();
+    printf("  %-16s %10.1f %10.1f %10.1f %10.1f %8d\n", name, insertSeconds * 1e9 / n, findSeconds * 1e9 / n,
+           churnSeconds * 1e9 / n, eraseSeconds * 1e9 / n, height);
+    if (found != (long long)ids.size())
+        printf("  lookups found %lld of %zu books\n", found, ids.size());
+}
+
+// Comparing the red-black tree's cost under each stats policy: TreeCounters as in the library, FlipCounter
+// as in a build with GATOR_STATS=0, and NoTreeStats, which leaves plain color stores; then the B+tree, whose
+// height is its level count.
+static void runTreeBenchmarks(const BenchConfig &config) {
+    vector<int> ids(config.treeOps), incoming(config.treeOps);
+    for (long long i = 0; i < config.treeOps; i++) {
+        ids[i] = (int)(i + 1);
+        incoming[i] = (int)(config.treeOps + i + 1);
+    }
+    if (config.dist != DIST_SEQUENTIAL) {
+        mt19937_64 rng(config.seed);
+        shuffle(ids.begin(), ids.end(), rng);
+        shuffle(incoming.begin(), incoming.end(), rng);
+    }
+    printf("book tree          %lld books (%s)\n", config.treeOps,
+           config.dist == DIST_SEQUENTIAL ? "sequential" : "shuffled");
+    printf("  %-16s %10s %10s %10s %10s %8s\n", "tree", "insert ns", "find ns", "churn ns", "erase ns", "height");
+    runTreeBenchmark<RedBlackTree<int, BookNode, less<int>, BookStore, TreeCounters> >(ids, incoming,
+                                                                                      "rbtree counters");
+    runTreeBenchmark<RedBlackTree<int, BookNode, less<int>, BookStore, FlipCounter> >(ids, incoming,
+                                                                                     "rbtree flips");
+    runTreeBenchmark<RedBlackTree<int, BookNode, less<int>, BookStore, NoTreeStats> >(ids, incoming, "rbtree none");
+    runTreeBenchmark<BPlusTree<int, BookNode, less<int>, BookStore, NoTreeStats> >(ids, incoming, "bplustree");
+}
+
+// Timing lookups of queries on a bare tree holding the keys 1..books, one find after another and then
+// with findMany, whose interleaved descents overlap their cache misses. The nodes are created in shuffled
+// order, so neighbors in the tree are scattered in memory as after a run of InsertBooks.
+template <typename Tree>
+static void runBatchBenchmark(const BenchConfig &config, const vector<int> &queries, const char *name) {
+    Tree tree;
+    vector<int> ids(config.books);
+    for (long long i = 0; i < config.books; i++)
+        ids[i] = (int)(i + 1);
+    mt19937_64 rng(config.seed);
+    shuffle(ids.begin(), ids.end(), rng);
+    vector<NodeIndex> nodes(ids.size());
+    for (size_t i = 0; i < ids.size(); i++)
+        nodes[ids[i] - 1] = tree.create(ids[i], ids[i]);
+    vector<int>().swap(ids);
+    tree.linkSorted(nodes, false);
+    vector<NodeIndex>().swap(nodes);
+
+    long long found[2] = {0, 0};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < queries.size(); i++)
+        found[0] += tree.find(queries[i]) != NIL;
+    double serialSeconds = elapsedSeconds(start);
+
+    const size_t BATCH = 64;
+    NodeIndex results[BATCH];
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < queries.size(); i += BATCH) {
+        size_t n = min(BATCH, queries.size() - i);
+        tree.findMany(&queries[i], n, results);
+        for (size_t j = 0; j < n; j++)
+            found[1] += results[j] != NIL;
+    }
+    double batchSeconds = elapsedSeconds(start);
+
+    double n = queries.size();
+    printf("  %-16s %12.1f %12.1f %8.2fx %8d\n", name, serialSeconds * 1e9 / n, batchSeconds * 1e9 / n,
+           batchSeconds > 0 ? serialSeconds / batchSeconds : 0.0, tree.height());
+    if (found[0] != found[1] || found[0] != (long long)queries.size())
+        printf("  lookups found %lld and %lld of %zu books\n", found[0], found[1], queries.size());
+}
+
+// Comparing serial and interleaved lookups on both engines, each built and measured in turn so that only
+// one catalog is in memory at a time.
+static void runBatchBenchmarks(const BenchConfig &config) {
+    vector<int> queries(config.batchOps);
+    mt19937_64 rng(config.seed + 1);
+    for (size_t i = 0; i < queries.size(); i++)
+        queries[i] = (int)(rng() % (unsigned long long)config.books) + 1;
+    printf("book tree          %lld books, %lld lookups of random IDs\n", config.books, config.batchOps);
+    printf("  %-16s %12s %12s %9s %8s\n", "tree", "find ns", "findMany ns", "speedup", "height");
+    runBatchBenchmark<RedBlackTree<int, int, less<int>, NodeStore<int, int>, NoTreeStats> >(config, queries, "rbtree");
+    runBatchBenchmark<BPlusTree<int, int, less<int>, NodeStore<int, int>, NoTreeStats> >(config, queries, "bplustree");
+}
+
+// Lookups of one reader thread: its share of --ops PrintBook, PrintBooks and FindClosestBook through its own
+// TreeReader, picked with the --mix weights of those three. Completed lookups are published in batches.
+static void runReader(Library &library, const BenchConfig &config, int reader, long long lookups,
+                      atomic<long long> &totalReads, unsigned long long &retries) {
+    BenchConfig own = config;
+    own.seed = config.seed + 7919 * (reader + 1);
+    WorkloadGenerator keys(own);
+    mt19937_64 rng(own.seed);
+    discrete_distribution<int> lookupPicker(config.mix + OP_PRINT, config.mix + OP_COUNT);
+    TreeReader view(library);
+    OutputBuffer out;
+    long long unpublished = 0;
+    for (long long i = 0; i < lookups; i++) {
+        int bookID = keys.pickBook();
+        switch (OP_PRINT + lookupPicker(rng)) {
+        case OP_PRINT:
+            view.printBook(bookID, out);
+            break;
+        case OP_RANGE:
+            view.printBooks(bookID, bookID + config.rangeWidth - 1, out);
+            break;
+        default:
+            view.findClosestBook(bookID, out);
+            break;
+        }
+        if (++unpublished == 64) {
+            totalReads.fetch_add(unpublished, memory_order_relaxed);
+            unpublished = 0;
+        }
+    }
+    totalReads.fetch_add(unpublished, memory_order_relaxed);
+    retries = view.retryCount();
+}
+
+// Reader scaling: for each reader count, --ops lookups split over that many TreeReader threads while one
+// writer thread applies the I,B,R,D part of the mix, one write per --reads-per-write lookups completed.
+static void runReaderBenchmark(Library &library, const BenchConfig &config, OutputBuffer &out) {
+    BenchConfig writes = config;
+    writes.seed = config.seed ^ 0x9E3779B9;
+    for (int op = OP_PRINT; op < OP_COUNT; op++)
+        writes.mix[op] = 0;
+    WorkloadGenerator writeGenerator(writes);
+
+    printf("%-8s %14s %14s %16s\n", "readers", "lookups/sec", "writes/sec", "retries/1k reads");
+    for (size_t run = 0; run < config.readerCounts.size(); run++) {
+        int readers = config.readerCounts[run];
+        atomic<long long> totalReads(0);
+        atomic<bool> done(false);
+        vector<unsigned long long> retries(readers, 0);
+        long long writesDone = 0;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        thread writer([&]() {
+            while (!done.load(memory_order_relaxed)) {
+                if (writesDone * config.readsPerWrite >= totalReads.load(memory_order_relaxed)) {
+                    this_thread::yield();
+                    continue;
+                }
+                execute(library, writeGenerator.next(), writes, out);
+                writesDone++;
+            }
+        });
+        vector<thread> threads;
+        for (int r = 0; r < readers; r++) {
+            long long share = config.ops / readers + (r < config.ops % readers ? 1 : 0);
+            threads.push_back(thread(runReader, ref(library), cref(config), r, share, ref(totalReads), ref(retries[r])));
+        }
+        for (int r = 0; r < readers; r++)
+            threads[r].join();
+        double seconds = elapsedSeconds(start);
+        done.store(true);
+        writer.join();
+
+        unsigned long long retried = 0;
+        for (int r = 0; r < readers; r++)
+            retried += retries[r];
+        printf("%-8d %14.0f %14.0f %16.2f\n", readers, config.ops / seconds, writesDone / seconds,
+               config.ops > 0 ? retried * 1000.0 / config.ops : 0.0);
+    }
+}
+
+// The lookup a PrintBook, PrintBooks or FindClosestBook command starts with, returning the books found.
+static int lookUp(Library &library, const BenchCommand &cmd) {
+    switch (cmd.op) {
+    case OP_PRINT:
+        return library.search(cmd.bookID) != NULL;
+    case OP_RANGE:
+        return library.countBooks(cmd.bookID, cmd.arg1);
+    default: {
+        BookNode *floorBook, *ceilingBook;
+        library.closestCandidates(cmd.bookID, floorBook, ceilingBook);
+        return (floorBook != NULL) + (ceilingBook != NULL);
+    }
+    }
+}
+
+// Query throughput before and after Freeze: --frozen-ops PrintBook, PrintBooks and FindClosestBook picked
+// with the --mix weights of those three, on the live tree and then, once the library is frozen, on another
+// stream of the same kind. Each stream is timed as a whole and for each kind of query alone, once as whole
+// commands and once as just the lookups they start with, since printing the books found costs the same
+// either way.
+static void runFrozenBenchmark(Library &library, const BenchConfig &config, OutputBuffer &out) {
+    // By pass (0 commands, 1 lookups), then live or frozen, then operation; OP_COUNT stands for all of them
+    double seconds[2][2][OP_COUNT + 1] = {};
+    long long counts[2][OP_COUNT + 1] = {};
+    double freezeSeconds = 0;
+    long long found = 0;
+    vector<BenchCommand> stream(config.frozenOps);
+    for (int frozen = 0; frozen < 2; frozen++) {
+        if (frozen) {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (!library.freeze()) {
+                printf("the catalog repeats book IDs and cannot be frozen\n");
+                return;
+            }
+            freezeSeconds = elapsedSeconds(start);
+        }
+        BenchConfig own = config;
+        own.seed = config.seed + 7919 * (frozen + 1);
+        WorkloadGenerator keys(own);
+        mt19937_64 rng(own.seed);
+        discrete_distribution<int> lookupPicker(config.mix + OP_PRINT, config.mix + OP_COUNT);
+        for (size_t i = 0; i < stream.size(); i++) {
+            BenchCommand &cmd = stream[i];
+            cmd.op = (BenchOp)(OP_PRINT + lookupPicker(rng));
+            cmd.bookID = keys.pickBook();
+            cmd.arg1 = cmd.bookID + config.rangeWidth - 1;
+            cmd.arg2 = 0;
+            counts[frozen][cmd.op]++;
+        }
+        counts[frozen][OP_COUNT] = stream.size();
+        for (int pass = 0; pass < 2; pass++) {
+            for (int op = OP_PRINT; op <= OP_COUNT; op++) {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                for (size_t i = 0; i < stream.size(); i++) {
+                    if (op != OP_COUNT && stream[i].op != op)
+                        continue;
+                    if (pass == 0)
+                        execute(library, stream[i], config, out);
+                    else
+                        found += lookUp(library, stream[i]);
+                }
+                seconds[pass][frozen][op] = elapsedSeconds(start);
+            }
+        }
+    }
+
+    printf("freeze             %.3f s for %d books\n", freezeSeconds, library.bookCount());
+    const char *passNames[2] = {"commands", "lookups only"};
+    for (int pass = 0; pass < 2; pass++) {
+        printf("\n%-16s %12s %12s %12s %9s\n", passNames[pass], "count", "live ns", "frozen ns", "speedup");
+        for (int op = OP_PRINT; op <= OP_COUNT; op++) {
+            if (counts[0][op] == 0 || counts[1][op] == 0)
+                continue;
+            double live = seconds[pass][0][op] * 1e9 / counts[0][op];
+            double frozen = seconds[pass][1][op] * 1e9 / counts[1][op];
+            printf("%-16s %12lld %12.1f %12.1f %8.2fx\n", op < OP_COUNT ? OP_NAMES[op] : "all", counts[1][op],
+                   live, frozen, frozen > 0 ? live / frozen : 0.0);
+        }
+    }
+    printf("\nbooks found        %lld by the lookups\n", found);
+}
+
+// Text of a command in the input file grammar, newline included.
+static string formatCommand(const BenchCommand &cmd, const BenchConfig &config) {
+    char line[128];
+    switch (cmd.op) {
+    case OP_INSERT:
+        snprintf(line, sizeof(line), "InsertBook(%d, \"Title\", \"Author\", \"Yes\")\n", cmd.bookID);
+        break;
+    case OP_BORROW:
+        snprintf(line, sizeof(line), "BorrowBook(%d, %d, %d)\n", cmd.arg1, cmd.bookID, cmd.arg2);
+        break;
+    case OP_RETURN:
+        snprintf(line, sizeof(line), "ReturnBook(%d, %d)\n", cmd.arg1, cmd.bookID);
+        break;
+    case OP_DELETE:
+        snprintf(line, sizeof(line), "DeleteBook(%d)\n", cmd.bookID);
+        break;
+    case OP_RANGE:
+        snprintf(line, sizeof(line), "PrintBooks(%d, %d)\n", cmd.bookID, cmd.arg1);
+        break;
+    case OP_CLOSEST:
+        if (config.closestCount > 1)
+            snprintf(line, sizeof(line), "FindClosestBooks(%d, %d)\n", cmd.bookID, config.closestCount);
+        else
+            snprintf(line, sizeof(line), "FindClosestBook(%d)\n", cmd.bookID);
+        break;
+    default:
+        snprintf(line, sizeof(line), "PrintBook(%d)\n", cmd.bookID);
+        break;
+    }
+    return line;
+}
+
+// One connection to the daemon, sending commands and reading back NUL terminated responses.
+class ServerConnection {
+private:
+    int fd;
+    char buffer[1 << 16];
+
+public:
+    ServerConnection() : fd(-1) {}
+    ~ServerConnection() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool connect(const string &path) {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        return fd >= 0 && ::connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+    }
+
+    bool send(const string &text) {
+        for (size_t done = 0; done < text.size();) {
+            ssize_t n = ::send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    // Reading until count more responses have ended, calling onResponse as each one does.
+    template <typename OnResponse>
+    bool receive(long long count, OnResponse onResponse) {
+        while (count > 0) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            for (const char *p = buffer; (p = static_cast<const char*>(memchr(p, '\0', buffer + n - p))) != NULL; p++) {
+                onResponse();
+                count--;
+            }
+        }
+        return true;
+    }
+};
+
+// One client of the load generator: its share of --ops commands, sent --depth at a time. A command's latency
+// runs from sending the window that holds it to the end of its response. New books of different clients get
+// different IDs.
+static void runClient(const BenchConfig &config, int client, int clients, long long commands,
+                      LatencyHistogram &latencies, bool &failed) {
+    BenchConfig own = config;
+    own.seed = config.seed + 7919 * (client + 1);
+    WorkloadGenerator generator(own);
+    ServerConnection connection;
+    if (!connection.connect(config.socketPath)) {
+        failed = true;
+        return;
+    }
+    string window;
+    for (long long done = 0; done < commands;) {
+        long long n = min((long long)config.depth, commands - done);
+        window.clear();
+        for (long long i = 0; i < n; i++) {
+            BenchCommand cmd = generator.next();
+            if (cmd.op == OP_INSERT)
+                cmd.bookID = (int)(config.books + 1 + (cmd.bookID - config.books - 1) * clients + client);
+            window += formatCommand(cmd, config);
+        }
+        chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+        bool ok = connection.send(window) && connection.receive(n, [&]() {
+            latencies.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sent).count());
+        });
+        if (!ok) {
+            failed = true;
+            return;
+        }
+        done += n;
+    }
+}
+
+// Daemon load test: the catalog is bulk inserted over one connection, then for each --clients count the
+// --ops commands are split over that many connections running at once.
+static int runClientBenchmark(const BenchConfig &config) {
+    ServerConnection loader;
+    if (!loader.connect(config.socketPath)) {
+        cout << "Cannot connect to " << config.socketPath << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string batch = "BulkInsertBegin()\n";
+    for (long long id = 1; id <= config.books; id++) {
+        BenchCommand cmd = {OP_INSERT, (int)id, 0, 0};
+        batch += formatCommand(cmd, config);
+    }
+    batch += "BulkInsertEnd()\n";
+    if (!loader.send(batch) || !loader.receive(config.books + 2, []() {})) {
+        cout << "Preloading the catalog failed" << endl;
+        return 1;
+    }
+    printf("catalog            %lld books, preloaded in %.3f s\n", config.books, elapsedSeconds(start));
+    printf("hardware threads   %u\n\n", thread::hardware_concurrency());
+
+    printf("%-8s %6s %12s %10s %10s %10s %10s\n", "clients", "depth", "ops/sec", "p50 us", "p99 us", "p999 us", "max us");
+    for (size_t run = 0; run < config.clientCounts.size(); run++) {
+        int clients = config.clientCounts[run];
+        vector<LatencyHistogram> latencies(clients);
+        vector<char> failures(clients, 0);
+        vector<thread> threads;
+        start = chrono::steady_clock::now();
+        for (int c = 0; c < clients; c++) {
+            long long share = config.ops / clients + (c < config.ops % clients ? 1 : 0);
+            threads.push_back(thread([&, c, share]() {
+                bool failed = false;
+                runClient(config, c, clients, share, latencies[c], failed);
+                failures[c] = failed;
+            }));
+        }
+        for (int c = 0; c < clients; c++)
+            threads[c].join();
+        double seconds = elapsedSeconds(start);
+        LatencyHistogram all;
+        for (int c = 0; c < clients; c++) {
+            if (failures[c]) {
+                cout << "Client " << c << " lost its connection" << endl;
+                return 1;
+            }
+            all.merge(latencies[c]);
+        }
+        printf("%-8d %6d %12.0f %10.1f %10.1f %10.1f %10.1f\n", clients, config.depth, config.ops / seconds,
+               all.percentile(0.50) / 1000.0, all.percentile(0.99) / 1000.0, all.percentile(0.999) / 1000.0,
+               all.percentile(1.0) / 1000.0);
+    }
+    return 0;
+}
+
+// Removing a log directory left by an earlier level or run.
+static void removeLogDirectory(const string &directory) {
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL)
+        return;
+    while (struct dirent *entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            unlink((directory + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    rmdir(directory.c_str());
+}
+
+// Durability levels: for each --sync level the catalog is bulk inserted and checkpointed into an empty log
+// directory, then the --ops commands are formatted, parsed and run through a CommandExecutor logging to it,
+// as `gatorLibrary --wal` runs an input file. "off" runs without a log. Closing the log, which writes and
+// syncs whatever is still pending, counts towards the measured time.
+static int runDurabilityBenchmark(const BenchConfig &config, OutputBuffer &out) {
+    if (mkdir(config.logDirectory.c_str(), 0755) != 0 && errno != EEXIST) {
+        cout << "Cannot create " << config.logDirectory << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    printf("catalog            %lld books\n", config.books);
+    printf("commands           %lld per level\n\n", config.ops);
+    printf("%-16s %12s %10s %10s %10s %10s %10s\n", "durability", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "max ns",
+           "fsyncs");
+    for (size_t level = 0; level < config.syncLevels.size(); level++) {
+        const string &name = config.syncLevels[level];
+        bool logging = name != "off";
+        WriteAheadLog::SyncPolicy policy = WriteAheadLog::SYNC_GROUP;
+        size_t groupOps = 64;
+        long long groupMicros = 100;
+        WriteAheadLog::parsePolicy(name, policy, groupOps, groupMicros);
+        string directory = config.logDirectory + "/level" + to_string(level);
+        removeLogDirectory(directory);
+
+        Library library(config.engine);
+        WriteAheadLog log(library, directory, policy, groupOps, groupMicros);
+        string error;
+        if (logging && !log.open(error)) {
+            cout << "Cannot open the log in " << directory << ": " << error << endl;
+            return 1;
+        }
+        vector<BookRecord> records;
+        records.reserve(config.books);
+        for (long long id = 1; id <= config.books; id++)
+            records.push_back(BookRecord((int)id, "\"Title\"", "\"Author\"", true, -1));
+        vector<int> duplicates;
+        library.bulkInsert(records, duplicates);
+        vector<BookRecord>().swap(records);
+        if (logging && !log.checkpoint(error)) {
+            cout << "Cannot checkpoint the catalog: " << error << endl;
+            return 1;
+        }
+
+        uint64_t preloadSyncs = log.syncCount();
+        CommandExecutor executor(library, out);
+        if (logging)
+            executor.logTo(&log, 0);
+        WorkloadGenerator generator(config);
+        CommandScanner scanner;
+        LatencyHistogram latencies;
+        string lines;
+        vector<size_t> lineEnds;
+        const long long CHUNK = 1 << 16;
+        double seconds = 0;
+        for (long long done = 0; done < config.ops; done += CHUNK) {
+            long long n = min(CHUNK, config.ops - done);
+            lines.clear();
+            lineEnds.clear();
+            for (long long i = 0; i < n; i++) {
+                lines += formatCommand(generator.next(), config);
+                lineEnds.push_back(lines.size() - 1);
+            }
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            chrono::steady_clock::time_point before = start;
+            const char *line = lines.data();
+            for (size_t i = 0; i < lineEnds.size(); i++) {
+                const char *lineEnd = lines.data() + lineEnds[i];
+                executor.execute(scanner.parse(line, lineEnd));
+                chrono::steady_clock::time_point after = chrono::steady_clock::now();
+                latencies.record(chrono::duration_cast<chrono::nanoseconds>(after - before).count());
+                before = after;
+                line = lineEnd + 1;
+            }
+            seconds += elapsedSeconds(start);
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        executor.finish();
+        if (logging && !log.close(error)) {
+            cout << "Writing the log failed: " << error << endl;
+            return 1;
+        }
+        seconds += elapsedSeconds(start);
+        printf("%-16s %12.0f %10llu %10llu %10llu %10llu %10llu\n", name.c_str(), seconds > 0 ? config.ops / seconds : 0.0,
+               latencies.percentile(0.50), latencies.percentile(0.99), latencies.percentile(0.999),
+               latencies.percentile(1.0), (unsigned long long)(log.syncCount() - preloadSyncs));
+        removeLogDirectory(directory);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (config.heapOps > 0) {
+        runHeapBenchmark(config);
+        return 0;
+    }
+    if (config.treeOps > 0) {
+        runTreeBenchmarks(config);
+        return 0;
+    }
+    if (config.batchOps > 0) {
+        runBatchBenchmarks(config);
+        return 0;
+    }
+    if (!config.socketPath.empty())
+        return runClientBenchmark(config);
+    OutputBuffer out;
+    if (!out.open(config.outputPath)) {
+        cout << "Error opening file: " << config.outputPath << endl;
+        return 1;
+    }
+    if (!config.logDirectory.empty())
+        return runDurabilityBenchmark(config, out);
+
+    Library library(config.engine);
+
+    // Preloading the catalog, in shuffled order unless the run is sequential.
+    vector<int> ids(config.books);
+    for (long long i = 0; i < config.books; i++) {
+        ids[i] = (int)i + 1;
+    }
+    if (config.dist != DIST_SEQUENTIAL) {
+        mt19937_64 shuffleRng(config.seed ^ 0x5bd1e995);
+        shuffle(ids.begin(), ids.end(), shuffleRng);
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (config.bulkPreload) {
+        vector<BookRecord> records;
+        records.reserve(ids.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (config.searchOps > 0)
+                records.push_back(BookRecord(ids[i], catalogTitle(ids[i]), catalogAuthor(ids[i], config.books), true, -1));
+            else
+                records.push_back(BookRecord(ids[i], "\"Title\"", "\"Author\"", true, -1));
+        }
+        vector<int> duplicates;
+        library.bulkInsert(records, duplicates);
+    } else {
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (config.searchOps > 0)
+                library.insertBook(ids[i], catalogTitle(ids[i]), catalogAuthor(ids[i], config.books), true, -1);
+            else
+                library.insertBook(ids[i], "\"Title\"", "\"Author\"", true, -1);
+        }
+    }
+    double preloadSeconds = elapsedSeconds(start);
+    vector<int>().swap(ids);
+    if (!config.readerCounts.empty()) {
+        printf("catalog            %lld books, preloaded in %.3f s\n", config.books, preloadSeconds);
+        printf("hardware threads   %u\n\n", thread::hardware_concurrency());
+        runReaderBenchmark(library, config, out);
+        return 0;
+    }
+    if (config.frozenOps > 0) {
+        printf("catalog            %lld books, preloaded in %.3f s\n", config.books, preloadSeconds);
+        runFrozenBenchmark(library, config, out);
+        return 0;
+    }
+
+    // Generating commands in chunks so the stream itself never dominates memory.
+    WorkloadGenerator generator(config);
+    LatencyHistogram histograms[OP_COUNT];
+    vector<BenchCommand> chunk;
+    const long long CHUNK = 1 << 16;
+    double runSeconds = 0;
+    for (long long done = 0; done < config.ops; done += CHUNK) {
+        long long n = min(CHUNK, config.ops - done);
+        chunk.clear();
+        for (long long i = 0; i < n; i++) {
+            chunk.push_back(generator.next());
+        }
+        start = chrono::steady_clock::now();
+        chrono::steady_clock::time_point before = start;
+        for (size_t i = 0; i < chunk.size(); i++) {
+            execute(library, chunk[i], config, out);
+            chrono::steady_clock::time_point after = chrono::steady_clock::now();
+            histograms[chunk[i].op].record(chrono::duration_cast<chrono::nanoseconds>(after - before).count());
+            before = after;
+        }
+        runSeconds += elapsedSeconds(start);
+    }
+
+    // Catalog searches: a title prefix of the first two words, which only a few books share, and the full
+    // name of an author.
+    LatencyHistogram titleSearches, authorSearches;
+    mt19937_64 searchRng(config.seed ^ 0x2545F491);
+    for (long long i = 0; i < config.searchOps; i++) {
+        int id = (int)(searchRng() % config.books) + 1;
+        string title = catalogTitle(id);
+        string titlePrefix = title.substr(1, title.find(' ', title.find(' ') + 1));
+        string author = catalogAuthor(id, config.books);
+        string authorPrefix = author.substr(1, author.size() - 2);
+        chrono::steady_clock::time_point before = chrono::steady_clock::now();
+        library.searchTitle(StringRef(titlePrefix.data(), titlePrefix.size()), out);
+        chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+        library.searchAuthor(StringRef(authorPrefix.data(), authorPrefix.size()), out);
+        chrono::steady_clock::time_point after = chrono::steady_clock::now();
+        titleSearches.record(chrono::duration_cast<chrono::nanoseconds>(middle - before).count());
+        authorSearches.record(chrono::duration_cast<chrono::nanoseconds>(after - middle).count());
+    }
+    out.close();
+
+    const char *distNames[] = {"uniform", "sequential", "zipf"};
+    AllocatorStats alloc = library.allocatorStats();
+    printf("catalog            %lld books (%s)\n", config.books, distNames[config.dist]);
+    printf("preload            %.3f s (%.0f inserts/sec)\n", preloadSeconds, config.books / preloadSeconds);
+    printf("commands           %lld in %.3f s\n", config.ops, runSeconds);
+    printf("throughput         %.0f ops/sec\n", runSeconds > 0 ? config.ops / runSeconds : 0.0);
+    printf("tree height        %d\n", library.height());
+    printf("live allocations   %zu (%zu bytes in %zu slabs)\n", alloc.liveNodes, alloc.bytesReserved, alloc.slabs);
+    printf("patron index       %zu active patrons (%zu bytes)\n", library.activePatrons(), library.patronIndexBytes());
+    printf("search index       %zu titles, %zu authors (%zu bytes)\n", library.indexedTitles(), library.distinctAuthors(),
+           library.searchIndexBytes());
+    printf("book cache         %lld hits in %lld lookups (%.1f%%)\n", library.cacheHits(), library.cacheLookups(),
+           library.cacheLookups() > 0 ? 100.0 * library.cacheHits() / library.cacheLookups() : 0.0);
+    printf("peak RSS           %ld KB\n\n", peakRSSKilobytes());
+
+    printf("%-16s %12s %10s %10s %10s %10s\n", "operation", "count", "p50 ns", "p99 ns", "p999 ns", "max ns");
+    LatencyHistogram all;
+    for (int op = 0; op < OP_COUNT; op++) {
+        all.merge(histograms[op]);
+        if (histograms[op].count() == 0)
+            continue;
+        printf("%-16s %12llu %10llu %10llu %10llu %10llu\n", OP_NAMES[op], histograms[op].count(),
+               histograms[op].percentile(0.50), histograms[op].percentile(0.99),
+               histograms[op].percentile(0.999), histograms[op].percentile(1.0));
+    }
+    printf("%-16s %12llu %10llu %10llu %10llu %10llu\n", "all", all.count(), all.percentile(0.50),
+           all.percentile(0.99), all.percentile(0.999), all.percentile(1.0));
+    const LatencyHistogram *searches[2] = {&titleSearches, &authorSearches};
+    const char *searchNames[2] = {"SearchTitle", "SearchAuthor"};
+    for (int i = 0; i < 2 && config.searchOps > 0; i++) {
+        printf("%-16s %12llu %10llu %10llu %10llu %10llu\n", searchNames[i], searches[i]->count(),
+               searches[i]->percentile(0.50), searches[i]->percentile(0.99), searches[i]->percentile(0.999),
+               searches[i]->percentile(1.0));
+    }
+    return 0;
+}